@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+// Reports how much the approximate cap (see approx_quantile in fix_terms.hpp)
+// changes the divergences, compared to the exact one, on synthetic bags. It
+// only differs from the exact cap for bags of more than APPROX_CAP_SAMPLES
+// points, so use at least that many.
+
+#include "np-divs/np_divs.hpp"
+#include "np-divs/matrix_arrays.hpp"
+#include "np-divs/div-funcs/from_str.hpp"
+#include "bench/synthetic.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+using namespace npdivs;
+using namespace std;
+namespace po = boost::program_options;
+
+int main(int argc, char ** argv) {
+    size_t num_bags, points, dim, num_threads;
+    int k;
+    string kind;
+    vector<string> specs;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce this help message.")
+        ("kind", po::value<string>(&kind)->default_value("gaussian"),
+            "Kind of bags: gaussian or mixture.")
+        ("bags,n", po::value<size_t>(&num_bags)->default_value(4),
+            "Number of bags.")
+        ("points,p", po::value<size_t>(&points)->default_value(100000),
+            "Number of points in each bag.")
+        ("dim,d", po::value<size_t>(&dim)->default_value(2),
+            "Dimension of the points.")
+        ("div-func,f", po::value< vector<string> >(&specs)->composing(),
+            "Divergence functions to compare, without a cap mode; can be "
+            "given more than once. Default: l2, renyi:.9, hellinger, linear.")
+        ("k,k", po::value<int>(&k)->default_value(3),
+            "The k for k-nearest-neighbor.")
+        ("num-threads", po::value<size_t>(&num_threads)->default_value(0),
+            "Number of threads; 0 means one per core.")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        cout << desc << "\n";
+        return 1;
+    }
+    if (specs.empty()) {
+        specs.push_back("l2");
+        specs.push_back("renyi:.9");
+        specs.push_back("hellinger");
+        specs.push_back("linear");
+    }
+
+    // each function twice, exact then approximate, so that one run's
+    // neighbor searches do for both
+    boost::ptr_vector<DivFunc> div_funcs;
+    for (size_t i = 0; i < specs.size(); i++)
+        div_funcs.push_back(div_func_from_str(specs[i] + ":exact"));
+    for (size_t i = 0; i < specs.size(); i++)
+        div_funcs.push_back(div_func_from_str(specs[i] + ":approx"));
+    size_t num_df = specs.size();
+
+    SyntheticBags bags(kind, num_bags, points, points, dim);
+    flann::Matrix<double>* results =
+        alloc_matrix_array<double>(2 * num_df, num_bags, num_bags);
+
+    DivParams params(k, flann::KDTreeSingleIndexParams(),
+                     flann::SearchParams(-1), num_threads, 0);
+    np_divs(bags.bags(), num_bags, div_funcs, results, params);
+
+    cout << "# " << num_bags << " " << kind << " bags of " << points
+         << " points in " << dim << " dimensions, k = " << k << "\n"
+         << "# div func\tworst abs change\tworst rel change\texact value\n";
+    for (size_t df = 0; df < num_df; df++) {
+        double worst_abs = 0, worst_rel = 0, at = 0;
+        for (size_t i = 0; i < num_bags; i++) {
+            for (size_t j = 0; j < num_bags; j++) {
+                double exact = results[df][i][j];
+                double diff = fabs(results[num_df + df][i][j] - exact);
+                double rel = exact == 0 ? 0 : diff / fabs(exact);
+                worst_abs = max(worst_abs, diff);
+                if (rel >= worst_rel) {
+                    worst_rel = rel;
+                    at = exact;
+                }
+            }
+        }
+        cout << specs[df] << "\t" << worst_abs << "\t" << worst_rel
+             << "\t" << at << "\n";
+    }
+
+    free_matrix_array(results, 2 * num_df);
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+// Calibrates the "auto" index policy (index_policy.hpp): times building the
+// indices for two bags and searching each point of one in the other, for
+// each kind of index over a grid of bag sizes and dimensions, and suggests
+// the thresholds at which the policy should switch between them.
+
+#include "np-divs/bag_index.hpp"
+#include "np-divs/div_params.hpp"
+#include "np-divs/div_stats.hpp"
+#include "np-divs/index_policy.hpp"
+#include "np-divs/np_divs.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <flann/flann.hpp>
+
+using namespace npdivs;
+using namespace std;
+namespace po = boost::program_options;
+
+typedef flann::L2<float> Distance;
+
+// seconds to build indices on x and y and find the k nearest neighbors in y
+// of each point of x, as one pair of bags in np_divs would; the best of
+// repeats, each of which averages enough runs to get past the clock's noise
+double time_pair(const flann::Matrix<float> &x, const flann::Matrix<float> &y,
+                 const flann::IndexParams &index_params, int k,
+                 size_t repeats, double &sink)
+{
+    vector<int> idx_buf(x.rows * k);
+    vector<float> dist_buf(x.rows * k);
+    flann::Matrix<int> idx(&idx_buf[0], x.rows, k);
+    flann::Matrix<float> dists(&dist_buf[0], x.rows, k);
+    const flann::SearchParams search(flann::FLANN_CHECKS_UNLIMITED);
+    const size_t runs = max<size_t>(1, 8192 / (x.rows * x.cols));
+
+    double best = -1;
+    for (size_t r = 0; r < repeats; r++) {
+        double start = wall_clock();
+        for (size_t run = 0; run < runs; run++) {
+            boost::scoped_ptr<BagIndex<Distance> > x_index(
+                    build_bag_index<Distance>(x, index_params));
+            boost::scoped_ptr<BagIndex<Distance> > y_index(
+                    build_bag_index<Distance>(y, index_params));
+            y_index->knnSearchBag(*x_index, x, idx, dists, k, search);
+            sink += dists[x.rows / 2][k - 1];
+        }
+        double t = (wall_clock() - start) / runs;
+        if (best < 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    size_t repeats;
+    int k, trees;
+    vector<size_t> sizes, dims;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce this help message.")
+        ("size,n", po::value< vector<size_t> >(&sizes)->composing(),
+            "Points per bag to try; can be given more than once. "
+            "Default: 16 through 2048, doubling.")
+        ("dim,d", po::value< vector<size_t> >(&dims)->composing(),
+            "Dimensions to try; can be given more than once. "
+            "Default: 2 through 64, doubling.")
+        ("k,k", po::value<int>(&k)->default_value(3),
+            "Neighbors to find for each point.")
+        ("trees,t", po::value<int>(&trees)->default_value(4),
+            "Trees in the kd-forest.")
+        ("repeats,r", po::value<size_t>(&repeats)->default_value(3),
+            "Timings of each; the best one is reported.")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        cout << desc << "\n";
+        return 1;
+    }
+
+    if (sizes.empty())
+        for (size_t n = 16; n <= 2048; n *= 2)
+            sizes.push_back(n);
+    if (dims.empty())
+        for (size_t d = 2; d <= 64; d *= 2)
+            dims.push_back(d);
+    sort(sizes.begin(), sizes.end());
+    sort(dims.begin(), dims.end());
+
+    enum { LINEAR, KDTREE, KDFOREST, GEMM, NUM_KINDS };
+    ostringstream forest;
+    forest << "kdforest:trees=" << trees;
+    const string kinds[NUM_KINDS] =
+        { "linear", "kdtree", forest.str(), "gemm" };
+    vector<flann::IndexParams> kind_params;
+    for (size_t e = 0; e < NUM_KINDS; e++)
+        kind_params.push_back(index_params_from_str(kinds[e]));
+
+    // times[di][si][e]
+    vector<vector<vector<double> > > times(dims.size(),
+            vector<vector<double> >(sizes.size(), vector<double>(NUM_KINDS)));
+
+    double sink = 0;
+    cout << "# k = " << k << ", " << kernel_isa_name(get_kernel_isa())
+         << " kernels\n"
+         << "# microseconds to build two bags' indices and search one in "
+         << "the other\n"
+         << "# dim\tsize";
+    for (size_t e = 0; e < NUM_KINDS; e++)
+        cout << "\t" << kinds[e];
+    cout << "\tfastest\n";
+
+    for (size_t di = 0; di < dims.size(); di++) {
+        for (size_t si = 0; si < sizes.size(); si++) {
+            const size_t dim = dims[di], size = sizes[si];
+
+            vector<float> pts(2 * size * dim);
+            boost::uint32_t state = 12345;
+            for (size_t i = 0; i < pts.size(); i++) {
+                state = state * 1664525u + 1013904223u;
+                pts[i] = state / 4294967296.0;
+            }
+            flann::Matrix<float> x(&pts[0], size, dim);
+            flann::Matrix<float> y(&pts[size * dim], size, dim);
+
+            cout << dim << "\t" << size;
+            size_t fastest = 0;
+            for (size_t e = 0; e < NUM_KINDS; e++) {
+                double t = time_pair(x, y, kind_params[e], k, repeats, sink);
+                times[di][si][e] = t;
+                if (t < times[di][si][fastest])
+                    fastest = e;
+                cout << "\t" << setprecision(4) << t * 1e6;
+            }
+            cout << "\t" << kinds[fastest] << "\n";
+        }
+    }
+
+    // The exact indices' totals decide the thresholds; the kd-forest is
+    // approximate, so the policy only uses it when asked to.
+    //
+    // gemm_min_dim: the lowest dimension from which gemm beats the kd-tree
+    // and the scan at every dimension tried, summed over the bag sizes
+    size_t gemm_di = dims.size();
+    while (gemm_di > 0) {
+        double gemm = 0, other = 0;
+        for (size_t si = 0; si < sizes.size(); si++) {
+            gemm += times[gemm_di - 1][si][GEMM];
+            other += min(times[gemm_di - 1][si][LINEAR],
+                         times[gemm_di - 1][si][KDTREE]);
+        }
+        if (gemm > other)
+            break;
+        gemm_di--;
+    }
+
+    // gemm_max_rows: the largest size up to which gemm keeps beating the
+    // others, summed over the dimensions from gemm_min_dim up; 0 (no limit)
+    // if it's still ahead at the biggest size tried, or there's no gemm
+    size_t gemm_si = sizes.size();
+    for (size_t si = 0; si < sizes.size() && gemm_di < dims.size(); si++) {
+        double gemm = 0, other = 0;
+        for (size_t di = gemm_di; di < dims.size(); di++) {
+            gemm += times[di][si][GEMM];
+            other += min(times[di][si][LINEAR], times[di][si][KDTREE]);
+        }
+        if (gemm > other) {
+            gemm_si = si;
+            break;
+        }
+    }
+
+    // linear_max_rows: the largest size up to which the scan beats the
+    // kd-tree, summed over the dimensions below gemm_min_dim
+    size_t linear_si = 0;
+    for (; linear_si < sizes.size(); linear_si++) {
+        double linear = 0, kdtree = 0;
+        for (size_t di = 0; di < max<size_t>(gemm_di, 1); di++) {
+            linear += times[di][linear_si][LINEAR];
+            kdtree += times[di][linear_si][KDTREE];
+        }
+        if (linear > kdtree)
+            break;
+    }
+
+    const IndexPolicy defaults;
+    cout << "# suggested: auto:linear_max_rows="
+         << (linear_si == 0 ? 0 : sizes[linear_si - 1])
+         << ":gemm_min_dim="
+         << (gemm_di < dims.size() ? dims[gemm_di] : dims.back() + 1)
+         << ":gemm_max_rows="
+         << (gemm_si == sizes.size() ? 0
+             : gemm_si == 0 ? 1 : sizes[gemm_si - 1])
+         << "\n# defaults:  auto:linear_max_rows=" << defaults.linear_max_rows
+         << ":gemm_min_dim=" << defaults.gemm_min_dim
+         << ":gemm_max_rows=" << defaults.gemm_max_rows << "\n";
+
+    if (sink == 42) // never, but the compiler doesn't know that
+        cout << "";
+    return 0;
+}
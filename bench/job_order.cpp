@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+// Compares the pair stage's job orders: plain row-major against tiles of
+// various sizes, each with and without ordering by cost, on synthetic
+// Gaussian bags.
+
+#include "np-divs/np_divs.hpp"
+#include "np-divs/matrix_arrays.hpp"
+#include "np-divs/div-funcs/div_l2.hpp"
+#include "bench/synthetic.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/program_options.hpp>
+
+using namespace npdivs;
+using namespace std;
+namespace po = boost::program_options;
+
+int main(int argc, char ** argv) {
+    size_t num_bags, points, max_points, dim, num_threads, repeats;
+    vector<size_t> tiles;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce this help message.")
+        ("bags,n", po::value<size_t>(&num_bags)->default_value(2000),
+            "Number of bags.")
+        ("points,p", po::value<size_t>(&points)->default_value(100),
+            "Number of points in each bag.")
+        ("max-points,m", po::value<size_t>(&max_points)->default_value(0),
+            "If more than --points, bag sizes are uniform between the two "
+            "instead, to see how the orders handle uneven jobs.")
+        ("dim,d", po::value<size_t>(&dim)->default_value(5),
+            "Dimension of the points.")
+        ("num-threads", po::value<size_t>(&num_threads)->default_value(0),
+            "Number of threads; 0 means one per core.")
+        ("tile,t", po::value< vector<size_t> >(&tiles)->composing(),
+            "Tile sizes to try; can be given more than once. 1 is the plain "
+            "row-major order, 0 is the automatic choice. Default: 1 and 0.")
+        ("repeats,r", po::value<size_t>(&repeats)->default_value(3),
+            "Runs of each order; the best time is reported.")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        cout << desc << "\n";
+        return 1;
+    }
+    if (tiles.empty()) {
+        tiles.push_back(1);
+        tiles.push_back(0);
+    }
+
+    SyntheticBags bags("gaussian", num_bags, points, max_points, dim);
+
+    boost::ptr_vector<DivFunc> div_funcs;
+    div_funcs.push_back(new DivL2());
+    flann::Matrix<double>* results =
+        alloc_matrix_array<double>(1, num_bags, num_bags);
+
+    DivParams params(3, flann::KDTreeSingleIndexParams(),
+                     flann::SearchParams(64), num_threads, 0);
+    params.thread_pool.reset(new ThreadPool(get_num_threads(num_threads)));
+
+    cout << "# " << num_bags << " bags of " << points;
+    if (max_points > points)
+        cout << "-" << max_points;
+    cout << " points in "
+         << dim << " dimensions, " << params.thread_pool->size()
+         << " threads\n"
+         << "# times include building the indices, but with many bags "
+         << "they're mostly the pair stage\n"
+         << "# tile\tby cost\tseconds\n";
+
+    for (size_t run = 0; run < 2 * tiles.size(); run++) {
+        size_t t = run / 2;
+        params.tile_size = tiles[t];
+        params.cost_order = run % 2 == 1;
+
+        double best = -1;
+        for (size_t r = 0; r < repeats; r++) {
+            boost::posix_time::ptime start =
+                boost::posix_time::microsec_clock::local_time();
+            np_divs(bags.bags(), num_bags, div_funcs, results, params);
+            double secs = (boost::posix_time::microsec_clock::local_time()
+                           - start).total_microseconds() / 1e6;
+            if (best < 0 || secs < best)
+                best = secs;
+        }
+
+        cout << tiles[t] << (tiles[t] == 0 ? " (auto)" : "")
+             << "\t" << (params.cost_order ? "yes" : "no")
+             << "\t" << best << "\n";
+    }
+
+    free_matrix_array(results, 1);
+    return 0;
+}
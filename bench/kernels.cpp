@@ -0,0 +1,160 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+// Throughput of the DivFunc kernels, in nanoseconds per element, for each
+// instruction set this CPU supports.
+
+#include "np-divs/kernels.hpp"
+#include "np-divs/div_stats.hpp"
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/program_options.hpp>
+
+using namespace npdivs;
+using namespace std;
+namespace po = boost::program_options;
+
+// what we time: runs one kernel over the buffers, returning something that
+// depends on the output so that it can't be optimized away
+struct KernelRun {
+    string name;
+    const vector<float> &a;
+    const vector<float> &b;
+    vector<float> &out_f;
+    vector<double> &out_d;
+    const vector<double> &logs;
+
+    KernelRun(const string &name, const vector<float> &a,
+              const vector<float> &b, vector<float> &out_f,
+              vector<double> &out_d, const vector<double> &logs)
+        : name(name), a(a), b(b), out_f(out_f), out_d(out_d), logs(logs)
+    { }
+
+    double operator()() {
+        size_t n = a.size();
+        if (name == "divide") {
+            divide_floats(&a[0], &b[0], n, &out_f[0]);
+            return out_f[n / 2];
+        } else if (name == "log") {
+            log_floats(&a[0], n, &out_d[0]);
+            return out_d[n / 2];
+        } else if (name == "pow") {
+            pow_floats(&a[0], n, -5., .4, &out_d[0]);
+            return out_d[n / 2];
+        } else if (name == "sum_exp") {
+            return sum_exp_as_floats(&logs[0], n, .7);
+        } else {
+            return sum_doubles(&logs[0], n);
+        }
+    }
+};
+
+int main(int argc, char ** argv) {
+    size_t size, repeats;
+    vector<string> isa_names;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce this help message.")
+        ("size,n", po::value<size_t>(&size)->default_value(4096),
+            "Number of elements in each call; something like a bag size.")
+        ("repeats,r", po::value<size_t>(&repeats)->default_value(20000),
+            "Calls to time for each kernel.")
+        ("isa,i", po::value< vector<string> >(&isa_names)->composing(),
+            "Instruction sets to try (scalar, avx2, avx512); can be given "
+            "more than once. Default: all the supported ones.")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        cout << desc << "\n";
+        return 1;
+    }
+
+    vector<KernelISA> isas;
+    if (isa_names.empty()) {
+        for (int isa = KERNELS_SCALAR; isa <= KERNELS_AVX512; isa++)
+            if (kernel_isa_supported((KernelISA) isa))
+                isas.push_back((KernelISA) isa);
+    } else {
+        for (size_t i = 0; i < isa_names.size(); i++)
+            isas.push_back(kernel_isa_from_str(isa_names[i]));
+    }
+
+    // ratios of kth-neighbor distances are all around 1
+    vector<float> a(size), b(size), out_f(size);
+    vector<double> out_d(size), logs(size);
+    boost::uint32_t state = 12345;
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1664525u + 1013904223u;
+        a[i] = .1 + state / 4294967296.0;
+        state = state * 1664525u + 1013904223u;
+        b[i] = .1 + state / 4294967296.0;
+        logs[i] = log(a[i] / b[i]);
+    }
+
+    const char *kernels[] = { "divide", "log", "pow", "sum_exp", "sum" };
+    const size_t num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    cout << "# " << size << " elements per call, " << repeats << " calls\n"
+         << "# kernel\tisa\tns/element\tspeedup\n";
+    for (size_t k = 0; k < num_kernels; k++) {
+        KernelRun run(kernels[k], a, b, out_f, out_d, logs);
+        double first = -1;
+        double sink = 0;
+
+        for (size_t i = 0; i < isas.size(); i++) {
+            set_kernel_isa(isas[i]);
+            sink += run(); // warm up
+
+            double start = wall_clock();
+            for (size_t r = 0; r < repeats; r++)
+                sink += run();
+            double ns = (wall_clock() - start) * 1e9 / (repeats * size);
+            if (first < 0)
+                first = ns;
+
+            cout << kernels[k] << "\t" << kernel_isa_name(isas[i])
+                 << "\t" << setprecision(3) << ns
+                 << "\t" << first / ns << "\n";
+        }
+        if (sink == 42) // never, but the compiler doesn't know that
+            cout << "";
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+
+// Time to find every point's k nearest neighbors in another bag with each of
+// the search engines (per-point searches of flann's linear and single
+// kd-tree indices, gemm, and the dual-tree search), over a range of
+// dimensions.
+
+#include "np-divs/bag_index.hpp"
+#include "np-divs/div_params.hpp"
+#include "np-divs/div_stats.hpp"
+#include "np-divs/np_divs.hpp"
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <flann/flann.hpp>
+
+using namespace npdivs;
+using namespace std;
+namespace po = boost::program_options;
+
+typedef flann::L2<float> Distance;
+
+// seconds to search index for every point of queries, the bag query_index
+// was built on; the best of repeats
+double time_search(const BagIndex<Distance> &index,
+                   const BagIndex<Distance> &query_index,
+                   const flann::Matrix<float> &queries, int k,
+                   size_t repeats, double &sink)
+{
+    vector<int> idx_buf(queries.rows * k);
+    vector<float> dist_buf(queries.rows * k);
+    flann::Matrix<int> idx(&idx_buf[0], queries.rows, k);
+    flann::Matrix<float> dists(&dist_buf[0], queries.rows, k);
+
+    double best = -1;
+    for (size_t r = 0; r < repeats; r++) {
+        double start = wall_clock();
+        index.knnSearchBag(query_index, queries, idx, dists, k,
+                           flann::SearchParams(flann::FLANN_CHECKS_UNLIMITED));
+        double t = wall_clock() - start;
+        if (best < 0 || t < best)
+            best = t;
+        sink += dists[queries.rows / 2][k - 1];
+    }
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    size_t size, repeats;
+    int k;
+    vector<size_t> dims;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce this help message.")
+        ("size,n", po::value<size_t>(&size)->default_value(2000),
+            "Points in each of the two bags.")
+        ("k,k", po::value<int>(&k)->default_value(3),
+            "Neighbors to find for each point.")
+        ("dim,d", po::value< vector<size_t> >(&dims)->composing(),
+            "Dimensions to try; can be given more than once. "
+            "Default: 2 through 512, doubling.")
+        ("repeats,r", po::value<size_t>(&repeats)->default_value(3),
+            "Searches to time for each; the best one is reported.")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        cout << desc << "\n";
+        return 1;
+    }
+
+    if (dims.empty())
+        for (size_t d = 2; d <= 512; d *= 2)
+            dims.push_back(d);
+
+    DivParams dual_params;
+    dual_params.search_strategy = SEARCH_DUAL_TREE;
+
+    const char *engines[] = { "linear", "kdtree", "gemm", "dual-tree" };
+    const size_t num_engines = sizeof(engines) / sizeof(engines[0]);
+    vector<flann::IndexParams> engine_params;
+    for (size_t e = 0; e + 1 < num_engines; e++)
+        engine_params.push_back(index_params_from_str(engines[e]));
+    engine_params.push_back(dual_params.get_index_params());
+
+    double sink = 0;
+    cout << "# " << size << " points per bag, k = " << k << ", "
+         << kernel_isa_name(get_kernel_isa()) << " kernels\n"
+         << "# milliseconds for all of one bag's searches in the other\n"
+         << "# dim";
+    for (size_t e = 0; e < num_engines; e++)
+        cout << "\t" << engines[e];
+    cout << "\n";
+
+    for (size_t di = 0; di < dims.size(); di++) {
+        const size_t dim = dims[di];
+
+        vector<float> pts(2 * size * dim);
+        boost::uint32_t state = 12345;
+        for (size_t i = 0; i < pts.size(); i++) {
+            state = state * 1664525u + 1013904223u;
+            pts[i] = state / 4294967296.0;
+        }
+        flann::Matrix<float> x(&pts[0], size, dim);
+        flann::Matrix<float> y(&pts[size * dim], size, dim);
+
+        cout << dim;
+        for (size_t e = 0; e < num_engines; e++) {
+            boost::scoped_ptr<BagIndex<Distance> > x_index(
+                    build_bag_index<Distance>(x, engine_params[e]));
+            boost::scoped_ptr<BagIndex<Distance> > y_index(
+                    build_bag_index<Distance>(y, engine_params[e]));
+
+            double t = time_search(*y_index, *x_index, x, k, repeats, sink);
+            cout << "\t" << setprecision(4) << t * 1e3;
+        }
+        cout << "\n";
+    }
+    if (sink == 42) // never, but the compiler doesn't know that
+        cout << "";
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+// Times np_divs on synthetic bags, phase by phase, and writes the results as
+// JSON or CSV so that runs can be compared across changes.
+
+#include "np-divs/np_divs.hpp"
+#include "np-divs/matrix_arrays.hpp"
+#include "np-divs/div-funcs/div_func.hpp"
+#include "np-divs/div-funcs/from_str.hpp"
+#include "bench/synthetic.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/utility.hpp>
+
+using namespace npdivs;
+using namespace std;
+namespace po = boost::program_options;
+
+struct BenchOpts : boost::noncopyable {
+    string kind;
+    size_t components;
+    size_t num_bags;
+    size_t points, max_points;
+    size_t dim;
+    int k;
+    string index;
+    size_t num_threads;
+    vector<string> div_func_specs;
+    size_t repeats;
+    unsigned int seed;
+    string format;
+    string output;
+};
+
+bool parse_args(int argc, char ** argv, BenchOpts& opts);
+
+DivStats run_once(const SyntheticBags &bags,
+                  const boost::ptr_vector<DivFunc> &div_funcs,
+                  flann::Matrix<double> *results,
+                  DivParams params)
+{
+    DivStats stats;
+    params.stats = &stats;
+    np_divs(bags.bags(), bags.size(), div_funcs, results, params);
+    return stats;
+}
+
+void write_csv(ostream &out, const BenchOpts &opts, size_t threads,
+               const vector<DivStats> &runs)
+{
+    string div_funcs;
+    for (size_t i = 0; i < opts.div_func_specs.size(); i++)
+        div_funcs += (i ? " " : "") + opts.div_func_specs[i];
+
+    out << "kind,components,bags,min_points,max_points,dim,k,index,threads,"
+           "div_funcs,repeat,index_s,rhos_s,pairs_s,total_s,search_s,"
+           "div_func_s\n";
+    for (size_t r = 0; r < runs.size(); r++) {
+        out << opts.kind << "," << opts.components << "," << opts.num_bags
+            << "," << opts.points << "," << max(opts.points, opts.max_points)
+            << "," << opts.dim << "," << opts.k << "," << opts.index
+            << "," << threads << "," << div_funcs << "," << r
+            << "," << runs[r].indices.wall_seconds
+            << "," << runs[r].rhos.wall_seconds
+            << "," << runs[r].pairs.wall_seconds
+            << "," << runs[r].total.wall_seconds
+            << "," << runs[r].search_seconds
+            << "," << runs[r].div_func_seconds << "\n";
+    }
+}
+
+void write_json(ostream &out, const BenchOpts &opts, size_t threads,
+                const vector<DivStats> &runs)
+{
+    // none of these strings can have quotes or backslashes in them
+    out << "{\n  \"config\": {"
+        << "\"kind\": \"" << opts.kind << "\", "
+        << "\"components\": " << opts.components << ", "
+        << "\"bags\": " << opts.num_bags << ", "
+        << "\"min_points\": " << opts.points << ", "
+        << "\"max_points\": " << max(opts.points, opts.max_points) << ", "
+        << "\"dim\": " << opts.dim << ", "
+        << "\"k\": " << opts.k << ", "
+        << "\"index\": \"" << opts.index << "\", "
+        << "\"threads\": " << threads << ", "
+        << "\"div_funcs\": [";
+    for (size_t i = 0; i < opts.div_func_specs.size(); i++)
+        out << (i ? ", " : "") << "\"" << opts.div_func_specs[i] << "\"";
+    out << "]},\n  \"runs\": [";
+    for (size_t r = 0; r < runs.size(); r++) {
+        out << (r ? ",\n" : "\n")
+            << "    {\"index_s\": " << runs[r].indices.wall_seconds
+            << ", \"rhos_s\": " << runs[r].rhos.wall_seconds
+            << ", \"pairs_s\": " << runs[r].pairs.wall_seconds
+            << ", \"total_s\": " << runs[r].total.wall_seconds
+            << ", \"search_s\": " << runs[r].search_seconds
+            << ", \"div_func_s\": " << runs[r].div_func_seconds << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char ** argv) {
+    try {
+        BenchOpts opts;
+        if (!parse_args(argc, argv, opts))
+            return 1;
+        if (opts.div_func_specs.empty())
+            opts.div_func_specs.push_back("l2");
+        if (opts.kind == "gaussian")
+            opts.components = 1;
+
+        boost::ptr_vector<DivFunc> div_funcs;
+        for (size_t i = 0; i < opts.div_func_specs.size(); i++)
+            div_funcs_from_str(opts.div_func_specs[i], div_funcs);
+
+        SyntheticBags bags(opts.kind, opts.num_bags, opts.points,
+                           opts.max_points, opts.dim, opts.components,
+                           opts.seed);
+
+        DivParams params(opts.k, index_params_from_str(opts.index),
+                         flann::SearchParams(64), opts.num_threads, 0);
+        params.thread_pool.reset(new ThreadPool(opts.num_threads));
+        size_t threads = params.thread_pool->size();
+
+        size_t num_df = div_funcs.size();
+        flann::Matrix<double>* results =
+            alloc_matrix_array<double>(num_df, bags.size(), bags.size());
+
+        vector<DivStats> runs;
+        for (size_t r = 0; r < opts.repeats; r++)
+            runs.push_back(run_once(bags, div_funcs, results, params));
+
+        free_matrix_array(results, num_df);
+
+        ofstream ofs;
+        if (opts.output != "-")
+            ofs.open(opts.output.c_str());
+        ostream &out = opts.output == "-" ? cout : ofs;
+
+        if (opts.format == "csv")
+            write_csv(out, opts, threads, runs);
+        else
+            write_json(out, opts, threads, runs);
+
+    } catch (std::exception &e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+bool parse_args(int argc, char ** argv, BenchOpts& opts) {
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce this help message.")
+        ("kind",
+            po::value<string>(&opts.kind)->default_value("gaussian"),
+            "What kind of bags to make: gaussian or mixture.")
+        ("components",
+            po::value<size_t>(&opts.components)->default_value(3),
+            "Number of components for mixture bags.")
+        ("bags,n",
+            po::value<size_t>(&opts.num_bags)->default_value(500),
+            "Number of bags.")
+        ("points,p",
+            po::value<size_t>(&opts.points)->default_value(100),
+            "Number of points in each bag.")
+        ("max-points,m",
+            po::value<size_t>(&opts.max_points)->default_value(0),
+            "If more than --points, bag sizes are uniform between the two.")
+        ("dim,d",
+            po::value<size_t>(&opts.dim)->default_value(5),
+            "Dimension of the points.")
+        ("neighbors,k",
+            po::value<int>(&opts.k)->default_value(3),
+            "The k for k-nearest-neighbor calculations.")
+        ("index,i",
+            po::value<string>(&opts.index)->default_value("kdtree"),
+            "The nearest-neighbor index to use, as for npdivs.")
+        ("num-threads",
+            po::value<size_t>(&opts.num_threads)->default_value(0),
+            "Number of threads; 0 means one per core.")
+        ("div-func,f",
+            po::value< vector<string> >(&opts.div_func_specs)->composing(),
+            "Divergence functions to use, as for npdivs; can be given more "
+            "than once. Default: l2.")
+        ("repeats,r",
+            po::value<size_t>(&opts.repeats)->default_value(3),
+            "Number of timed runs.")
+        ("seed",
+            po::value<unsigned int>(&opts.seed)->default_value(0),
+            "Random seed for the bags.")
+        ("format",
+            po::value<string>(&opts.format)->default_value("json"),
+            "Output format: json or csv.")
+        ("output,o",
+            po::value<string>(&opts.output)->default_value("-"),
+            "Where to write the results; - means stdout.")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        cout << desc << "\n";
+        return false;
+    }
+    if (opts.format != "json" && opts.format != "csv") {
+        cerr << "Error: --format must be json or csv\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,119 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_BENCH_SYNTHETIC_HPP_
+#define NPDIVS_BENCH_SYNTHETIC_HPP_
+#include "np-divs/basics.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/normal_distribution.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/variate_generator.hpp>
+#include <boost/throw_exception.hpp>
+#include <boost/utility.hpp>
+
+#include <flann/util/matrix.h>
+
+namespace npdivs {
+
+class SyntheticBags : boost::noncopyable {
+    /* Random bags for benchmarking, from a fixed seed.
+     *
+     * "gaussian": each bag is from a unit-variance Gaussian whose mean is
+     * itself standard normal.
+     *
+     * "mixture": each bag is from an even mixture of `components` such
+     * Gaussians, with the means of each bag's components drawn separately.
+     *
+     * Bag sizes are uniform between min_points and max_points.
+     */
+
+    std::vector<double> data;
+    std::vector<flann::Matrix<double> > bag_matrices;
+
+    public:
+
+    SyntheticBags(const std::string &kind, size_t num_bags,
+                  size_t min_points, size_t max_points, size_t dim,
+                  size_t components = 3, unsigned int seed = 0)
+    {
+        if (kind == "gaussian")
+            components = 1;
+        else if (kind != "mixture")
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                        "unknown kind of synthetic bags: " + kind));
+        if (components < 1)
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                        "need at least one mixture component"));
+
+        boost::mt19937 rng(seed);
+        boost::variate_generator<boost::mt19937&,
+                                 boost::normal_distribution<> >
+            normal(rng, boost::normal_distribution<>());
+        boost::random::uniform_int_distribution<size_t> size_dist(
+                min_points, std::max(min_points, max_points));
+        boost::random::uniform_int_distribution<size_t> comp_dist(
+                0, components - 1);
+
+        std::vector<size_t> sizes(num_bags);
+        size_t total = 0;
+        for (size_t b = 0; b < num_bags; b++)
+            total += sizes[b] = size_dist(rng);
+
+        data.resize(total * dim);
+        bag_matrices.resize(num_bags);
+
+        std::vector<double> means(components * dim);
+        double *pt = data.empty() ? NULL : &data[0];
+        for (size_t b = 0; b < num_bags; b++) {
+            bag_matrices[b] = flann::Matrix<double>(pt, sizes[b], dim);
+
+            for (size_t m = 0; m < means.size(); m++)
+                means[m] = normal();
+
+            for (size_t p = 0; p < sizes[b]; p++) {
+                const double *mean = &means[comp_dist(rng) * dim];
+                for (size_t d = 0; d < dim; d++)
+                    *pt++ = mean[d] + normal();
+            }
+        }
+    }
+
+    size_t size() const { return bag_matrices.size(); }
+    const flann::Matrix<double> *bags() const { return &bag_matrices[0]; }
+};
+
+}
+#endif
@@ -1,4 +1,4 @@
-function [Ds] = NPDivs(x_bags, y_bags, div_funcs, options)
+function [Ds, stats] = NPDivs(x_bags, y_bags, div_funcs, options)
 % NPDivs Calculate nonparametric divergence estimates, using the MEX interface
 %        to the npdivs library.
 %
@@ -21,18 +21,56 @@ function [Ds] = NPDivs(x_bags, y_bags, div_funcs, options)
 %           Some support an argument specifying a divergence parameter:
 %           renyi:.99 means the Renyi-.99 divergence.
 %
+%           alpha and renyi can also sweep over alpha: 'renyi:.5..0.99:20'
+%           means 20 evenly-spaced alphas from .5 to .99, and gives one
+%           output matrix for each.
+%
+%           Any of them can end with ':approx' (e.g. 'l2:.99:approx') to cap
+%           large values at a percentile estimated from a sample, which is
+%           faster for bags of more than 20000 points, or ':exact' to never
+%           do so; by default it's done for bags of 100000 points or more.
+%
 %   options: a struct array with the following possible members:
 %         k: the k for k-nearest-neighbor. Default 3.
 %
-%         index: the nearest-neighbor index to use. Options are linear, kdtree. 
-%              Default is kdtree. Use linear for high-dimensional, relatively
-%              sparse data.
+%         ks: a vector of ks to use instead of k, all from one search for
+%              the largest. Ds is then a numel(ks) x numel(div_funcs) cell
+%              array, with Ds{i, j} for ks(i) and the j-th div func.
+%
+%         index: the nearest-neighbor index to use. Options are linear, kdtree,
+%              kdforest, kmeans, composite, autotuned, gemm, auto, with any
+%              arguments after the type, like 'kdforest:trees=8' or
+%              'kmeans:branching=32:iterations=5'. Default is kdtree. Use
+%              gemm (an exact search like linear, but faster) for
+%              high-dimensional, relatively sparse data. auto picks linear,
+%              kdtree or gemm for each bag from its size and dimension;
+%              its thresholds can be set like
+%              'auto:linear_max_rows=32:gemm_min_dim=8:gemm_max_rows=50000'.
+%
+%         search: how hard the approximate indices search, like
+%              'checks=128,eps=0.1'. Default is an unlimited number of
+%              checks, which is exact but slow for kdforest and kmeans.
+%
+%         search_strategy: how to find each point's neighbors in the other
+%              bag of a pair. 'points' (the default) searches index once for
+%              each point; 'dual-tree' walks trees on both bags together,
+%              which is exact and meant for low dimensions, and ignores
+%              index.
 %
 %         num_threads: the number of threads to use in calculation.
-%              0 (the default) means one per core.
+%              0 (the default) means one per core. The threads are kept
+%              around between calls with the same num_threads.
+%
+%         pin_threads: whether to bind each worker thread to a single CPU
+%              (Linux only). Default false.
 %
 %         show_progress: whether to show progress as computation occurs.
 %              Default: only if the size of each return matrix is > 5,000.
+%
+% If a second output is requested, it's a struct of timings (in seconds) for
+% each phase of the computation, counts of the nearest-neighbor searches, the
+% memory used for indices, rhos, and scratch space, and per-thread job
+% counts and busy/idle times.
 
 if nargin < 2; y_bags = []; end
 if nargin < 3; div_funcs = {'l2'}; end
@@ -64,5 +102,9 @@ if ~isfield(options, 'show_progress')
     options.show_progress = num_x * num_y > 5000;
 end
 
-Ds = npdivs_mex(x_bags, y_bags, options);
+if nargout > 1
+    [Ds, stats] = npdivs_mex(x_bags, y_bags, options);
+else
+    Ds = npdivs_mex(x_bags, y_bags, options);
+end
 end
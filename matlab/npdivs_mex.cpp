@@ -42,6 +42,7 @@
 #include <boost/exception/all.hpp>
 #include <boost/format.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <mex.h>
 
@@ -60,6 +61,7 @@ using std::string;
 using std::vector;
 
 using npdivs::DivParams;
+using npdivs::DivStats;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Helpers to convert from MATLAB to C++ types
@@ -263,17 +265,78 @@ mxArray *make_matrix(const flann::Matrix<T> bag) {
     return mat;
 }
 
-// make a MATLAB cell vector of matrices
+// make a MATLAB cell array of matrices, filled in column-major order
 template <typename T>
-mxArray *make_matrix_cells(const flann::Matrix<T> *bags, size_t n) {
-    mxArray *cells = mxCreateCellMatrix(1, n);
+mxArray *make_matrix_cells(const flann::Matrix<T> *bags,
+                           size_t rows, size_t cols) {
+    mxArray *cells = mxCreateCellMatrix(rows, cols);
 
-    for (size_t i = 0; i < n; i++)
+    for (size_t i = 0; i < rows * cols; i++)
         mxSetCell(cells, i, make_matrix(bags[i]));
 
     return cells;
 }
 
+// make a MATLAB cell vector of matrices
+template <typename T>
+mxArray *make_matrix_cells(const flann::Matrix<T> *bags, size_t n) {
+    return make_matrix_cells(bags, 1, n);
+}
+
+// make a MATLAB struct out of the timings and counts from a DivStats
+mxArray *make_phase_struct(const npdivs::PhaseStats &phase) {
+    const char *fields[] = { "wall_seconds", "cpu_seconds" };
+    mxArray *s = mxCreateStructMatrix(1, 1, 2, fields);
+    mxSetField(s, 0, "wall_seconds", mxCreateDoubleScalar(phase.wall_seconds));
+    mxSetField(s, 0, "cpu_seconds", mxCreateDoubleScalar(phase.cpu_seconds));
+    return s;
+}
+
+mxArray *make_stats_struct(const DivStats &stats) {
+    const char *fields[] = {
+        "indices", "rhos", "pairs", "total",
+        "knn_searches", "knn_queries", "points_searched",
+        "search_seconds", "div_func_seconds",
+        "index_bytes", "rho_bytes", "scratch_bytes",
+        "thread_jobs", "thread_busy_seconds", "thread_idle_seconds"
+    };
+    mxArray *s = mxCreateStructMatrix(1, 1, 15, fields);
+
+    mxSetField(s, 0, "indices", make_phase_struct(stats.indices));
+    mxSetField(s, 0, "rhos", make_phase_struct(stats.rhos));
+    mxSetField(s, 0, "pairs", make_phase_struct(stats.pairs));
+    mxSetField(s, 0, "total", make_phase_struct(stats.total));
+
+    mxSetField(s, 0, "knn_searches", mxCreateDoubleScalar(stats.knn_searches));
+    mxSetField(s, 0, "knn_queries", mxCreateDoubleScalar(stats.knn_queries));
+    mxSetField(s, 0, "points_searched",
+            mxCreateDoubleScalar(stats.points_searched));
+    mxSetField(s, 0, "search_seconds",
+            mxCreateDoubleScalar(stats.search_seconds));
+    mxSetField(s, 0, "div_func_seconds",
+            mxCreateDoubleScalar(stats.div_func_seconds));
+
+    mxSetField(s, 0, "index_bytes", mxCreateDoubleScalar(stats.index_bytes));
+    mxSetField(s, 0, "rho_bytes", mxCreateDoubleScalar(stats.rho_bytes));
+    mxSetField(s, 0, "scratch_bytes",
+            mxCreateDoubleScalar(stats.scratch_bytes));
+
+    size_t n = stats.threads.size();
+    mxArray *jobs = mxCreateDoubleMatrix(1, n, mxREAL);
+    mxArray *busy = mxCreateDoubleMatrix(1, n, mxREAL);
+    mxArray *idle = mxCreateDoubleMatrix(1, n, mxREAL);
+    for (size_t i = 0; i < n; i++) {
+        mxGetPr(jobs)[i] = stats.threads[i].jobs;
+        mxGetPr(busy)[i] = stats.threads[i].busy_seconds;
+        mxGetPr(idle)[i] = stats.threads[i].idle_seconds;
+    }
+    mxSetField(s, 0, "thread_jobs", jobs);
+    mxSetField(s, 0, "thread_busy_seconds", busy);
+    mxSetField(s, 0, "thread_idle_seconds", idle);
+
+    return s;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function to print a progress bar
 
@@ -300,15 +363,46 @@ class ProgressBar {
 ////////////////////////////////////////////////////////////////////////////////
 // Function to compute divergences
 
+////////////////////////////////////////////////////////////////////////////////
+// Thread pool that's kept around between calls, so that repeated calls don't
+// have to start up and tear down their threads every time
+
+boost::shared_ptr<npdivs::ThreadPool> thread_pool;
+
+void free_thread_pool() {
+    thread_pool.reset();
+}
+
+boost::shared_ptr<npdivs::ThreadPool> get_thread_pool(
+        size_t num_threads, bool pin_threads)
+{
+    npdivs::ThreadPool *pool = thread_pool.get();
+    if (pool == NULL
+            || pool->size() != npdivs::get_num_threads(num_threads)
+            || pool->pinned() != pin_threads)
+    {
+        thread_pool.reset(); // join the old threads before starting new ones
+        thread_pool.reset(new npdivs::ThreadPool(num_threads, pin_threads));
+        mexAtExit(&free_thread_pool);
+    }
+    return thread_pool;
+}
+
+
 struct DivOptions {
     vector<string> div_funcs;
     int k;
+    vector<int> ks;
     size_t num_threads;
+    bool pin_threads;
     string index_type;
+    string search;
+    string search_strategy;
     bool show_progress;
 
     DivOptions() :
-        k(3), num_threads(0), index_type("kdtree")
+        k(3), num_threads(0), pin_threads(false), index_type("kdtree"),
+        search_strategy("points")
     {}
 
     void parseOpt(string name, mxArray* val) {
@@ -328,13 +422,34 @@ struct DivOptions {
             if (k < 1)
                 mexErrMsgTxt("k must be a positive integer");
 
+        } else if (name == "ks") {
+            if (!mxIsDouble(val))
+                mexErrMsgTxt("ks must be a vector of positive integers");
+            mwSize nel = mxGetNumberOfElements(val);
+            for (mwSize i = 0; i < nel; i++) {
+                double v = mxGetPr(val)[i];
+                if (v < 1 || v != floor(v))
+                    mexErrMsgTxt("ks must be a vector of positive integers");
+                ks.push_back((int) v);
+            }
+
         } else if (name == "num_threads") {
             num_threads = get_size_t(val,
                     "num_threads must be a nonnegative integer");
 
+        } else if (name == "pin_threads") {
+            pin_threads = get_bool(val, "pin_threads must be a boolean");
+
         } else if (name == "index") {
             index_type = get_string(val, "index must be a string");
 
+        } else if (name == "search") {
+            search = get_string(val, "search must be a string");
+
+        } else if (name == "search_strategy") {
+            search_strategy = get_string(val,
+                    "search_strategy must be a string");
+
         } else if (name == "show_progress") {
             show_progress = get_bool(val, "show_progress must be a boolean");
 
@@ -344,21 +459,28 @@ struct DivOptions {
     }
 
     DivParams getDivParams(const ProgressBar &pbar) const {
-        flann::SearchParams search_params(-1);
+        flann::SearchParams search_params = npdivs::search_params_from_str(
+                search, flann::SearchParams(-1));
 
-        return DivParams(k,
+        DivParams params(k,
                 npdivs::index_params_from_str(index_type),
                 search_params,
                 num_threads,
                 show_progress ? 200 : 0,
                 boost::bind(&ProgressBar::update, pbar, _1));
+        params.ks = ks;
+        params.search_strategy =
+            npdivs::search_strategy_from_str(search_strategy);
+        params.thread_pool = get_thread_pool(num_threads, pin_threads);
+        return params;
     }
 };
 
 
 void do_divs(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
     if (nrhs != 3) mexErrMsgTxt("npdivs takes exactly three arguments");
-    if (nlhs != 1) mexErrMsgTxt("npdivs returns exactly 1 output");
+    if (nlhs != 1 && nlhs != 2)
+        mexErrMsgTxt("npdivs returns the divergences and optionally stats");
 
     const mxArray *x_bags_m = prhs[0];
     const mxArray *y_bags_m = prhs[1];
@@ -396,15 +518,15 @@ void do_divs(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
                       mxGetFieldByNumber(opts_m, 0, i));
     }
 
-    size_t num_df = opts.div_funcs.size();
-    if (num_df == 0) {
+    if (opts.div_funcs.size() == 0)
         opts.div_funcs.push_back("l2");
-        num_df = 1;
-    }
 
+    // sweeps like renyi:.5..0.99:20 give more than one div func
     boost::ptr_vector<npdivs::DivFunc> dfs;
-    for (size_t i = 0; i < num_df; i++)
-        dfs.push_back(npdivs::div_func_from_str(opts.div_funcs[i]));
+    for (size_t i = 0; i < opts.div_funcs.size(); i++)
+        npdivs::div_funcs_from_str(opts.div_funcs[i], dfs);
+    size_t num_ks = opts.ks.empty() ? 1 : opts.ks.size();
+    size_t num_df = dfs.size() * num_ks;
 
     // allocate space for results
     MatrixD *divs = matalloc_matrix_array<double>(num_df, num_x, num_y);
@@ -413,16 +535,25 @@ void do_divs(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
     // run it!
     ProgressBar pbar(y_bags == NULL ? (num_x+1) * num_x / 2 : num_x * num_y);
 
-    npdivs::np_divs(x_bags, num_x, y_bags, num_y,
-            dfs, divs, opts.getDivParams(pbar));
+    DivParams params = opts.getDivParams(pbar);
+    DivStats stats;
+    if (nlhs == 2)
+        params.stats = &stats;
+
+    npdivs::np_divs(x_bags, num_x, y_bags, num_y, dfs, divs, params);
 
     // copy into output
-    mxArray* divs_cell = make_matrix_cells(divs, num_df);
+    // with several ks, Ds{ki, df} is for ks(ki) and div_funcs{df}
+    mxArray* divs_cell = opts.ks.empty()
+        ? make_matrix_cells(divs, num_df)
+        : make_matrix_cells(divs, num_ks, dfs.size());
 
     // kill temp vars
     free_matalloced_matrix_array(divs, num_df);
 
     plhs[0] = divs_cell;
+    if (nlhs == 2)
+        plhs[1] = make_stats_struct(stats);
 }
 
 void mexFunction(int nlhs, mxArray **plhs, int nrhs, const mxArray **prhs) {
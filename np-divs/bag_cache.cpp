@@ -0,0 +1,172 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/bag_cache.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/atomic.hpp>
+#include <boost/format.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace npdivs {
+
+using std::string;
+
+boost::uint64_t hash_bytes(const void *data, size_t len, boost::uint64_t h) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+string index_params_to_str(const flann::IndexParams &index_params) {
+    // IndexParams is a std::map, so this is in a consistent order
+    std::ostringstream out;
+    flann::IndexParams::const_iterator it;
+    for (it = index_params.begin(); it != index_params.end(); ++it)
+        out << it->first << "=" << it->second << ";";
+    return out.str();
+}
+
+bool file_exists(const string &path) {
+    std::ifstream f(path.c_str());
+    return f.good();
+}
+
+namespace {
+// rho files are this, then the number of rows as a uint64, then the floats
+// (squared distances, since version 2)
+const char rho_magic[] = "NPDIVSRHO2";
+}
+
+BagCache::BagCache(const string &dir_,
+                   const flann::IndexParams &index_params,
+                   int k,
+                   const flann::SearchParams &search_params)
+    : dir(dir_)
+{
+    struct stat info;
+    if (stat(dir.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR))
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "cache directory '" + dir + "' doesn't exist"));
+
+    if (!dir.empty() && dir[dir.size() - 1] != '/')
+        dir += '/';
+
+    const string ips = index_params_to_str(index_params);
+    index_params_hash = hash_bytes(ips.data(), ips.size());
+
+    // approximate searches can give different rhos, so key on those too
+    this->k = k;
+    rho_suffix = (boost::format("-c%d-e%g.rhos")
+            % search_params.checks % search_params.eps).str();
+}
+
+string BagCache::index_path(const string &key) const {
+    return dir + key + ".index";
+}
+
+string BagCache::rho_path(const string &key, int k) const {
+    return (boost::format("%s%s-k%d%s")
+            % dir % key % (k ? k : this->k) % rho_suffix).str();
+}
+
+string BagCache::temp_path(const string &path) const {
+    static boost::atomic<unsigned long> counter(0);
+    return (boost::format("%s.tmp-%d-%d")
+            % path % getpid() % counter.fetch_add(1)).str();
+}
+
+void BagCache::move_into_place(const string &tmp, const string &path) const {
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        std::remove(tmp.c_str());
+}
+
+bool BagCache::load_rho(const string &key, size_t rows,
+                        std::vector<float> &rho, int k) const
+{
+    std::ifstream in(rho_path(key, k).c_str(), std::ios::binary);
+    if (!in)
+        return false;
+
+    char magic[sizeof(rho_magic)];
+    boost::uint64_t n;
+    in.read(magic, sizeof(magic));
+    in.read((char *) &n, sizeof(n));
+    if (!in || string(magic) != rho_magic || n != rows)
+        return false;
+
+    rho.resize(rows);
+    if (rows > 0)
+        in.read((char *) &rho[0], rows * sizeof(float));
+    return !in.fail();
+}
+
+void BagCache::save_rho(const string &key, const std::vector<float> &rho,
+                        int k) const
+{
+    const string path = rho_path(key, k);
+    const string tmp = temp_path(path);
+
+    boost::uint64_t n = rho.size();
+    bool ok;
+    {
+        std::ofstream out(tmp.c_str(), std::ios::binary);
+        out.write(rho_magic, sizeof(rho_magic));
+        out.write((const char *) &n, sizeof(n));
+        if (n > 0)
+            out.write((const char *) &rho[0], n * sizeof(float));
+        out.close();
+        ok = !out.fail();
+    }
+
+    if (ok)
+        move_into_place(tmp, path);
+    else
+        std::remove(tmp.c_str());
+}
+
+}
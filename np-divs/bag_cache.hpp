@@ -0,0 +1,161 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_BAG_CACHE_HPP_
+#define NPDIVS_BAG_CACHE_HPP_
+#include "np-divs/basics.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <flann/flann.hpp>
+
+namespace npdivs {
+
+boost::uint64_t hash_bytes(const void *data, size_t len,
+                           boost::uint64_t seed = 14695981039346656037ULL);
+// 64-bit FNV-1a; pass the last hash as the seed to keep going
+
+class BagCache {
+    /* An on-disk cache of the per-bag work np_divs does before the pair
+     * stage: the built flann indices, and the rhos (squared distances from
+     * each point to its k-th neighbor in its own bag).
+     *
+     * Files are named by a hash of the bag's contents plus the index params
+     * (and, for rhos, k and the search params), so changing any of those
+     * just misses the cache. Files are written to a temporary name and
+     * renamed into place, so concurrent runs sharing a directory are safe.
+     *
+     * The cache is best-effort: anything that can't be read is recomputed,
+     * and failures to write are ignored. The directory itself has to exist,
+     * though; the constructor throws a std::domain_error if it doesn't.
+     */
+
+    std::string dir;
+    boost::uint64_t index_params_hash;
+    int k;
+    std::string rho_suffix;
+
+    std::string temp_path(const std::string &path) const;
+    void move_into_place(const std::string &tmp, const std::string &path)
+        const;
+
+    public:
+
+    BagCache(const std::string &dir,
+             const flann::IndexParams &index_params,
+             int k,
+             const flann::SearchParams &search_params);
+
+    // The key identifying this bag (with these index params).
+    template <typename Scalar>
+    std::string key(const flann::Matrix<Scalar> &bag) const;
+
+    std::string index_path(const std::string &key) const;
+    // k of 0 means the one passed to the constructor
+    std::string rho_path(const std::string &key, int k = 0) const;
+
+    // Returns the saved index for this bag, or NULL if there isn't one.
+    template <typename Distance>
+    flann::Index<Distance>* load_index(
+            const std::string &key,
+            const flann::Matrix<typename Distance::ElementType> &bag) const;
+
+    template <typename Distance>
+    void save_index(const std::string &key, flann::Index<Distance> &index)
+        const;
+
+    // Loads the saved rho into rho if there's one of the right size.
+    bool load_rho(const std::string &key, size_t rows,
+                  std::vector<float> &rho, int k = 0) const;
+
+    void save_rho(const std::string &key, const std::vector<float> &rho,
+                  int k = 0) const;
+};
+
+std::string index_params_to_str(const flann::IndexParams &index_params);
+
+bool file_exists(const std::string &path);
+
+////////////////////////////////////////////////////////////////////////////////
+// Template implementations
+
+template <typename Scalar>
+std::string BagCache::key(const flann::Matrix<Scalar> &bag) const {
+    boost::uint64_t sizes[] = { bag.rows, bag.cols, sizeof(Scalar) };
+    boost::uint64_t h = hash_bytes(sizes, sizeof(sizes), index_params_hash);
+
+    // go row by row, in case the matrix has a stride
+    for (size_t i = 0; i < bag.rows; i++)
+        h = hash_bytes(bag[i], bag.cols * sizeof(Scalar), h);
+
+    char buf[17];
+    std::sprintf(buf, "%016llx", (unsigned long long) h);
+    return std::string(buf);
+}
+
+template <typename Distance>
+flann::Index<Distance>* BagCache::load_index(
+        const std::string &key,
+        const flann::Matrix<typename Distance::ElementType> &bag) const
+{
+    std::string path = index_path(key);
+    if (!file_exists(path))
+        return NULL;
+
+    try {
+        return new flann::Index<Distance>(bag, flann::SavedIndexParams(path));
+    } catch (std::exception &e) {
+        return NULL; // probably a corrupted or truncated file; just rebuild
+    }
+}
+
+template <typename Distance>
+void BagCache::save_index(const std::string &key,
+                          flann::Index<Distance> &index) const
+{
+    std::string path = index_path(key);
+    std::string tmp = temp_path(path);
+    try {
+        index.save(tmp);
+        move_into_place(tmp, path);
+    } catch (std::exception &e) {
+        std::remove(tmp.c_str());
+    }
+}
+
+}
+
+#endif
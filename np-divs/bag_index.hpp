@@ -0,0 +1,170 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_BAG_INDEX_HPP_
+#define NPDIVS_BAG_INDEX_HPP_
+#include "np-divs/basics.hpp"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include <flann/flann.hpp>
+
+namespace npdivs {
+
+// The IndexParams key that asks for one of np-divs' own search engines rather
+// than a flann index (e.g. "gemm"; see index_params_from_str). Params with it
+// still have a flann "algorithm", for code that only knows about flann.
+const char NPDIVS_ALGORITHM[] = "npdivs_algorithm";
+
+// which of np-divs' own engines index_params asks for, or "" for flann
+inline std::string npdivs_algorithm(const flann::IndexParams &index_params) {
+    return flann::get_param<std::string>(
+            index_params, NPDIVS_ALGORITHM, std::string());
+}
+
+
+// Space that a BagIndex's searches can reuse from one call to the next, so
+// that a caller who keeps one around (as DKNWorkspace does) doesn't send
+// every search back to the heap. What goes where is up to the index; each
+// thread needs its own.
+struct SearchScratch {
+    std::vector<float> floats[4];
+    std::vector<std::vector<std::pair<float, int> > > candidates;
+    std::vector<std::pair<double, int> > exact;
+
+    // the memory it's holding onto
+    size_t bytes() const {
+        size_t total = exact.capacity() * sizeof(std::pair<double, int>);
+        for (size_t i = 0; i < 4; i++)
+            total += floats[i].capacity() * sizeof(float);
+        for (size_t i = 0; i < candidates.size(); i++)
+            total += candidates[i].capacity() * sizeof(std::pair<float, int>);
+        return total;
+    }
+};
+
+
+template <typename Distance>
+class BagIndex : boost::noncopyable {
+    /* The neighbor search structure for one bag, as make_indices builds it:
+     * either a flann index or one of np-divs' own engines. It has the parts
+     * of flann::Index's interface that np_divs uses, so DKN works on either.
+     *
+     * As with flann's, searches don't change the index, and can be done from
+     * several threads at once.
+     */
+    public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType DistanceType;
+
+    virtual ~BagIndex() { }
+
+    // sets indices[i] and dists[i] to the knn nearest points to queries[i]
+    // and their distances, nearest first
+    virtual void knnSearch(const flann::Matrix<ElementType> &queries,
+                           flann::Matrix<int> &indices,
+                           flann::Matrix<DistanceType> &dists,
+                           size_t knn,
+                           const flann::SearchParams &params) const = 0;
+
+    // knnSearch, working in scratch; engines that need space of their own
+    // for a search override this (and have knnSearch make a temporary one)
+    virtual void knnSearchWith(const flann::Matrix<ElementType> &queries,
+                               flann::Matrix<int> &indices,
+                               flann::Matrix<DistanceType> &dists,
+                               size_t knn,
+                               const flann::SearchParams &params,
+                               SearchScratch &scratch) const {
+        knnSearch(queries, indices, dists, knn, params);
+    }
+
+    // like knnSearch, for queries that are the bag query_index was built on;
+    // engines that can use query_index's structure to search for all of
+    // them together (see dual_tree.hpp) override this
+    virtual void knnSearchBag(const BagIndex &query_index,
+                              const flann::Matrix<ElementType> &queries,
+                              flann::Matrix<int> &indices,
+                              flann::Matrix<DistanceType> &dists,
+                              size_t knn,
+                              const flann::SearchParams &params) const {
+        knnSearch(queries, indices, dists, knn, params);
+    }
+
+    // whether knnSearchBag is any better than knnSearch, so that it's worth
+    // searching for a whole bag at once rather than splitting it up
+    virtual bool searches_bags() const { return false; }
+
+    virtual size_t size() const = 0;
+    virtual size_t veclen() const = 0;
+
+    // bytes used by the index, not counting the bag itself
+    virtual size_t usedMemory() const = 0;
+
+    // the flann index underneath, or NULL for np-divs' own engines
+    virtual flann::Index<Distance>* flann_index() { return NULL; }
+};
+
+
+template <typename Distance>
+class FlannBagIndex : public BagIndex<Distance> {
+    typedef BagIndex<Distance> super;
+
+    boost::scoped_ptr<flann::Index<Distance> > index;
+
+    public:
+    typedef typename super::ElementType ElementType;
+    typedef typename super::DistanceType DistanceType;
+
+    // takes ownership of index
+    explicit FlannBagIndex(flann::Index<Distance> *index) : index(index) { }
+
+    virtual void knnSearch(const flann::Matrix<ElementType> &queries,
+                           flann::Matrix<int> &indices,
+                           flann::Matrix<DistanceType> &dists,
+                           size_t knn,
+                           const flann::SearchParams &params) const {
+        index->knnSearch(queries, indices, dists, knn, params);
+    }
+
+    virtual size_t size() const { return index->size(); }
+    virtual size_t veclen() const { return index->veclen(); }
+    virtual size_t usedMemory() const { return index->usedMemory(); }
+
+    virtual flann::Index<Distance>* flann_index() { return index.get(); }
+};
+
+}
+
+#endif
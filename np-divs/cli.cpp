@@ -36,11 +36,16 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <stdexcept>
 
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/throw_exception.hpp>
 #include <boost/utility.hpp>
 
 #include <flann/util/matrix.h>
@@ -58,33 +63,104 @@ struct ProgOpts : noncopyable {
     ptr_vector<DivFunc> div_funcs;
 
     size_t k;
+    vector<int> ks;
     size_t num_threads;
+    bool pin_threads;
 
     flann::IndexParams index_params;
     flann::SearchParams search_params;
+    SearchStrategy search_strategy;
 
+    size_t tile_size;
+    bool no_cost_order;
+    size_t split_rows;
     size_t show_progress;
 
+    string cache_dir;
+    string save_knn;
+    string from_knn;
+    string stats_format;
+
     void parse_div_funcs(const vector<string> &names) {
         for (size_t i = 0; i < names.size(); i++) {
-            div_funcs.push_back(div_func_from_str(names[i]));
+            div_funcs_from_str(names[i], div_funcs);
         }
     }
 
     void parse_index(const string name) {
         index_params = index_params_from_str(name);
     }
+
+    void parse_search(const string spec) {
+        search_params = search_params_from_str(spec);
+    }
+
+    void parse_search_strategy(const string name) {
+        search_strategy = search_strategy_from_str(name);
+    }
+
+    void parse_ks(const string spec) {
+        vector<string> tokens;
+        split(tokens, spec, is_any_of(","));
+        for (size_t i = 0; i < tokens.size(); i++)
+            ks.push_back(lexical_cast<int>(tokens[i]));
+    }
+
+    void parse_stats_format(const string format) {
+        if (format != "json")
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                        "unknown stats format " + format));
+        stats_format = format;
+    }
 };
 
 
 bool parse_args(int argc, char ** argv, ProgOpts& opts);
 
+void write_results(const ProgOpts& opts, flann::Matrix<double>* results,
+                   size_t num_df) {
+    if (opts.results_file == "-") {
+        matrix_array_to_csv(cout, results, num_df);
+    } else {
+        ofstream ofs(opts.results_file.c_str());
+        matrix_array_to_csv(ofs, results, num_df);
+    }
+}
+
+int divs_from_store(const ProgOpts& opts) {
+    KNNStore store(opts.from_knn);
+    if (opts.show_progress)
+        cerr << "Loaded neighbor distances for " << store.num_x() << " x "
+             << store.num_y() << " bags (k = " << store.k() << ").\n";
+
+    size_t num_df = opts.div_funcs.size();
+    flann::Matrix<double>* results =
+        alloc_matrix_array<double>(num_df, store.num_x(), store.num_y());
+
+    DivParams params(store.k(), opts.index_params, opts.search_params,
+            opts.num_threads, opts.show_progress);
+    params.thread_pool.reset(
+            new ThreadPool(opts.num_threads, opts.pin_threads));
+
+    DivStats stats;
+    if (!opts.stats_format.empty())
+        params.stats = &stats;
+
+    np_divs_from_store(store, opts.div_funcs, results, params);
+
+    if (params.stats)
+        stats.write_json(cerr);
+
+    write_results(opts, results, num_df);
+    free_matrix_array(results, num_df);
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     typedef flann::Matrix<double> Matrix;
 
     try {
         ProgOpts opts;
-        opts.search_params = flann::SearchParams(64);
         if (!parse_args(argc, argv, opts))
             return 1;
 
@@ -94,6 +170,9 @@ int main(int argc, char ** argv) {
             return 1;
         }
 
+        if (!opts.from_knn.empty())
+            return divs_from_store(opts);
+
         // load input bags
         // TODO - gracefully handle nonexisting files
         size_t num_x;
@@ -122,10 +201,26 @@ int main(int argc, char ** argv) {
         }
 
 
+        // with several ks, there's a matrix for each div func and k
+        if (!opts.ks.empty())
+            num_df *= opts.ks.size();
         Matrix* results = alloc_matrix_array<double>(num_df, num_x, num_y);
 
         DivParams params(opts.k, opts.index_params, opts.search_params,
                 opts.num_threads, opts.show_progress);
+        params.ks = opts.ks;
+        params.search_strategy = opts.search_strategy;
+        params.thread_pool.reset(
+                new ThreadPool(opts.num_threads, opts.pin_threads));
+        params.cache_dir = opts.cache_dir;
+        params.knn_store = opts.save_knn;
+        params.tile_size = opts.tile_size;
+        params.cost_order = !opts.no_cost_order;
+        params.split_rows = opts.split_rows;
+
+        DivStats stats;
+        if (!opts.stats_format.empty())
+            params.stats = &stats;
 
         boost::posix_time::ptime t_start = boost::posix_time::second_clock::local_time();
 
@@ -135,12 +230,10 @@ int main(int argc, char ** argv) {
         if (opts.show_progress)
             cerr << "Computation took " << (t_end - t_start).total_seconds() << " seconds.\n";
 
-        if (opts.results_file == "-") {
-            matrix_array_to_csv(cout, results, num_df);
-        } else {
-            ofstream ofs(opts.results_file.c_str());
-            matrix_array_to_csv(ofs, results, num_df);
-        }
+        if (params.stats)
+            stats.write_json(cerr);
+
+        write_results(opts, results, num_df);
 
         free_matrix_array(results, num_df);
 
@@ -156,7 +249,6 @@ int main(int argc, char ** argv) {
 // TODO nicer handling of matrix inputs
 // TODO optionally support HDF5 inputs
 // TODO positional arguments for x_bags, y_bags
-// TODO support setting {index,search}_params
 bool parse_args(int argc, char ** argv, ProgOpts& opts) {
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -189,17 +281,87 @@ bool parse_args(int argc, char ** argv, ProgOpts& opts) {
             "normalized: l2:.95 or renyi:.99:.95 means certain calculated "
             "intermediate values above the 95th percentile are cut down; 1 "
             "means not to do this; default is .99. All extra arguments are "
-            "optional.")
+            "optional. Adding :approx (l2:.99:approx) finds that percentile "
+            "from a sample of the values, which is faster for bags of more "
+            "than 20000 points; :exact never does; the default does for "
+            "100000 or more. alpha and renyi can also sweep over alpha: "
+            "renyi:.5..0.99:20 means 20 evenly-spaced alphas from .5 to .99, "
+            "each with its own output matrix.")
         ("num-threads",
             po::value<size_t>(&opts.num_threads)->default_value(0),
             "Number of threads to use for calculations. 0 means one per core.")
+        ("pin-threads",
+            po::bool_switch(&opts.pin_threads),
+            "Bind each worker thread to a single CPU (Linux only).")
+        ("tile-size",
+            po::value<size_t>(&opts.tile_size)->default_value(0),
+            "Work through the output matrix in blocks of this many rows and "
+            "columns, to keep the bags in use in the CPU cache. 0 picks a "
+            "size from the cache and bag sizes; 1 means plain row order.")
+        ("no-cost-order",
+            po::bool_switch(&opts.no_cost_order),
+            "Don't do the pairs of biggest bags first.")
+        ("split-rows",
+            po::value<size_t>(&opts.split_rows)->default_value(50000),
+            "Split searches for at least this many points into pieces that "
+            "run in parallel. 0 means never.")
+        ("stats",
+            po::value<string>()
+                ->notifier(bind(&ProgOpts::parse_stats_format,
+                                boost::ref(opts), _1)),
+            "Print timings and counts for each phase of the computation to "
+            "stderr in this format. Options: json.")
         ("neighbors,k",
             po::value<size_t>(&opts.k)->default_value(3),
             "The k for k-nearest-neighbor calculations.")
+        ("ks",
+            po::value<string>()
+                ->notifier(bind(&ProgOpts::parse_ks, boost::ref(opts), _1)),
+            "A comma-separated list of ks to use instead of --neighbors, "
+            "all from one search for the largest. The output has a matrix "
+            "for each div func and k: each div func's matrices are together, "
+            "in the order of the ks.")
         ("index,i",
             po::value<string>()->default_value("kdtree")
                 ->notifier(bind(&ProgOpts::parse_index, boost::ref(opts), _1)),
-            "The nearest-neighbor index to use. Options: linear, kdtree.")
+            "The nearest-neighbor index to use. Options: linear, kdtree, "
+            "kdforest, kmeans, composite, autotuned, "
+            "gemm (exact, like linear, but faster in high dimensions), "
+            "auto (linear, kdtree or gemm for each bag, by its size and "
+            "dimension). Arguments go after the type, like "
+            "kdforest:trees=8, kmeans:branching=32:iterations=5, "
+            "autotuned:precision=0.95, "
+            "auto:linear_max_rows=32:gemm_min_dim=8:gemm_max_rows=50000.")
+        ("search",
+            po::value<string>()->default_value("checks=64")
+                ->notifier(bind(&ProgOpts::parse_search, boost::ref(opts), _1)),
+            "How hard the approximate indices (kdforest, kmeans, composite) "
+            "search, as comma-separated key=value pairs: checks (how many "
+            "leaves to look at, or unlimited), eps (an allowed relative "
+            "error, for the kd-trees). Less work is faster but less "
+            "accurate.")
+        ("search-strategy",
+            po::value<string>()->default_value("points")
+                ->notifier(bind(&ProgOpts::parse_search_strategy,
+                                boost::ref(opts), _1)),
+            "How to find each point's neighbors in the other bag of a pair. "
+            "Options: points (a search of --index for each point), "
+            "dual-tree (an exact search that walks trees on both bags "
+            "together, for low dimensions; ignores --index).")
+        ("cache-dir",
+            po::value<string>(&opts.cache_dir),
+            "An existing directory in which to save each bag's index and "
+            "nearest-neighbor distances, so that later runs on the same bags "
+            "can skip rebuilding them.")
+        ("save-knn",
+            po::value<string>(&opts.save_knn),
+            "Also save all of the nearest-neighbor distances to this file, "
+            "so that other divergences on the same bags can be computed "
+            "later with --from-knn.")
+        ("from-knn",
+            po::value<string>(&opts.from_knn),
+            "Compute divergences from a file written by --save-knn, instead "
+            "of reading bags and searching them. k is taken from the file.")
         ("progress,p",
             po::value<size_t>(&opts.show_progress)->default_value(1000),
             "Show progress indications every X computations (default 1000; "
@@ -30,17 +30,13 @@
  ******************************************************************************/
 #include "np-divs/div-funcs/div_alpha.hpp"
 
-#include <algorithm>
 #include <cmath>
-#include <functional>
-#include <numeric>
 #include <stdexcept>
 #include <vector>
 
-#include <boost/bind.hpp>
-
 #include "np-divs/fix_terms.hpp"
 #include "np-divs/gamma.hpp"
+#include "np-divs/kernels.hpp"
 
 namespace npdivs {
 
@@ -53,57 +49,108 @@ string DivAlpha::name() const {
 }
 
 
-double DivAlpha::operator()(const vector<float> &rho_x,
-                            const vector<float> &nu_x,
-                            const vector<float> &rho_y,
-                            const vector<float> &nu_y,
-                            int dim,
-                            int k) const {
+void DivAlpha::eval_pairs(const DivPair *pairs, size_t num_pairs,
+                          int dim, int k, bool squared,
+                          double *results, DivScratch &scratch) const {
     /* Estimates alpha-divergence \int p^\alpha q^(1-\alpha) based on
-     * kth-nearest-neighbor statistics.
+     * kth-nearest-neighbor statistics, for each pair.
      *
-     * Note that rho_y is used only for its .size(), and nu_y is not used at
+     * Note that rho_y is used only for its size, and nu_y is not used at
      * all. (They're there to be consistent with the DivFunc interface.)
      */
-
-    return (*this)(rho_x, nu_x, rho_y.size(), dim, k);
+    vector<float> &r = scratch.ratios;
+    vector<double> &log_r = scratch.terms[0];
+    for (size_t p = 0; p < num_pairs; p++) {
+        const DivPair &pair = pairs[p];
+        capped_ratios(pair.rho_x, pair.nu_x, ub, cap_mode, r, squared);
+        log_ratios(r, log_r);
+        results[p] = finish(estimate_from_logs(log_r, pair.rho_x.size,
+                    pair.rho_y.size, dim, k, squared));
+    }
 }
 
-double DivAlpha::operator()(const vector<float> &rho,
-                            const vector<float> &nu,
+double DivAlpha::operator()(DistSpan rho,
+                            DistSpan nu,
                             int m,
                             int dim,
-                            int k) const {
+                            int k,
+                            bool squared) const {
     /* Estimates alpha-divergence \int p^\alpha q^(1-\alpha) based on
      * kth-nearest-neighbor statistics.
      *
      * m is the number of sample points in the Y distribution (the one
      * that nu is computed relative to).
      */
-    using boost::bind;
+    vector<float> r;
+    capped_ratios(rho, nu, ub, cap_mode, r, squared);
+    return finish(estimate(r, rho.size, m, dim, k, squared));
+}
 
-    size_t n = rho.size();
+void DivAlpha::capped_ratios(DistSpan rho,
+                             DistSpan nu,
+                             double ub,
+                             CapMode cap_mode,
+                             vector<float> &r,
+                             bool squared) {
+    /* Sets r to rho ./ nu, with anything too big capped by fix_terms. For
+     * squared distances, these are the squared ratios, capped at the square
+     * of the plain distances' cap.
+     */
 
-    // r = rho_x ./ nu_x
-    vector<float> r;
-    r.resize(n);
-    transform(rho.begin(), rho.end(), nu.begin(), r.begin(),
-            divides<float>());
-    
-    // cap anything too big
-    fix_terms(r, ub);
-
-    // r = r .^ (dim * (1-alpha))
-    transform(r.begin(), r.end(), r.begin(),
-            bind<double, double(&)(double,double)>(pow, _1, dim*(1-alpha)));
-
-    // find the mean of r and multiply by the appropriate constant
-    return accumulate(r.begin(), r.end(), 0.) / n *
-           exp(lgamma(k)*2 - lgamma(k+1-alpha) - lgamma(k+alpha-1)) *
-           pow((n-1.0) / m, 1.-alpha);
+    r.resize(rho.size);
+    if (!r.empty())
+        divide_floats(rho.data, nu.data, r.size(), &r[0]);
+
+    fix_terms(r, ub, cap_mode, squared);
+}
+
+void DivAlpha::log_ratios(const vector<float> &r, vector<double> &log_r) {
+    log_r.resize(r.size());
+    if (!r.empty())
+        log_floats(&r[0], r.size(), &log_r[0]);
+}
+
+double DivAlpha::estimate(const vector<float> &r, size_t n,
+                          int m, int dim, int k, bool squared) const {
+    /* Estimates \int p^\alpha q^(1-\alpha) from the capped ratios r, for
+     * a bag of n points (before any nans were thrown out of r).
+     */
+    vector<double> log_r;
+    log_ratios(r, log_r);
+    return estimate_from_logs(log_r, n, m, dim, k, squared);
+}
+
+double DivAlpha::estimate_from_logs(const vector<double> &log_r, size_t n,
+                                    int m, int dim, int k,
+                                    bool squared) const {
+    /* As estimate(), but from the logs of the capped ratios. The powers are
+     * always taken as exp(ex * log r), by the same kernel, so that every way
+     * of getting here gives the same answer. Ratios of squared distances
+     * just take half the exponent.
+     */
+    const double ex = dim * (1 - alpha) * (squared ? .5 : 1.);
+
+    // mean of r .^ (dim * (1-alpha)), rounding each power to a float
+    double total = 0.;
+    if (ex == 0) {
+        total = log_r.size(); // like pow(r, 0), even for r of 0 or inf
+    } else if (!log_r.empty()) {
+        total = sum_exp_as_floats(&log_r[0], log_r.size(), ex);
+    }
+
+    // multiply by the appropriate constant
+    return total / n * constant(dim, k) * pow((n-1.0) / m, 1.-alpha);
     // FIXME: what about the c-bar term?
 }
 
+double DivAlpha::compute_log_constant(int dim, int k) const {
+    return lgamma(k)*2 - lgamma(k+1-alpha) - lgamma(k+alpha-1);
+}
+
+double DivAlpha::finish(double est) const {
+    return est;
+}
+
 double DivAlpha::get_alpha() const { return alpha; }
 
 DivAlpha* DivAlpha::do_clone() const {
@@ -51,25 +51,52 @@ class DivAlpha : public DivFunc {
 
         virtual std::string name() const;
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
-                int y_size,
-                int dim,
-                int k
-            ) const;
+        using super::operator();
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
-                const std::vector<float> &rho_y,
-                const std::vector<float> &nu_y,
+        double operator()(
+                DistSpan rho_x,
+                DistSpan nu_x,
+                int y_size,
                 int dim,
-                int k
+                int k,
+                bool squared = false
             ) const;
 
         double get_alpha() const;
 
+        // The pieces of eval_pairs(), so that DivFuncBatch can share the
+        // ratios between every alpha-family function with the same ub, and
+        // DivAlphaSweep can share their logs between different alphas.
+        static void capped_ratios(
+                DistSpan rho,
+                DistSpan nu,
+                double ub,
+                CapMode cap_mode,
+                std::vector<float> &r,
+                bool squared = false);
+
+        static void log_ratios(const std::vector<float> &r,
+                               std::vector<double> &log_r);
+
+        double estimate(const std::vector<float> &r, size_t n,
+                        int m, int dim, int k, bool squared = false) const;
+
+        double estimate_from_logs(const std::vector<double> &log_r, size_t n,
+                                  int m, int dim, int k,
+                                  bool squared = false) const;
+
+        // turns the estimate of \int p^\alpha q^(1-\alpha) into the result
+        virtual double finish(double est) const;
+
+    protected:
+        virtual void eval_pairs(const DivPair *pairs, size_t num_pairs,
+                                int dim, int k, bool squared,
+                                double *results,
+                                DivScratch &scratch) const;
+
+        // log(gamma(k)^2 / gamma(k - alpha + 1) / gamma(k + alpha - 1))
+        virtual double compute_log_constant(int dim, int k) const;
+
     private:
         virtual DivAlpha* do_clone() const;
 };
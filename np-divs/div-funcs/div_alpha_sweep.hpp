@@ -0,0 +1,71 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_DIV_ALPHA_SWEEP_HPP_
+#define NPDIVS_DIV_ALPHA_SWEEP_HPP_
+#include "np-divs/basics.hpp"
+
+#include <vector>
+
+#include "np-divs/div-funcs/div_alpha.hpp"
+
+namespace npdivs {
+
+class DivAlphaSweep {
+    /* Estimates \int p^\alpha q^(1-\alpha) for several alphas from the same
+     * capped ratios rho/nu: the logs of the ratios are taken once, and each
+     * alpha is then one pass of exp() over them. The estimates are exactly
+     * what each DivAlpha::estimate() would give.
+     *
+     * Doesn't own the DivAlphas, and keeps scratch space, so each thread
+     * needs its own.
+     */
+
+    std::vector<const DivAlpha*> div_funcs;
+    std::vector<double> log_r;
+
+    public:
+    // adds a function to the sweep, returning where its estimate goes;
+    // functions with the same alpha share an estimate
+    size_t add(const DivAlpha *div_func);
+
+    size_t size() const { return div_funcs.size(); }
+
+    // sets ests[i] to the i-th estimate for the capped ratios r, from a bag
+    // of n points (before nans were thrown out of r); squared is as in
+    // DivFunc::operator()
+    void operator()(const std::vector<float> &r, size_t n,
+                    int m, int dim, int k, double *ests,
+                    bool squared = false);
+};
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/div-funcs/div_batch.hpp"
+
+#include <vector>
+
+namespace npdivs {
+
+using std::vector;
+
+DivFuncBatch::DivFuncBatch(const boost::ptr_vector<DivFunc> &div_funcs)
+    : div_funcs(div_funcs),
+      alphas(div_funcs.size(), NULL),
+      which_ub(div_funcs.size(), 0),
+      which_estimate(div_funcs.size(), 0)
+{
+    for (size_t df = 0; df < div_funcs.size(); df++) {
+        const DivAlpha *alpha = dynamic_cast<const DivAlpha*>(&div_funcs[df]);
+        if (alpha == NULL)
+            continue;
+        alphas[df] = alpha;
+
+        double ub = alpha->get_ub();
+        CapMode cap_mode = alpha->get_cap_mode();
+        size_t group = 0;
+        while (group < ubs.size()
+                && (ubs[group] != ub || cap_modes[group] != cap_mode))
+            group++;
+        if (group == ubs.size()) {
+            ubs.push_back(ub);
+            cap_modes.push_back(cap_mode);
+            sweeps.push_back(DivAlphaSweep());
+        }
+
+        which_ub[df] = group;
+        which_estimate[df] = sweeps[group].add(alpha);
+    }
+
+    ests.resize(sweeps.size());
+    for (size_t group = 0; group < sweeps.size(); group++)
+        ests[group].resize(sweeps[group].size());
+}
+
+void DivFuncBatch::operator()(DistSpan rho_x,
+                              DistSpan nu_x,
+                              DistSpan rho_y,
+                              DistSpan nu_y,
+                              int dim,
+                              int k,
+                              double *results,
+                              bool squared) {
+    DivPair pair(rho_x, nu_x, rho_y, nu_y);
+    (*this)(&pair, 1, dim, k, results, squared);
+}
+
+void DivFuncBatch::operator()(const DivPair *pairs,
+                              size_t num_pairs,
+                              int dim,
+                              int k,
+                              double *results,
+                              bool squared,
+                              DivScratch *scratch) {
+    /* The alpha-family estimates only look at rho_x and nu_x, and the size
+     * of the y bag; see DivAlpha::eval_pairs().
+     */
+    DivScratch own;
+    if (scratch == NULL)
+        scratch = &own;
+    vector<float> &r = scratch->ratios;
+
+    for (size_t p = 0; p < num_pairs; p++) {
+        const DivPair &pair = pairs[p];
+        for (size_t group = 0; group < ubs.size(); group++) {
+            DivAlpha::capped_ratios(pair.rho_x, pair.nu_x,
+                                    ubs[group], cap_modes[group], r, squared);
+            sweeps[group](r, pair.rho_x.size, pair.rho_y.size, dim, k,
+                          &ests[group][0], squared);
+        }
+
+        for (size_t df = 0; df < div_funcs.size(); df++)
+            if (alphas[df])
+                results[df * num_pairs + p] = alphas[df]->finish(
+                        ests[which_ub[df]][which_estimate[df]]);
+    }
+
+    for (size_t df = 0; df < div_funcs.size(); df++)
+        if (!alphas[df])
+            div_funcs[df](pairs, num_pairs, dim, k, results + df * num_pairs,
+                          squared, scratch);
+}
+
+}
@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_DIV_BATCH_HPP_
+#define NPDIVS_DIV_BATCH_HPP_
+#include "np-divs/basics.hpp"
+
+#include <vector>
+
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include "np-divs/div-funcs/div_alpha.hpp"
+#include "np-divs/div-funcs/div_alpha_sweep.hpp"
+#include "np-divs/div-funcs/div_func.hpp"
+
+namespace npdivs {
+
+class DivFuncBatch {
+    /* Evaluates a list of DivFuncs on the same pair of bags, sharing the work
+     * between the alpha-family functions (alpha, bc, hellinger, renyi): the
+     * capped ratios rho/nu are computed once for each distinct ub (and cap
+     * mode), and then a DivAlphaSweep gets the estimate for each distinct
+     * alpha with that ub.
+     * Other functions are just called as usual. Results are the same as
+     * calling each one, as long as alpha-family subclasses only change
+     * DivAlpha::finish().
+     *
+     * Keeps some scratch space of its own (and works in the caller's
+     * DivScratch), so each thread needs its own.
+     */
+
+    const boost::ptr_vector<DivFunc> &div_funcs;
+
+    std::vector<double> ubs;             // the distinct ubs of alpha funcs
+    std::vector<CapMode> cap_modes;      // and their cap modes
+    std::vector<DivAlphaSweep> sweeps;   // one for each of those
+    std::vector<const DivAlpha*> alphas; // NULL if not in the alpha family
+    std::vector<size_t> which_ub;        // for the alpha funcs
+    std::vector<size_t> which_estimate;  // within that ub's sweep
+
+    // scratch space
+    std::vector<std::vector<double> > ests;
+
+    public:
+    DivFuncBatch(const boost::ptr_vector<DivFunc> &div_funcs);
+
+    size_t size() const { return div_funcs.size(); }
+
+    // the number of times rho/nu gets computed and capped per direction
+    size_t num_ratio_groups() const { return ubs.size(); }
+
+    // sets results[df] to
+    // div_funcs[df](rho_x, nu_x, rho_y, nu_y, dim, k, squared)
+    void operator()(
+            DistSpan rho_x,
+            DistSpan nu_x,
+            DistSpan rho_y,
+            DistSpan nu_y,
+            int dim,
+            int k,
+            double *results,
+            bool squared = false);
+
+    // sets results[df * num_pairs + p] to div_funcs[df]'s estimate for
+    // pairs[p]; functions outside the alpha family are each called once for
+    // all the pairs. Works in scratch, or if it's NULL, in space of its own
+    // for the call.
+    void operator()(
+            const DivPair *pairs,
+            size_t num_pairs,
+            int dim,
+            int k,
+            double *results,
+            bool squared = false,
+            DivScratch *scratch = NULL);
+};
+
+}
+
+#endif
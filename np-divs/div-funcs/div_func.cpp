@@ -30,12 +30,79 @@
  ******************************************************************************/
 #include "np-divs/div-funcs/div_func.hpp"
 
+#include <cmath>
+
 namespace npdivs {
 
-DivFunc::DivFunc(double ub_) : ub(ub_) { }
+DivFunc::DivFunc(double ub_) : ub(ub_), cap_mode(CAP_AUTO) { }
 
 double DivFunc::get_ub() const { return ub; }
 
-DivFunc* DivFunc::clone() const { return do_clone(); }
+CapMode DivFunc::get_cap_mode() const { return cap_mode; }
+void DivFunc::set_cap_mode(CapMode mode) { cap_mode = mode; }
+
+DivFunc* DivFunc::clone() const {
+    DivFunc *copy = do_clone();
+    copy->cap_mode = cap_mode;
+    copy->prepared = prepared;
+    return copy;
+}
+
+double DivFunc::operator()(DistSpan rho_x, DistSpan nu_x,
+                           DistSpan rho_y, DistSpan nu_y,
+                           int dim, int k, bool squared) const {
+    DivPair pair(rho_x, nu_x, rho_y, nu_y);
+    DivScratch scratch;
+    double result;
+    eval_pairs(&pair, 1, dim, k, squared, &result, scratch);
+    return result;
+}
+
+void DivFunc::operator()(const DivPair *pairs, size_t num_pairs,
+                         int dim, int k, double *results,
+                         bool squared, DivScratch *scratch) const {
+    if (num_pairs == 0)
+        return;
+
+    if (scratch) {
+        eval_pairs(pairs, num_pairs, dim, k, squared, results, *scratch);
+    } else {
+        DivScratch own;
+        eval_pairs(pairs, num_pairs, dim, k, squared, results, own);
+    }
+}
+
+void DivFunc::prepare(int dim, int k) {
+    if (find_prepared(dim, k))
+        return;
+
+    Prepared p;
+    p.dim = dim;
+    p.k = k;
+    p.log_c = compute_log_constant(dim, k);
+    p.c = std::exp(p.log_c);
+    prepared.push_back(p);
+}
+
+double DivFunc::compute_log_constant(int dim, int k) const {
+    return 0;
+}
+
+const DivFunc::Prepared* DivFunc::find_prepared(int dim, int k) const {
+    for (size_t i = 0; i < prepared.size(); i++)
+        if (prepared[i].dim == dim && prepared[i].k == k)
+            return &prepared[i];
+    return NULL;
+}
+
+double DivFunc::log_constant(int dim, int k) const {
+    const Prepared *p = find_prepared(dim, k);
+    return p ? p->log_c : compute_log_constant(dim, k);
+}
+
+double DivFunc::constant(int dim, int k) const {
+    const Prepared *p = find_prepared(dim, k);
+    return p ? p->c : std::exp(compute_log_constant(dim, k));
+}
 
 }
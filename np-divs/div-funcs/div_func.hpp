@@ -33,14 +33,60 @@
 #include "np-divs/basics.hpp"
 
 #include <boost/utility.hpp>
+#include <cstddef>
 #include <string>
 #include <vector>
 
+#include "np-divs/fix_terms.hpp"
+
 namespace npdivs {
 
+// A read-only view of size distances, wherever they live: a vector, a
+// KNNStore's map, or MATLAB's memory. Doesn't own them.
+struct DistSpan {
+    const float *data;
+    size_t size;
+
+    DistSpan() : data(NULL), size(0) { }
+    DistSpan(const float *data, size_t size) : data(data), size(size) { }
+    DistSpan(const std::vector<float> &v)
+        : data(v.empty() ? NULL : &v[0]), size(v.size()) { }
+
+    bool empty() const { return size == 0; }
+    const float& operator[](size_t i) const { return data[i]; }
+};
+
+// The distances a DivFunc looks at for one pair of bags X and Y: rho_x from
+// each point of X to its k-th neighbor in X, nu_x from each point of X to
+// its k-th neighbor in Y, and likewise for rho_y and nu_y.
+struct DivPair {
+    DistSpan rho_x, nu_x, rho_y, nu_y;
+
+    DivPair() { }
+    DivPair(DistSpan rho_x, DistSpan nu_x, DistSpan rho_y, DistSpan nu_y)
+        : rho_x(rho_x), nu_x(nu_x), rho_y(rho_y), nu_y(nu_y) { }
+};
+
+// Vectors for DivFuncs to work in while they evaluate pairs. A caller that
+// keeps one around, as each np_divs worker does, lets them reuse the space
+// from one call to the next instead of going back to the heap for it.
+struct DivScratch {
+    std::vector<float> ratios;
+    std::vector<double> terms[4];
+
+    // the memory it's holding onto
+    size_t bytes() const {
+        size_t total = ratios.capacity() * sizeof(float);
+        for (size_t i = 0; i < 4; i++)
+            total += terms[i].capacity() * sizeof(double);
+        return total;
+    }
+};
+
 class DivFunc : boost::noncopyable {
     protected:
         const double ub; // if ub is .99, will cap terms at the 99-th percentile
+        CapMode cap_mode; // how to find that percentile; CAP_AUTO by default
 
     public:
         DivFunc(double ub = .99);
@@ -49,20 +95,74 @@ class DivFunc : boost::noncopyable {
 
         virtual std::string name() const = 0;
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
-                const std::vector<float> &rho_y,
-                const std::vector<float> &nu_y,
+        double operator()(
+                DistSpan rho_x,
+                DistSpan nu_x,
+                DistSpan rho_y,
+                DistSpan nu_y,
                 int dim,
-                int k
-            ) const = 0;
+                int k,
+                bool squared = false
+            ) const;
+        // Distances are Euclidean unless squared is true, in which case
+        // they're squared Euclidean distances as flann::L2 gives them; that
+        // only halves the exponents they're raised to, so np_divs passes
+        // them that way and never takes a square root.
+
+        // Sets results[p] to the estimate for pairs[p], for each of the
+        // num_pairs pairs. That's a single virtual call, working in scratch
+        // (or, if it's NULL, in space of its own for the call).
+        void operator()(
+                const DivPair *pairs,
+                size_t num_pairs,
+                int dim,
+                int k,
+                double *results,
+                bool squared = false,
+                DivScratch *scratch = NULL
+            ) const;
 
         DivFunc* clone() const;
 
         double get_ub() const;
 
+        CapMode get_cap_mode() const;
+        void set_cap_mode(CapMode mode);
+
+        // Works out the estimator's constants for this dim and k, so that
+        // calls with them are just arithmetic over the vectors. np_divs does
+        // this on its own copies of the div funcs, for each k; it isn't safe
+        // to do on a div func that other threads are using.
+        void prepare(int dim, int k);
+
+    protected:
+        // what both operator()s call; see the batch one
+        virtual void eval_pairs(const DivPair *pairs, size_t num_pairs,
+                                int dim, int k, bool squared,
+                                double *results,
+                                DivScratch &scratch) const = 0;
+
+        // The log of the estimator's constant factor for dim and k (0 unless
+        // overridden). Working in logs keeps it finite in high dimensions,
+        // where the gamma functions involved overflow.
+        virtual double compute_log_constant(int dim, int k) const;
+
+        // compute_log_constant, and its exp, from prepare() if it was called
+        // with this dim and k, and computed on the spot otherwise
+        double log_constant(int dim, int k) const;
+        double constant(int dim, int k) const;
+
     private:
+        struct Prepared {
+            int dim;
+            int k;
+            double log_c;
+            double c;
+        };
+        std::vector<Prepared> prepared;
+
+        const Prepared* find_prepared(int dim, int k) const;
+
         virtual DivFunc* do_clone() const = 0;
 };
 
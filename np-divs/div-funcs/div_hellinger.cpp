@@ -39,12 +39,7 @@ std::string DivHellinger::name() const {
     return "Hellinger distance";
 }
 
-double DivHellinger::operator()(const std::vector<float> &rho,
-                                const std::vector<float> &nu,
-                                int m,
-                                int dim,
-                                int k) const {
-    double est = this->super::operator()(rho, nu, m, dim, k);
+double DivHellinger::finish(double est) const {
     return est < 1 ? std::sqrt(1 - est) : 0;
 }
 
@@ -47,13 +47,7 @@ class DivHellinger : public DivAlpha {
 
         virtual std::string name() const;
 
-        virtual double operator()(
-                const std::vector<float> &rho,
-                const std::vector<float> &nu,
-                int m,
-                int dim,
-                int k
-            ) const;
+        virtual double finish(double est) const;
 
     private:
         DivHellinger* do_clone() const;
@@ -30,9 +30,7 @@
  ******************************************************************************/
 #include "np-divs/div-funcs/div_l2.hpp"
 
-#include <algorithm>
 #include <cmath>
-#include <numeric>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -41,6 +39,7 @@
 
 #include "np-divs/fix_terms.hpp"
 #include "np-divs/gamma.hpp"
+#include "np-divs/kernels.hpp"
 
 namespace npdivs {
 
@@ -53,75 +52,68 @@ string DivL2::name() const {
 }
 
 
-class pow_mult {
-    double ex;
-    double mult;
-public:
-    pow_mult(double e, double m) : ex(e), mult(m) {}
-    double operator()(double x) {
-        return pow(x, ex) * mult;
-    }
-};
+// x .^ ex * exp(log_mult)
+static void pow_mult(DistSpan x, double ex, double log_mult,
+                     vector<double> &out) {
+    out.resize(x.size);
+    if (!x.empty())
+        pow_floats(x.data, x.size, ex, log_mult, &out[0]);
+}
 
-template <typename T>
-inline T mean(const vector<T> &v) {
-    return accumulate(v.begin(), v.end(), (T) 0) / v.size();
+double DivL2::compute_log_constant(int dim, int k) const {
+    // this is B_{k,a,b} for a=0,b=1 and a=1,b=0
+    return log(k - 1.) - .5 * dim * log(M_PI) + lgamma(dim/2.0 + 1);
 }
 
 
-double DivL2::operator()(const vector<float> &rho_x,
-                         const vector<float> &nu_x,
-                         const vector<float> &rho_y,
-                         const vector<float> &nu_y,
-                         int dim,
-                         int k) const {
+void DivL2::eval_pairs(const DivPair *pairs, size_t num_pairs,
+                       int dim, int k, bool squared, double *results,
+                       DivScratch &scratch) const {
     /* Estimates L2 divergence \sqrt \int (p-q)^2 between distribution X and Y,
-     * based on kth-nearest-neighbor statistics.
+     * based on kth-nearest-neighbor statistics, for each pair.
      */
     if (k <= 1) {
         BOOST_THROW_EXCEPTION(domain_error(
                     "l2 divergence estimator needs k >= 2"));
     }
-    // (k-1) / volume of unit ball: this is B_{k,a,b} for a=0,b=1 and a=1,b=0
-    const double c = (k-1) / pow(M_PI, .5 * dim) * gamma(dim/2.0 + 1);
-    // XXX only works for dimensions up to 340
-
-    int N = rho_x.size();
-    int M = rho_y.size();
-
-    // break up the calculation according to
-    // \sqrt \int (p - q)^2 = \sqrt( \int p^2 - \int qp - \int pq + \int q^2 )
-    vector<double> pp, qp, pq, qq;
-    pp.resize(N); qp.resize(N);
-    pq.resize(M); qq.resize(M);
-
-    transform(rho_x.begin(), rho_x.end(), pp.begin(), pow_mult(-dim, c/(N-1)));
-    transform( nu_x.begin(),  nu_x.end(), qp.begin(), pow_mult(-dim, c/  M  ));
-    transform( nu_y.begin(),  nu_y.end(), pq.begin(), pow_mult(-dim, c/  N  ));
-    transform(rho_y.begin(), rho_y.end(), qq.begin(), pow_mult(-dim, c/(M-1)));
-
-    double res;
-    if (N != M) {
-        // throw away anything too big
-        fix_terms(pp, ub);
-        fix_terms(qp, ub);
-        fix_terms(pq, ub);
-        fix_terms(qq, ub);
-
-        // combine terms
-        res = mean(pp) - mean(qp) - mean(pq) + mean(qq);
-
-    } else {
-        // this is slightly faster, and more consistent with the matlab code
-        // TODO - this special case should probably go away eventually
-        for (int i = 0; i < N; i++) {
-            pp[i] += qq[i] - pq[i] - qp[i];
-        }
-
-        fix_terms(pp, ub);
-        res = mean(pp);
-    };
-    return res > 0 ? sqrt(res) : 0.;
+    // log of (k-1) / volume of unit ball
+    const double log_c = log_constant(dim, k);
+
+    // the distances get raised to -dim, or their squares to -dim/2
+    const double ex = squared ? -.5 * dim : -1. * dim;
+
+    vector<double> &pp = scratch.terms[0], &qp = scratch.terms[1],
+                   &pq = scratch.terms[2], &qq = scratch.terms[3];
+    for (size_t p = 0; p < num_pairs; p++) {
+        const DivPair &pair = pairs[p];
+        int N = pair.rho_x.size;
+        int M = pair.rho_y.size;
+
+        // break up the calculation according to \sqrt \int (p - q)^2
+        //     = \sqrt( \int p^2 - \int qp - \int pq + \int q^2 )
+        pow_mult(pair.rho_x, ex, log_c - log(N-1.), pp);
+        pow_mult( pair.nu_x, ex, log_c - log(M   ), qp);
+        pow_mult( pair.nu_y, ex, log_c - log(N   ), pq);
+        pow_mult(pair.rho_y, ex, log_c - log(M-1.), qq);
+
+        double res;
+        if (N != M) {
+            // combine the terms, throwing away anything too big
+            res = capped_mean(pp, ub, cap_mode) - capped_mean(qp, ub, cap_mode)
+                - capped_mean(pq, ub, cap_mode) + capped_mean(qq, ub, cap_mode);
+
+        } else {
+            // this is slightly faster, and more consistent with the matlab
+            // code
+            // TODO - this special case should probably go away eventually
+            for (int i = 0; i < N; i++) {
+                pp[i] += qq[i] - pq[i] - qp[i];
+            }
+
+            res = capped_mean(pp, ub, cap_mode);
+        };
+        results[p] = res > 0 ? sqrt(res) : 0.;
+    }
 }
 
 DivL2* DivL2::do_clone() const {
@@ -47,14 +47,14 @@ class DivL2 : public DivFunc {
 
         virtual std::string name() const;
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
-                const std::vector<float> &rho_y,
-                const std::vector<float> &nu_y,
-                int dim,
-                int k
-            ) const;
+    protected:
+        virtual void eval_pairs(const DivPair *pairs, size_t num_pairs,
+                                int dim, int k, bool squared,
+                                double *results,
+                                DivScratch &scratch) const;
+
+        // log((k-1) / volume of the unit ball in dim dimensions)
+        virtual double compute_log_constant(int dim, int k) const;
 
     private:
         virtual DivL2* do_clone() const;
@@ -30,17 +30,13 @@
  ******************************************************************************/
 #include "np-divs/div-funcs/div_linear.hpp"
 
-#include <algorithm>
 #include <cmath>
-#include <functional>
-#include <numeric>
 #include <stdexcept>
 #include <vector>
 
-#include <boost/bind.hpp>
-
 #include "np-divs/fix_terms.hpp"
 #include "np-divs/gamma.hpp"
+#include "np-divs/kernels.hpp"
 
 namespace npdivs {
 
@@ -53,49 +49,57 @@ string DivLinear::name() const {
 }
 
 
-double DivLinear::operator()(const vector<float> &rho_x,
-                             const vector<float> &nu_x,
-                             const vector<float> &rho_y,
-                             const vector<float> &nu_y,
-                             int dim,
-                             int k) const {
+void DivLinear::eval_pairs(const DivPair *pairs, size_t num_pairs,
+                           int dim, int k, bool squared,
+                           double *results, DivScratch &scratch) const {
     /* Estimates linear "divergence" \int qp based on kth-nearest-neighbor
-     * statistics.
+     * statistics, for each pair.
      *
-     * Note that rho_y is used only for its .size(), and nu_y is not used at
+     * Note that rho_y is used only for its size, and nu_y is not used at
      * all. (They're there to be consistent with the DivFunc interface.)
      */
-
-    return (*this)(rho_x, nu_x, rho_y.size(), dim, k);
+    const double log_c = log_constant(dim, k);
+    for (size_t p = 0; p < num_pairs; p++)
+        results[p] = estimate(pairs[p].rho_x, pairs[p].nu_x,
+                              pairs[p].rho_y.size, dim, squared, log_c,
+                              scratch.terms[0]);
 }
 
-double DivLinear::operator()(const vector<float> &rho,
-                            const vector<float> &nu,
-                            int m,
-                            int dim,
-                            int k) const {
+double DivLinear::operator()(DistSpan rho,
+                             DistSpan nu,
+                             int m,
+                             int dim,
+                             int k,
+                             bool squared) const {
     /* Estimates linear "divergence" \int qp based on kth-nearest-neighbor
      * statistics.
      *
      * m is the number of sample points in the Y distribution (the one
      * that nu is computed relative to).
      */
-    size_t n = rho.size();
+    vector<double> r;
+    return estimate(rho, nu, m, dim, squared, log_constant(dim, k), r);
+}
 
-    // r = nu ^ -d
-    vector<float> r;
+double DivLinear::estimate(DistSpan rho, DistSpan nu, int m, int dim,
+                           bool squared, double log_c,
+                           vector<double> &r) const {
+    size_t n = rho.size;
+
+    // r = nu ^ -d (or, for squared distances, nu ^ -d/2) times the
+    // appropriate constant, which doesn't change which terms get capped
+    const double ex = squared ? -.5 * dim : -1. * dim;
     r.resize(n);
-    transform(nu.begin(), nu.end(), r.begin(),
-            boost::bind<double, double(&)(double,double)>(pow, _1, -1.*dim));
+    if (n > 0)
+        pow_floats(nu.data, n, ex, log_c - log((double) m), &r[0]);
 
-    // cap anything too big
-    fix_terms(r, ub);
+    // find the mean of r, capping anything too big
+    return capped_sum(r, ub, cap_mode) / ((double) n);
+}
 
-    // find the mean of r and multiply by the appropriate constant
-    return accumulate(r.begin(), r.end(), 0.0) / ((double) n)
-           * (k-1.) // gamma(k)^2 / gamma(k-0) / gamma(k-1)
-           / pow(M_PI, .5 * dim) * gamma(dim/2.0 + 1) // vol. of unit ball
-           / ((double) m);
+double DivLinear::compute_log_constant(int dim, int k) const {
+    // gamma(k)^2 / gamma(k-0) / gamma(k-1) = k-1, over the unit ball volume
+    return log(k - 1.) - .5 * dim * log(M_PI) + lgamma(dim/2.0 + 1);
 }
 
 DivLinear* DivLinear::do_clone() const {
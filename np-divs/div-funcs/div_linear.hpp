@@ -48,24 +48,33 @@ class DivLinear : public DivFunc {
 
         virtual std::string name() const;
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
+        using super::operator();
+
+        double operator()(
+                DistSpan rho_x,
+                DistSpan nu_x,
                 int y_size,
                 int dim,
-                int k
+                int k,
+                bool squared = false
             ) const;
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
-                const std::vector<float> &rho_y,
-                const std::vector<float> &nu_y,
-                int dim,
-                int k
-            ) const;
+    protected:
+        virtual void eval_pairs(const DivPair *pairs, size_t num_pairs,
+                                int dim, int k, bool squared,
+                                double *results,
+                                DivScratch &scratch) const;
+
+        // log((k-1) / volume of the unit ball in dim dimensions)
+        virtual double compute_log_constant(int dim, int k) const;
 
     private:
+        // the estimate for one pair, with log_c from log_constant and r as
+        // scratch space
+        double estimate(DistSpan rho, DistSpan nu, int m, int dim,
+                        bool squared, double log_c,
+                        std::vector<double> &r) const;
+
         virtual DivLinear* do_clone() const;
 };
 
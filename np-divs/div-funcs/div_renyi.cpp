@@ -42,16 +42,10 @@ std::string DivRenyi::name() const {
     return (boost::format("Renyi-%g divergence") % alpha).str();
 }
 
-double DivRenyi::operator()(const std::vector<float> &rho,
-                            const std::vector<float> &nu,
-                            int m,
-                            int dim,
-                            int k) const {
+double DivRenyi::finish(double est) const {
     /* Estimates Renyi divergence \log (\int p^\alpha q^(1-\alpha)) / (\alpha-1)
-     * based on kth-nearest-neighbor statistics.
+     * from the estimate of \int p^\alpha q^(1-\alpha).
      */
-
-    double est = this->super::operator()(rho, nu, m, dim, k);
     return std::max(0., std::log(est) / (alpha - 1.));
 }
 
@@ -47,13 +47,7 @@ class DivRenyi : public DivAlpha {
 
         virtual std::string name() const;
 
-        virtual double operator()(
-                const std::vector<float> &rho_x,
-                const std::vector<float> &nu_x,
-                int m,
-                int dim,
-                int k
-            ) const;
+        virtual double finish(double est) const;
 
     private:
         virtual DivRenyi* do_clone() const;
@@ -38,6 +38,7 @@
 #include "np-divs/div-funcs/div_linear.hpp"
 #include "np-divs/div-funcs/div_renyi.hpp"
 
+#include <cstdlib>
 #include <functional>
 #include <stdexcept>
 #include <string>
@@ -59,16 +60,37 @@ namespace npdivs {
 #define THROW_DOM(x)\
     BOOST_THROW_EXCEPTION(std::domain_error(x))
 
-DivFunc* div_func_from_str(const string &spec) {
-    vector<string> tokens;
-    split(tokens, spec, bind2nd(equal_to<char>(), ':'));
+static bool pop_cap_mode(vector<string> &tokens, CapMode &mode) {
+    /* If the last token names a cap mode, sets mode and removes it. */
+    if (tokens.empty())
+        return false;
+
+    const string &last = tokens.back();
+    if (last == "exact")
+        mode = CAP_EXACT;
+    else if (last == "approx")
+        mode = CAP_APPROX;
+    else if (last == "auto")
+        mode = CAP_AUTO;
+    else
+        return false;
+
+    tokens.pop_back();
+    return true;
+}
 
+static DivFunc* make_div_func(const string &spec,
+                              const vector<string> &tokens) {
     size_t num_toks = tokens.size();
     if (num_toks == 0)
         THROW_DOM("can't handle empty div func specification");
 
     const string &kind = tokens[0];
 
+    if (num_toks > 1 && tokens[1].find("..") != string::npos)
+        THROW_DOM("sweep specification '" + spec + "' gives more than one "
+                  "div func; use div_funcs_from_str");
+
     vector<double> args;
     args.reserve(num_toks - 1);
     for (size_t i = 1; i < num_toks; i++)
@@ -123,4 +145,60 @@ DivFunc* div_func_from_str(const string &spec) {
     }
 }
 
+DivFunc* div_func_from_str(const string &spec) {
+    vector<string> tokens;
+    split(tokens, spec, bind2nd(equal_to<char>(), ':'));
+
+    CapMode cap_mode = CAP_AUTO;
+    pop_cap_mode(tokens, cap_mode);
+
+    DivFunc *div_func = make_div_func(spec, tokens);
+    div_func->set_cap_mode(cap_mode);
+    return div_func;
+}
+
+void div_funcs_from_str(const string &spec,
+                        boost::ptr_vector<DivFunc> &div_funcs) {
+    /* Like div_func_from_str, but also handles sweeps over alpha:
+     * renyi:.5..0.99:20 or alpha:.5..0.99:20:.95 mean 20 evenly spaced alphas
+     * from .5 to .99, inclusive, with an optional ub and cap mode.
+     */
+    vector<string> tokens;
+    split(tokens, spec, bind2nd(equal_to<char>(), ':'));
+
+    CapMode cap_mode = CAP_AUTO;
+    pop_cap_mode(tokens, cap_mode);
+
+    string::size_type dots = tokens.size() > 1
+                           ? tokens[1].find("..") : string::npos;
+    if (dots == string::npos) {
+        div_funcs.push_back(div_func_from_str(spec));
+        return;
+    }
+
+    const string &kind = tokens[0];
+    if (kind != "alpha" && kind != "renyi")
+        THROW_DOM("can only sweep alpha for alpha and renyi, not '" + kind
+                  + "'");
+    if (tokens.size() < 3 || tokens.size() > 4)
+        THROW_DOM("sweep should look like " + kind
+                  + ":lo..hi:num[:ub][:approx]");
+
+    double lo = atof(tokens[1].substr(0, dots).c_str());
+    double hi = atof(tokens[1].substr(dots + 2).c_str());
+    int num = atoi(tokens[2].c_str());
+    double ub = tokens.size() == 4 ? atof(tokens[3].c_str()) : .99;
+    if (num < 1)
+        THROW_DOM("sweep needs at least one alpha");
+
+    for (int i = 0; i < num; i++) {
+        double alpha = num == 1 ? lo : lo + (hi - lo) * i / (num - 1);
+        if (kind == "alpha")
+            div_funcs.push_back(new DivAlpha(alpha, ub));
+        else
+            div_funcs.push_back(new DivRenyi(alpha, ub));
+        div_funcs.back().set_cap_mode(cap_mode);
+    }
+}
+
 }
@@ -35,9 +35,18 @@
 
 #include <string>
 
+#include <boost/ptr_container/ptr_vector.hpp>
+
 namespace npdivs{
 
+// parses specs like l2, renyi:.99 or renyi:.99:.95; any of them can end with
+// :exact, :approx or :auto to set the DivFunc's cap mode (see fix_terms.hpp)
 DivFunc* div_func_from_str(const std::string &spec);
 
+// appends the div funcs for spec, which can also be a sweep over alpha, like
+// renyi:.5..0.99:20 (20 alphas from .5 to .99) or alpha:.5..0.99:20:.95
+void div_funcs_from_str(const std::string &spec,
+                        boost::ptr_vector<DivFunc> &div_funcs);
+
 }
 #endif
@@ -31,10 +31,19 @@
 #include "np-divs/div_params.hpp"
 
 #include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/throw_exception.hpp>
 
 #include <flann/flann.hpp>
 
+#include "np-divs/bag_index.hpp"
+#include "np-divs/index_policy.hpp"
+
 namespace npdivs {
 
 void do_nothing(size_t left) {}
@@ -42,18 +51,227 @@ void print_progress_cerr(size_t left) {
     std::cerr << left << " pairs left to compute\n";
 }
 
-// TODO: more index types, support arguments
-flann::IndexParams index_params_from_str(const std::string &spec) {
-    // even though this looks like object slicing, it's not, i promise
-    if (spec == "linear" || spec == "brute") {
-        flann::LinearIndexParams ps;
-        return ps;
-    } else if (spec == "kdtree" || spec == "kd") {
+flann::IndexParams DivParams::get_index_params() const {
+    if (search_strategy == SEARCH_DUAL_TREE) {
+        // still a kd-tree to anything that only knows flann's indices
         flann::KDTreeSingleIndexParams ps;
+        ps[NPDIVS_ALGORITHM] = std::string("dual_tree");
         return ps;
+    }
+    return index_params;
+}
+
+SearchStrategy search_strategy_from_str(const std::string &name) {
+    if (name == "points" || name == "single")
+        return SEARCH_EACH_POINT;
+    else if (name == "dual-tree" || name == "dual")
+        return SEARCH_DUAL_TREE;
+    else
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "unknown search strategy " + name));
+}
+
+// the kinds of value an index or search parameter can take
+enum ParamKind { PARAM_INT, PARAM_FLOAT, PARAM_BOOL, PARAM_CENTERS };
+
+// an argument that a spec may give: its name there, and the flann
+// parameter it sets
+struct ParamArg {
+    const char *key;
+    const char *param;
+    ParamKind kind;
+};
+
+static const ParamArg kdtree_args[] = {
+    { "leaf_max_size", "leaf_max_size", PARAM_INT },
+    { "reorder", "reorder", PARAM_BOOL },
+};
+static const ParamArg kdforest_args[] = {
+    { "trees", "trees", PARAM_INT },
+};
+static const ParamArg kmeans_args[] = {
+    { "branching", "branching", PARAM_INT },
+    { "iterations", "iterations", PARAM_INT },
+    { "centers_init", "centers_init", PARAM_CENTERS },
+    { "cb_index", "cb_index", PARAM_FLOAT },
+};
+static const ParamArg composite_args[] = {
+    { "trees", "trees", PARAM_INT },
+    { "branching", "branching", PARAM_INT },
+    { "iterations", "iterations", PARAM_INT },
+    { "centers_init", "centers_init", PARAM_CENTERS },
+    { "cb_index", "cb_index", PARAM_FLOAT },
+};
+static const ParamArg autotuned_args[] = {
+    { "precision", "target_precision", PARAM_FLOAT },
+    { "build_weight", "build_weight", PARAM_FLOAT },
+    { "memory_weight", "memory_weight", PARAM_FLOAT },
+    { "sample_fraction", "sample_fraction", PARAM_FLOAT },
+};
+
+static const ParamArg auto_args[] = {
+    { "linear_max_rows", "linear_max_rows", PARAM_INT },
+    { "gemm_min_dim", "gemm_min_dim", PARAM_INT },
+    { "gemm_max_rows", "gemm_max_rows", PARAM_INT },
+    { "forest_min_dim", "forest_min_dim", PARAM_INT },
+    { "trees", "trees", PARAM_INT },
+};
+
+#define NUM_ARGS(args) (sizeof(args) / sizeof(args[0]))
+
+template <typename T>
+static T parse_value(const std::string &key, const std::string &value) {
+    try {
+        return boost::lexical_cast<T>(value);
+    } catch (boost::bad_lexical_cast &) {
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "bad value '" + value + "' for " + key));
+    }
+}
+
+static bool parse_bool(const std::string &key, const std::string &value) {
+    if (value == "true" || value == "yes" || value == "1")
+        return true;
+    else if (value == "false" || value == "no" || value == "0")
+        return false;
+    BOOST_THROW_EXCEPTION(std::domain_error(
+                "bad value '" + value + "' for " + key));
+}
+
+static flann::flann_centers_init_t parse_centers(const std::string &value) {
+    if (value == "random")
+        return flann::FLANN_CENTERS_RANDOM;
+    else if (value == "gonzales")
+        return flann::FLANN_CENTERS_GONZALES;
+    else if (value == "kmeanspp")
+        return flann::FLANN_CENTERS_KMEANSPP;
+    BOOST_THROW_EXCEPTION(std::domain_error(
+                "unknown centers_init " + value));
+}
+
+// splits "key=value"
+static void split_arg(const std::string &arg,
+                      std::string &key, std::string &value) {
+    const size_t eq = arg.find('=');
+    if (eq == std::string::npos || eq == 0)
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "expected key=value, got '" + arg + "'"));
+    key = arg.substr(0, eq);
+    value = arg.substr(eq + 1);
+}
+
+// sets the params that tokens[1, ...) name, out of the num_args in args
+static void set_index_args(flann::IndexParams &ps,
+                           const std::vector<std::string> &tokens,
+                           const ParamArg *args, size_t num_args) {
+    for (size_t t = 1; t < tokens.size(); t++) {
+        std::string key, value;
+        split_arg(tokens[t], key, value);
+
+        const ParamArg *arg = NULL;
+        for (size_t a = 0; a < num_args; a++)
+            if (key == args[a].key)
+                arg = &args[a];
+        if (arg == NULL)
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                        "unknown argument " + key + " for index type "
+                        + tokens[0]));
+
+        switch (arg->kind) {
+            case PARAM_INT:
+                ps[arg->param] = parse_value<int>(key, value); break;
+            case PARAM_FLOAT:
+                ps[arg->param] = parse_value<float>(key, value); break;
+            case PARAM_BOOL:
+                ps[arg->param] = parse_bool(key, value); break;
+            case PARAM_CENTERS:
+                ps[arg->param] = parse_centers(value); break;
+        }
+    }
+}
+
+flann::IndexParams index_params_from_str(const std::string &spec) {
+    /* The spec is an index type, optionally followed by its arguments, as
+     * in "kdforest:trees=8" or "kmeans:branching=32:iterations=5"; anything
+     * not given gets flann's default.
+     */
+    std::vector<std::string> tokens;
+    boost::algorithm::split(tokens, spec, boost::is_any_of(":"));
+    const std::string &kind = tokens[0];
+
+    // even though this looks like object slicing, it's not, i promise
+    flann::IndexParams ps;
+    if (kind == "linear" || kind == "brute") {
+        ps = flann::LinearIndexParams();
+        set_index_args(ps, tokens, NULL, 0);
+    } else if (kind == "kdtree" || kind == "kd") {
+        ps = flann::KDTreeSingleIndexParams();
+        set_index_args(ps, tokens, kdtree_args, NUM_ARGS(kdtree_args));
+    } else if (kind == "kdforest" || kind == "randomized") {
+        ps = flann::KDTreeIndexParams();
+        set_index_args(ps, tokens, kdforest_args, NUM_ARGS(kdforest_args));
+    } else if (kind == "kmeans") {
+        ps = flann::KMeansIndexParams();
+        set_index_args(ps, tokens, kmeans_args, NUM_ARGS(kmeans_args));
+    } else if (kind == "composite") {
+        ps = flann::CompositeIndexParams();
+        set_index_args(ps, tokens, composite_args, NUM_ARGS(composite_args));
+    } else if (kind == "autotuned") {
+        ps = flann::AutotunedIndexParams();
+        set_index_args(ps, tokens, autotuned_args, NUM_ARGS(autotuned_args));
+    } else if (kind == "auto") {
+        // picks one of the others for each bag (see index_policy.hpp)
+        ps = IndexPolicy().index_params();
+        set_index_args(ps, tokens, auto_args, NUM_ARGS(auto_args));
+    } else if (kind == "lsh") {
+        // flann only does LSH on binary features, under Hamming distance
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "flann's lsh index only works with Hamming distance on "
+                    "binary features, not the L2 distances we need"));
+    } else if (kind == "gemm") {
+        // our own exact search (see gemm_index.hpp); it's still a linear
+        // index as far as anything that only knows flann is concerned
+        ps = flann::LinearIndexParams();
+        ps[NPDIVS_ALGORITHM] = std::string("gemm");
+        set_index_args(ps, tokens, NULL, 0);
     } else {
-        BOOST_THROW_EXCEPTION(std::domain_error("unknown index type " + spec));
+        BOOST_THROW_EXCEPTION(std::domain_error("unknown index type " + kind));
+    }
+    return ps;
+}
+
+flann::SearchParams search_params_from_str(
+        const std::string &spec, const flann::SearchParams &defaults)
+{   /* The spec is a comma-separated list of key=value, as in
+     * "checks=128,eps=0.1"; anything not given comes from defaults.
+     */
+    flann::SearchParams ps = defaults;
+    if (spec.empty())
+        return ps;
+
+    std::vector<std::string> tokens;
+    boost::algorithm::split(tokens, spec, boost::is_any_of(","));
+    for (size_t t = 0; t < tokens.size(); t++) {
+        std::string key, value;
+        split_arg(tokens[t], key, value);
+
+        if (key == "checks") {
+            if (value == "unlimited")
+                ps.checks = flann::FLANN_CHECKS_UNLIMITED;
+            else if (value == "auto")
+                ps.checks = flann::FLANN_CHECKS_AUTOTUNED;
+            else
+                ps.checks = parse_value<int>(key, value);
+        } else if (key == "eps") {
+            ps.eps = parse_value<float>(key, value);
+        } else if (key == "sorted") {
+            ps.sorted = parse_bool(key, value);
+        } else {
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                        "unknown search argument " + key));
+        }
     }
+    return ps;
 }
 
 }
@@ -32,23 +32,85 @@
 #define NPDIVS_DIV_PARAMS_HPP_
 #include "np-divs/basics.hpp"
 
+#include <string>
+#include <vector>
+
 #include <flann/flann.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "np-divs/div_stats.hpp"
+#include "np-divs/thread_pool.hpp"
 
 namespace npdivs {
 
 void do_nothing(size_t);
 void print_progress_cerr(size_t);
 
+// how np_divs finds each point's neighbors in the other bag of a pair
+enum SearchStrategy {
+    // a separate search in the other bag's index for each point, using
+    // whatever index index_params asks for
+    SEARCH_EACH_POINT,
+
+    // a dual-tree search that walks kd-trees on both bags at once, pruning
+    // whole groups of points together (see dual_tree.hpp); exact, for low
+    // dimensions and flann::L2 only. index_params is then ignored.
+    SEARCH_DUAL_TREE
+};
+
+SearchStrategy search_strategy_from_str(const std::string &name);
+
 struct DivParams {
     int k; // the k of our k-nearest-neighbor searches
+
+    // if nonempty, k is ignored and every div func is evaluated for each of
+    // these k, all from one search for the largest; results then needs
+    // div_funcs.size() * ks.size() matrices, with div func df at ks[ki] in
+    // results[df * ks.size() + ki]
+    std::vector<int> ks;
     flann::IndexParams index_params;
     flann::SearchParams search_params;
+    SearchStrategy search_strategy;
     size_t num_threads; // 0 means boost::thread::hardware_concurrency()
 
     size_t show_progress; // show progress every X steps; 0 means never
     boost::function<void (size_t)> print_progress;
 
+    // if set, all the parallel work runs on this pool (and num_threads is
+    // ignored); otherwise each call makes a temporary one of num_threads
+    boost::shared_ptr<ThreadPool> thread_pool;
+
+    // whether that temporary pool binds each of its threads to a single CPU
+    // (see ThreadPool); off by default
+    bool pin_threads;
+
+    // the side of the square blocks of the divergence matrix that the pair
+    // stage works through one at a time (see JobDispenser); 0 picks one
+    // from the bag and index sizes, 1 means plain row-major order
+    size_t tile_size;
+
+    // whether to do the most expensive pairs of bags first, so that threads
+    // don't sit idle at the end while one finishes off a pair of huge bags
+    // (see JobDispenser::order_by_cost)
+    bool cost_order;
+
+    // searches with at least this many query points are split into chunks
+    // of rows that run in parallel on the thread pool, so that a huge bag
+    // doesn't leave one core working through it alone; 0 means never split
+    size_t split_rows;
+
+    // if set, np_divs fills this in with timings and counts for the call
+    DivStats *stats;
+
+    // if nonempty, an existing directory in which to cache each bag's index
+    // and rhos between calls (see BagCache)
+    std::string cache_dir;
+
+    // if nonempty, np_divs also writes every rho and nu it computes to a
+    // KNNStore at this path, for later use by np_divs_from_store
+    std::string knn_store;
+
     DivParams(
         int k = 3,
         flann::IndexParams index_params = flann::KDTreeSingleIndexParams(),
@@ -58,10 +120,14 @@ struct DivParams {
         void (*print_progress)(size_t) = &print_progress_cerr)
     :
         k(k), index_params(index_params), search_params(search_params),
+        search_strategy(SEARCH_EACH_POINT),
         num_threads(num_threads), show_progress(show_progress),
         print_progress(boost::function<void (size_t)>(
                 print_progress == NULL ? &do_nothing : print_progress
-        ))
+        )),
+        pin_threads(false),
+        tile_size(0), cost_order(true), split_rows(50000),
+        stats(NULL)
     { }
 
     DivParams(int k,
@@ -70,14 +136,34 @@ struct DivParams {
             boost::function<void(size_t)> print_progress)
     :
         k(k), index_params(index_params), search_params(search_params),
+        search_strategy(SEARCH_EACH_POINT),
         num_threads(num_threads), show_progress(show_progress),
-        print_progress(print_progress)
+        print_progress(print_progress),
+        pin_threads(false),
+        tile_size(0), cost_order(true), split_rows(50000),
+        stats(NULL)
     { }
 
+    // ks, or just k if that's empty
+    std::vector<int> get_ks() const {
+        return ks.empty() ? std::vector<int>(1, k) : ks;
+    }
 
+    // the params to build each bag's index with: index_params, unless
+    // search_strategy needs a particular kind
+    flann::IndexParams get_index_params() const;
 };
 
+// parses an index spec: a type (linear, kdtree, kdforest, kmeans,
+// composite, autotuned, gemm, or auto to pick for each bag), then any of its
+// arguments, as in "kdforest:trees=8" or "autotuned:precision=0.95"
 flann::IndexParams index_params_from_str(const std::string &spec);
 
+// parses search arguments like "checks=128,eps=0.1" on top of defaults;
+// checks may also be "unlimited" or "auto"
+flann::SearchParams search_params_from_str(
+        const std::string &spec,
+        const flann::SearchParams &defaults = flann::SearchParams());
+
 }
 #endif
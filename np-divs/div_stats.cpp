@@ -0,0 +1,133 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/div_stats.hpp"
+
+#include <ostream>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+namespace npdivs {
+
+double wall_clock() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+double cpu_clock() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+double thread_cpu_clock() {
+#if defined(__linux__) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    return cpu_clock();
+}
+
+void DivStats::clear() {
+    indices = rhos = pairs = total = PhaseStats();
+    knn_searches = knn_queries = points_searched = 0;
+    search_seconds = div_func_seconds = 0;
+    index_bytes = rho_bytes = scratch_bytes = 0;
+    threads.clear();
+}
+
+void DivStats::add_worker(const WorkerStats &worker, bool pair_worker) {
+    knn_searches += worker.knn_searches;
+    knn_queries += worker.knn_queries;
+    points_searched += worker.points_searched;
+
+    if (pair_worker) {
+        search_seconds += worker.search_seconds;
+        div_func_seconds += worker.div_func_seconds;
+
+        threads.push_back(worker);
+        WorkerStats &t = threads.back();
+        t.idle_seconds = pairs.wall_seconds > t.busy_seconds
+                       ? pairs.wall_seconds - t.busy_seconds : 0;
+    }
+}
+
+namespace {
+void write_phase(std::ostream &out, const char *name, const PhaseStats &p) {
+    out << "\"" << name << "\": {\"wall_seconds\": " << p.wall_seconds
+        << ", \"cpu_seconds\": " << p.cpu_seconds << "}";
+}
+}
+
+void DivStats::write_json(std::ostream &out) const {
+    out << "{\n  \"phases\": {";
+    write_phase(out, "indices", indices);
+    out << ",\n             ";
+    write_phase(out, "rhos", rhos);
+    out << ",\n             ";
+    write_phase(out, "pairs", pairs);
+    out << ",\n             ";
+    write_phase(out, "total", total);
+    out << "},\n"
+        << "  \"knn_searches\": " << knn_searches << ",\n"
+        << "  \"knn_queries\": " << knn_queries << ",\n"
+        << "  \"points_searched\": " << points_searched << ",\n"
+        << "  \"search_seconds\": " << search_seconds << ",\n"
+        << "  \"div_func_seconds\": " << div_func_seconds << ",\n"
+        << "  \"index_bytes\": " << index_bytes << ",\n"
+        << "  \"rho_bytes\": " << rho_bytes << ",\n"
+        << "  \"scratch_bytes\": " << scratch_bytes << ",\n"
+        << "  \"bytes_allocated\": " << bytes_allocated() << ",\n"
+        << "  \"threads\": [";
+    for (size_t i = 0; i < threads.size(); i++) {
+        const WorkerStats &t = threads[i];
+        out << (i ? ",\n    " : "\n    ")
+            << "{\"jobs\": " << t.jobs
+            << ", \"busy_seconds\": " << t.busy_seconds
+            << ", \"idle_seconds\": " << t.idle_seconds
+            << ", \"search_seconds\": " << t.search_seconds
+            << ", \"div_func_seconds\": " << t.div_func_seconds
+            << ", \"knn_queries\": " << t.knn_queries << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+}
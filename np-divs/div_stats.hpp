@@ -0,0 +1,153 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_DIV_STATS_HPP_
+#define NPDIVS_DIV_STATS_HPP_
+#include "np-divs/basics.hpp"
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "np-divs/thread_pool.hpp"
+
+namespace npdivs {
+
+double wall_clock(); // seconds since some fixed point; only differences matter
+double cpu_clock();  // CPU seconds used by the whole process, all threads
+
+// CPU seconds used by the calling thread; where there's no per-thread clock
+// (only Linux has one here), the same as cpu_clock()
+double thread_cpu_clock();
+
+struct PhaseStats {
+    double wall_seconds;
+
+    // summed over the thread that called np_divs and its pool's threads,
+    // so other threads in the process (MATLAB's, say) don't count; but if
+    // the pool is shared, whatever else it runs meanwhile does, and without
+    // per-thread clocks it's the whole process
+    double cpu_seconds;
+
+    PhaseStats() : wall_seconds(0), cpu_seconds(0) { }
+};
+
+class PhaseTimer {
+    const ThreadPool *pool;
+    double wall_start, cpu_start;
+
+    // CPU time used by this thread and the pool's
+    double cpu() const {
+        return thread_cpu_clock() + (pool ? pool->cpu_seconds() : 0);
+    }
+
+    public:
+    // stop() must be called from the thread that made the timer
+    explicit PhaseTimer(const ThreadPool *pool = NULL) : pool(pool) {
+        restart();
+    }
+
+    void restart() {
+        wall_start = wall_clock();
+        cpu_start = cpu();
+    }
+
+    // adds the time since construction (or the last restart) to phase
+    void stop(PhaseStats &phase) const {
+        phase.wall_seconds += wall_clock() - wall_start;
+        phase.cpu_seconds += cpu() - cpu_start;
+    }
+};
+
+struct WorkerStats {
+    /* What one worker did. The search counts are kept for the rho workers
+     * too, but only the pair workers' show up in DivStats::threads.
+     */
+    size_t jobs;
+
+    size_t knn_searches;    // calls to DKN
+    size_t knn_queries;     // points whose neighbors were found
+    size_t points_searched; // sizes of the indices searched, summed
+
+    double busy_seconds;     // wall time spent on jobs
+    double idle_seconds;     // the rest of the phase
+    double search_seconds;   // the part of busy spent on searches
+    double div_func_seconds; // the part of busy spent in the DivFuncs
+
+    WorkerStats()
+        : jobs(0), knn_searches(0), knn_queries(0), points_searched(0),
+          busy_seconds(0), idle_seconds(0),
+          search_seconds(0), div_func_seconds(0)
+    { }
+};
+
+struct DivStats {
+    /* Timings and counts for one np_divs call, filled in if a pointer to
+     * one is passed as DivParams::stats.
+     */
+    PhaseStats indices;  // building (or loading) the indices
+    PhaseStats rhos;     // each bag's neighbor distances to itself
+    PhaseStats pairs;    // the searches and DivFuncs for each pair of bags
+    PhaseStats total;    // the whole call
+
+    // over the rho and pair phases
+    size_t knn_searches;
+    size_t knn_queries;
+    size_t points_searched;
+
+    // thread-seconds in the pair phase, summed over the workers
+    double search_seconds;
+    double div_func_seconds;
+
+    // memory np_divs allocates itself: the flann indices (as they report
+    // it), the rho vectors, and the workers' search scratch space
+    size_t index_bytes;
+    size_t rho_bytes;
+    size_t scratch_bytes;
+
+    std::vector<WorkerStats> threads; // pair phase, one per worker
+
+    DivStats() { clear(); }
+
+    void clear();
+
+    size_t bytes_allocated() const {
+        return index_bytes + rho_bytes + scratch_bytes;
+    }
+
+    // adds a worker's counts into the totals; if pair_worker, also records
+    // it in threads, with idle_seconds as the rest of the pair phase
+    void add_worker(const WorkerStats &worker, bool pair_worker);
+
+    void write_json(std::ostream &out) const;
+};
+
+}
+#endif
@@ -32,61 +32,189 @@
 #define NPDIVS_DKN_HPP_
 #include "np-divs/basics.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <vector>
 #include <flann/flann.hpp>
 
+#include "np-divs/bag_index.hpp"
+
 namespace npdivs {
 
-template <typename Distance, typename ResultType>
-std::vector<ResultType> DKN(
-        flann::Index<Distance> &index,
+template <typename DistanceType>
+class DKNWorkspace {
+    /* Scratch space for the neighbor indices and distances that flann writes
+     * during a DKN search, and for the search itself if it's a BagIndex that
+     * can use some.
+     *
+     * The buffers only ever grow, so a workspace that's kept around between
+     * searches stops allocating once it's seen the largest query. Not
+     * thread-safe; give each thread its own.
+     */
+    std::vector<int> indices_buf;
+    std::vector<DistanceType> dists_buf;
+    SearchScratch search;
+
+    public:
+
+    flann::Matrix<int> indices(size_t rows, int k) {
+        indices_buf.resize(rows * k);
+        return flann::Matrix<int>(
+                indices_buf.empty() ? NULL : &indices_buf[0], rows, k);
+    }
+
+    flann::Matrix<DistanceType> dists(size_t rows, int k) {
+        dists_buf.resize(rows * k);
+        return flann::Matrix<DistanceType>(
+                dists_buf.empty() ? NULL : &dists_buf[0], rows, k);
+    }
+
+    SearchScratch& search_scratch() { return search; }
+
+    size_t bytes() const {
+        return indices_buf.capacity() * sizeof(int)
+             + dists_buf.capacity() * sizeof(DistanceType)
+             + search.bytes();
+    }
+};
+
+
+// index.knnSearch, for a flann::Index (or anything else with one)
+template <typename Index, typename ElementType, typename DistanceType>
+void knn_search(Index &index,
+                const flann::Matrix<ElementType> &query,
+                flann::Matrix<int> &indices,
+                flann::Matrix<DistanceType> &dists,
+                int k,
+                const flann::SearchParams &search_params,
+                DKNWorkspace<DistanceType> &workspace) {
+    index.knnSearch(query, indices, dists, k, search_params);
+}
+
+// and for a BagIndex, in the workspace's search scratch
+template <typename Distance>
+void knn_search(BagIndex<Distance> &index,
+                const flann::Matrix<typename Distance::ElementType> &query,
+                flann::Matrix<int> &indices,
+                flann::Matrix<typename Distance::ResultType> &dists,
+                int k,
+                const flann::SearchParams &search_params,
+                DKNWorkspace<typename Distance::ResultType> &workspace) {
+    index.knnSearchWith(query, indices, dists, k, search_params,
+                        workspace.search_scratch());
+}
+
+
+template <typename DistanceType, typename ResultType>
+void copy_dkns(const flann::Matrix<DistanceType> &dists,
+               const int *ks, size_t num_ks, ResultType *const *dkns,
+               bool take_sqrt = true)
+{   /* Writes column ks[i] - 1 of dists, the distances to each query's
+     * ks[i]-th nearest neighbor, into dkns[i].
+     */
+    for (size_t ki = 0; ki < num_ks; ki++) {
+        const int col = ks[ki] - 1;
+        ResultType *dkn = dkns[ki];
+        if (take_sqrt)
+            for (size_t i = 0; i < dists.rows; i++)
+                dkn[i] = std::sqrt(dists[i][col]);
+        else
+            for (size_t i = 0; i < dists.rows; i++)
+                dkn[i] = dists[i][col];
+    }
+}
+
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+void DKN(
+        Index<Distance> &index,
         const flann::Matrix<typename Distance::ElementType> &query,
+        ResultType *dkn,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
         int k = 3,
         const flann::SearchParams &search_params = flann::SearchParams(),
         bool take_sqrt = true)
-{   /* Get the distances to the k-th nearest neighbor of each element in query
-     * using the passed index and search params.
-     *
-     * Make sure that the passed index objects have already done buildIndex().
-     * Since FLANN searches are thread-safe, so is this function.
-     *
-     * Because flann::L2 is actually the squared Euclidean distance, this
-     * function by default square-roots the results. Pass take_sqrt=false to
-     * avoid this.
-     * */
-    using std::vector;
-    using flann::Matrix;
-
+{   /* Like the vector-returning DKN below, but writes the query.rows results
+     * into dkn and does the search in the passed workspace, so that it
+     * doesn't touch the heap once the workspace is big enough.
+     */
     typedef typename Distance::ResultType DistanceType;
 
-    // matrices to store the results
-    Matrix<int> indices(new int[query.rows*k], query.rows, k);
-    Matrix<DistanceType> dists(new DistanceType[query.rows*k], query.rows, k);
+    flann::Matrix<int> indices = workspace.indices(query.rows, k);
+    flann::Matrix<DistanceType> dists = workspace.dists(query.rows, k);
 
     // search!
-    index.knnSearch(query, indices, dists, k, search_params);
+    knn_search(index, query, indices, dists, k, search_params, workspace);
 
     // get out just the results we want
-    vector<ResultType> dkn;
-    dkn.reserve(query.rows);
     if (take_sqrt)
         for (size_t i = 0; i < query.rows; i++)
-            dkn.push_back(std::sqrt(dists[i][k-1]));
+            dkn[i] = std::sqrt(dists[i][k-1]);
     else
         for (size_t i = 0; i < query.rows; i++)
-            dkn.push_back(dists[i][k-1]);
+            dkn[i] = dists[i][k-1];
+}
+
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+void DKN(
+        Index<Distance> &index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        const int *ks,
+        size_t num_ks,
+        ResultType *const *dkns,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        const flann::SearchParams &search_params = flann::SearchParams(),
+        bool take_sqrt = true)
+{   /* Like the DKN above, but for several values of k at once: does a single
+     * search for the largest, and writes the distances to each point's
+     * ks[i]-th nearest neighbor into dkns[i].
+     */
+    typedef typename Distance::ResultType DistanceType;
+
+    int k = *std::max_element(ks, ks + num_ks);
+
+    flann::Matrix<int> indices = workspace.indices(query.rows, k);
+    flann::Matrix<DistanceType> dists = workspace.dists(query.rows, k);
+
+    knn_search(index, query, indices, dists, k, search_params, workspace);
+    copy_dkns(dists, ks, num_ks, dkns, take_sqrt);
+}
+
 
-    delete[] indices.ptr();
-    delete[] dists.ptr();
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+std::vector<ResultType> DKN(
+        Index<Distance> &index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        int k = 3,
+        const flann::SearchParams &search_params = flann::SearchParams(),
+        bool take_sqrt = true)
+{   /* Get the distances to the k-th nearest neighbor of each element in query
+     * using the passed index and search params.
+     *
+     * index can be a flann::Index or a BagIndex. Make sure that flann indices
+     * have already done buildIndex(). Since their searches are thread-safe,
+     * so is this function.
+     *
+     * Because flann::L2 is actually the squared Euclidean distance, this
+     * function by default square-roots the results. Pass take_sqrt=false to
+     * avoid this.
+     * */
+    DKNWorkspace<typename Distance::ResultType> workspace;
 
+    std::vector<ResultType> dkn(query.rows);
+    if (query.rows > 0)
+        DKN(index, query, &dkn[0], workspace, k, search_params, take_sqrt);
     return dkn;
 }
 
 
-template <typename Distance>
+template <typename Distance, template <typename> class Index>
 std::vector<typename Distance::ResultType> DKN(
-        flann::Index<Distance> &index,
+        Index<Distance> &index,
         const flann::Matrix<typename Distance::ElementType> &query,
         int k = 3,
         const flann::SearchParams &search_params = flann::SearchParams(),
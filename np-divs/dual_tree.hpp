@@ -0,0 +1,479 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_DUAL_TREE_HPP_
+#define NPDIVS_DUAL_TREE_HPP_
+#include "np-divs/basics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/throw_exception.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+
+#include <flann/flann.hpp>
+
+#include "np-divs/bag_index.hpp"
+
+namespace npdivs {
+
+// whether Distance gives squared Euclidean distances, which the boxes'
+// bounds assume
+template <typename Distance>
+struct is_squared_l2 : boost::false_type { };
+template <typename T>
+struct is_squared_l2<flann::L2<T> > : boost::true_type { };
+
+template <typename Distance>
+class DualTreeIndex : public BagIndex<Distance> {
+    /* An exact kd-tree over one bag, whose nodes keep their bounding boxes.
+     *
+     * Plain knnSearch goes down the tree once per query, like flann's
+     * single kd-tree. But knnSearchBag, given another DualTreeIndex's bag as
+     * the queries, walks the two trees together: a pair of nodes whose boxes
+     * are further apart than the current k-th neighbor distance of every
+     * query in the query node is skipped all at once, rather than once for
+     * each query point, and each query starts out with the points in its own
+     * leaf so that those bounds are tight from the beginning. How the two
+     * compare with flann's own kd-tree depends on the bags and the machine;
+     * `make bench_knn` times them side by side.
+     *
+     * The boxes are in terms of squared Euclidean distance, so Distance must
+     * be flann::L2 (the constructor throws std::domain_error otherwise); the
+     * distances themselves come from Distance, and match a linear search's.
+     * Searches are exact, so ignore the SearchParams. The bag matrix must
+     * outlive the index.
+     */
+    typedef BagIndex<Distance> super;
+
+    public:
+    typedef typename super::ElementType ElementType;
+    typedef typename super::DistanceType DistanceType;
+
+    private:
+    struct Node {
+        size_t begin, end; // the range of tree positions under the node
+        int left, right;   // children, or -1 for a leaf
+    };
+
+    static const size_t LEAF_SIZE = 16;
+
+    // the reference node is only split along with the query node while it
+    // has this many times as many points; below that, it's cheaper to let
+    // each query's own search sort out the rest
+    static const size_t REF_SPLIT_RATIO = 16;
+
+    flann::Matrix<ElementType> data;
+    Distance distance;
+    const size_t dim;
+
+    std::vector<int> ids; // the bag row at each tree position
+    std::vector<ElementType> points; // the bag's rows, in tree order
+    std::vector<Node> nodes; // the root is nodes[0]
+    std::vector<ElementType> lo, hi; // node n's box is lo, hi[n*dim, ...)
+    std::vector<DistanceType> diags; // the length of each box's diagonal
+
+    // the k nearest found so far for one query, nearest first, padded with
+    // infinity and -1
+    struct Neighbors {
+        DistanceType *dists;
+        int *idx;
+        size_t k;
+
+        DistanceType worst() const { return dists[k - 1]; }
+
+        void insert(DistanceType d, int id) {
+            if (!(d < dists[k - 1]))
+                return;
+            size_t pos = k - 1;
+            for (; pos > 0 && d < dists[pos - 1]; pos--) {
+                dists[pos] = dists[pos - 1];
+                idx[pos] = idx[pos - 1];
+            }
+            dists[pos] = d;
+            idx[pos] = id;
+        }
+    };
+
+    struct ByCoord {
+        const flann::Matrix<ElementType> &data;
+        size_t d;
+        ByCoord(const flann::Matrix<ElementType> &data, size_t d)
+            : data(data), d(d) { }
+        bool operator()(int a, int b) const { return data[a][d] < data[b][d]; }
+    };
+
+    int build(size_t begin, size_t end) {
+        const int n = int(nodes.size());
+        Node node = { begin, end, -1, -1 };
+        nodes.push_back(node);
+
+        lo.resize(lo.size() + dim);
+        hi.resize(hi.size() + dim);
+        ElementType *l = &lo[n * dim], *h = &hi[n * dim];
+        std::copy(data[ids[begin]], data[ids[begin]] + dim, l);
+        std::copy(data[ids[begin]], data[ids[begin]] + dim, h);
+        for (size_t p = begin + 1; p < end; p++) {
+            const ElementType *row = data[ids[p]];
+            for (size_t d = 0; d < dim; d++) {
+                l[d] = std::min(l[d], row[d]);
+                h[d] = std::max(h[d], row[d]);
+            }
+        }
+
+        DistanceType diag = 0;
+        for (size_t d = 0; d < dim; d++)
+            diag += (DistanceType(h[d]) - l[d]) * (h[d] - l[d]);
+        diags.push_back(std::sqrt(diag));
+
+        if (end - begin <= LEAF_SIZE)
+            return n;
+
+        // split the widest side at the median
+        size_t split = 0;
+        for (size_t d = 1; d < dim; d++)
+            if (h[d] - l[d] > h[split] - l[split])
+                split = d;
+        if (!(h[split] > l[split]))
+            return n; // all the same point
+
+        const size_t mid = begin + (end - begin) / 2;
+        std::nth_element(ids.begin() + begin, ids.begin() + mid,
+                         ids.begin() + end, ByCoord(data, split));
+
+        const int left = build(begin, mid);
+        const int right = build(mid, end);
+        nodes[n].left = left;
+        nodes[n].right = right;
+        return n;
+    }
+
+    const ElementType *point(size_t pos) const { return &points[pos * dim]; }
+
+    static DistanceType gap(DistanceType below, DistanceType above) {
+        return below > 0 ? below : (above > 0 ? above : 0);
+    }
+
+    // the squared distance from x to node n's box
+    DistanceType box_dist(const ElementType *x, int n) const {
+        const ElementType *l = &lo[n * dim], *h = &hi[n * dim];
+        DistanceType dist = 0;
+        for (size_t d = 0; d < dim; d++) {
+            DistanceType g = gap(DistanceType(l[d]) - x[d],
+                                 DistanceType(x[d]) - h[d]);
+            dist += g * g;
+        }
+        return dist;
+    }
+
+    // the squared distance between the boxes of our node n and other's m
+    DistanceType box_dist(int n, const DualTreeIndex &other, int m) const {
+        const ElementType *l = &lo[n * dim], *h = &hi[n * dim];
+        const ElementType *ol = &other.lo[m * dim], *oh = &other.hi[m * dim];
+        DistanceType dist = 0;
+        for (size_t d = 0; d < dim; d++) {
+            DistanceType g = gap(DistanceType(ol[d]) - h[d],
+                                 DistanceType(l[d]) - oh[d]);
+            dist += g * g;
+        }
+        return dist;
+    }
+
+    // the squared distance between the centers of our node n's box and
+    // other's node m's
+    DistanceType center_dist(int n, const DualTreeIndex &other, int m) const {
+        const ElementType *l = &lo[n * dim], *h = &hi[n * dim];
+        const ElementType *ol = &other.lo[m * dim], *oh = &other.hi[m * dim];
+        DistanceType dist = 0;
+        for (size_t d = 0; d < dim; d++) {
+            DistanceType g = (DistanceType(l[d]) + h[d] - ol[d] - oh[d]) / 2;
+            dist += g * g;
+        }
+        return dist;
+    }
+
+    // the leaf that q would be in, or failing that the one a greedy descent
+    // finds
+    int nearest_leaf(const ElementType *q) const {
+        int n = 0;
+        while (nodes[n].left >= 0) {
+            const Node &node = nodes[n];
+            n = box_dist(q, node.right) < box_dist(q, node.left)
+                ? node.right : node.left;
+        }
+        return n;
+    }
+
+    void scan_leaf(const ElementType *q, int n, Neighbors &nbrs) const {
+        for (size_t p = nodes[n].begin; p < nodes[n].end; p++)
+            nbrs.insert(distance(q, point(p), dim), ids[p]);
+    }
+
+    // adds the points under node n to nbrs, except for those in the leaf
+    // skip (which have already been added)
+    void search(const ElementType *q, int n, DistanceType n_dist,
+                Neighbors &nbrs, int skip = -1) const
+    {
+        if (n_dist > nbrs.worst())
+            return;
+
+        const Node &node = nodes[n];
+        if (node.left < 0) {
+            if (n != skip)
+                scan_leaf(q, n, nbrs);
+            return;
+        }
+
+        DistanceType l_dist = box_dist(q, node.left),
+                     r_dist = box_dist(q, node.right);
+        if (l_dist <= r_dist) {
+            search(q, node.left, l_dist, nbrs, skip);
+            search(q, node.right, r_dist, nbrs, skip);
+        } else {
+            search(q, node.right, r_dist, nbrs, skip);
+            search(q, node.left, l_dist, nbrs, skip);
+        }
+    }
+
+    // the state of one knnSearchBag: the neighbors of each query tree
+    // position and the reference leaf it started from, and for each query
+    // node an upper bound on the k-th neighbor distance of every query under
+    // it, and the smallest k-th neighbor distance of any of them so far
+    struct DualSearch {
+        const DualTreeIndex &qtree;
+        std::vector<DistanceType> dists;
+        std::vector<int> idx;
+        std::vector<int> seed;
+        std::vector<DistanceType> bound, min_kth;
+        size_t k;
+
+        DualSearch(const DualTreeIndex &qtree, size_t k)
+            :
+                qtree(qtree),
+                dists(qtree.points.size() / qtree.dim * k,
+                      std::numeric_limits<DistanceType>::infinity()),
+                idx(dists.size(), -1),
+                seed(dists.size() / k, -1),
+                bound(qtree.nodes.size(),
+                      std::numeric_limits<DistanceType>::infinity()),
+                min_kth(bound),
+                k(k)
+        { }
+
+        Neighbors neighbors(size_t pos) {
+            Neighbors nbrs = { &dists[pos * k], &idx[pos * k], k };
+            return nbrs;
+        }
+
+        // a bound for all of node n's queries from one of them having a
+        // k-th neighbor at squared distance kth: none of the others can be
+        // more than the box's diagonal further from it
+        DistanceType spread(DistanceType kth, int n) const {
+            DistanceType b = std::sqrt(kth) + qtree.diags[n];
+            return b * b;
+        }
+
+        void tighten(int n, DistanceType b) {
+            bound[n] = std::min(bound[n], b);
+        }
+
+        // sets node n's bounds from its leaves' queries' neighbors
+        void init_bounds(int n) {
+            const Node &node = qtree.nodes[n];
+            if (node.left < 0) {
+                DistanceType worst = 0;
+                for (size_t p = node.begin; p < node.end; p++) {
+                    const DistanceType kth = dists[p * k + k - 1];
+                    worst = std::max(worst, kth);
+                    min_kth[n] = std::min(min_kth[n], kth);
+                }
+                bound[n] = std::min(worst, spread(min_kth[n], n));
+            } else {
+                init_bounds(node.left);
+                init_bounds(node.right);
+                min_kth[n] = std::min(min_kth[node.left],
+                                      min_kth[node.right]);
+                bound[n] = std::min(
+                        std::max(bound[node.left], bound[node.right]),
+                        spread(min_kth[n], n));
+            }
+        }
+    };
+
+    void dual_search(int qn, int rn, DistanceType qr_dist,
+                     DualSearch &s) const
+    {
+        if (qr_dist > s.bound[qn])
+            return;
+
+        const Node &q = s.qtree.nodes[qn], &r = nodes[rn];
+
+        if (q.left < 0) {
+            // finish off each query on its own, which prunes better than
+            // sharing the leaf's looser bound would
+            DistanceType worst = 0, best = s.min_kth[qn];
+            for (size_t qp = q.begin; qp < q.end; qp++) {
+                const ElementType *x = s.qtree.point(qp);
+                Neighbors nbrs = s.neighbors(qp);
+                search(x, rn, box_dist(x, rn), nbrs, s.seed[qp]);
+                worst = std::max(worst, nbrs.worst());
+                best = std::min(best, nbrs.worst());
+            }
+            s.min_kth[qn] = best;
+            s.bound[qn] = std::min(worst, s.spread(best, qn));
+
+        } else {
+            // split the query node, and if it's much bigger the reference one
+            // too, so that each query child meets the nearer reference child
+            // first. The children's queries are the parent's, so its bounds
+            // hold for them too, including what the first child finds.
+            const int kids[] = { q.left, q.right };
+            for (size_t c = 0; c < 2; c++) {
+                const int kid = kids[c];
+                s.tighten(kid, s.bound[qn]);
+                s.tighten(kid, s.spread(s.min_kth[qn], qn));
+
+                if (r.left < 0 || r.end - r.begin
+                                  < REF_SPLIT_RATIO * (q.end - q.begin)) {
+                    dual_search(kid, rn, box_dist(rn, s.qtree, kid), s);
+                } else {
+                    // the boxes often overlap, so go by their centers to
+                    // pick which child to try first
+                    int near = r.left, far = r.right;
+                    if (center_dist(far, s.qtree, kid)
+                            < center_dist(near, s.qtree, kid))
+                        std::swap(near, far);
+                    dual_search(kid, near, box_dist(near, s.qtree, kid), s);
+                    dual_search(kid, far, box_dist(far, s.qtree, kid), s);
+                }
+
+                s.min_kth[qn] = std::min(s.min_kth[qn], s.min_kth[kid]);
+            }
+            s.bound[qn] = std::min(
+                    std::max(s.bound[q.left], s.bound[q.right]),
+                    s.spread(s.min_kth[qn], qn));
+        }
+    }
+
+    public:
+    explicit DualTreeIndex(const flann::Matrix<ElementType> &data,
+                           Distance distance = Distance())
+        : data(data), distance(distance), dim(data.cols), ids(data.rows)
+    {
+        if (!is_squared_l2<Distance>::value)
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                    "dual-tree searches need flann::L2 distances"));
+
+        for (size_t i = 0; i < data.rows; i++)
+            ids[i] = int(i);
+        if (data.rows > 0)
+            build(0, data.rows);
+
+        points.resize(data.rows * dim);
+        for (size_t p = 0; p < data.rows; p++)
+            std::copy(data[ids[p]], data[ids[p]] + dim, &points[p * dim]);
+    }
+
+    virtual void knnSearch(const flann::Matrix<ElementType> &queries,
+                           flann::Matrix<int> &indices,
+                           flann::Matrix<DistanceType> &dists,
+                           size_t knn,
+                           const flann::SearchParams &params) const
+    {
+        for (size_t i = 0; i < queries.rows; i++) {
+            Neighbors nbrs = { dists[i], indices[i], knn };
+            std::fill(dists[i], dists[i] + knn,
+                      std::numeric_limits<DistanceType>::infinity());
+            std::fill(indices[i], indices[i] + knn, -1);
+            if (knn > 0 && !nodes.empty())
+                search(queries[i], 0, box_dist(queries[i], 0), nbrs);
+        }
+    }
+
+    virtual void knnSearchBag(const BagIndex<Distance> &query_index,
+                              const flann::Matrix<ElementType> &queries,
+                              flann::Matrix<int> &indices,
+                              flann::Matrix<DistanceType> &dists,
+                              size_t knn,
+                              const flann::SearchParams &params) const
+    {   /* Falls back to knnSearch unless query_index is a DualTreeIndex on
+         * queries.
+         */
+        const DualTreeIndex *qtree =
+            dynamic_cast<const DualTreeIndex *>(&query_index);
+        if (qtree == NULL || qtree->data.rows != queries.rows
+                || queries.rows == 0 || qtree->data[0] != queries[0]
+                || knn == 0 || nodes.empty()) {
+            knnSearch(queries, indices, dists, knn, params);
+            return;
+        }
+
+        // start each query off with the points in its own part of the
+        // tree, so the bounds are decent from the beginning
+        DualSearch s(*qtree, knn);
+        for (size_t qp = 0; qp < queries.rows; qp++) {
+            const ElementType *x = qtree->point(qp);
+            Neighbors nbrs = s.neighbors(qp);
+            s.seed[qp] = nearest_leaf(x);
+            scan_leaf(x, s.seed[qp], nbrs);
+        }
+        s.init_bounds(0);
+
+        dual_search(0, 0, box_dist(0, *qtree, 0), s);
+
+        for (size_t qp = 0; qp < queries.rows; qp++) {
+            const int row = qtree->ids[qp];
+            std::copy(&s.dists[qp * knn], &s.dists[qp * knn] + knn,
+                      dists[row]);
+            std::copy(&s.idx[qp * knn], &s.idx[qp * knn] + knn,
+                      indices[row]);
+        }
+    }
+
+    virtual bool searches_bags() const { return true; }
+
+    virtual size_t size() const { return data.rows; }
+    virtual size_t veclen() const { return data.cols; }
+
+    virtual size_t usedMemory() const {
+        return ids.capacity() * sizeof(int)
+             + (points.capacity() + lo.capacity() + hi.capacity())
+               * sizeof(ElementType)
+             + diags.capacity() * sizeof(DistanceType)
+             + nodes.capacity() * sizeof(Node);
+    }
+};
+
+}
+
+#endif
@@ -33,7 +33,13 @@
 namespace npdivs {
 
 // explicit instantiations
-template void fix_terms(std::vector<float> &terms, double ub);
-template void fix_terms(std::vector<double> &terms, double ub);
+template void fix_terms(std::vector<float> &terms, double ub, CapMode mode,
+                        bool squared);
+template void fix_terms(std::vector<double> &terms, double ub, CapMode mode,
+                        bool squared);
+template double capped_sum(std::vector<float> &terms, double ub,
+                           CapMode mode);
+template double capped_sum(std::vector<double> &terms, double ub,
+                           CapMode mode);
 
 }
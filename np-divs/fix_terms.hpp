@@ -34,8 +34,13 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <vector>
 
+#include <boost/cstdint.hpp>
+
+#include "np-divs/kernels.hpp"
+
 namespace npdivs {
 
 template <typename T>
@@ -55,7 +60,25 @@ struct greater_than {
 };
 
 template <typename T>
-T quantile(std::vector<T> &vec, double p) {
+T interpolate(T smaller, T larger, double frac, bool squared) {
+    /* smaller + (larger - smaller) * frac, or if squared is true, the same
+     * between the square roots of the two, squared: if the values are
+     * squares, that gives exactly the square of what quantile() would say
+     * about their roots.
+     */
+    if (!squared)
+        return smaller + (larger - smaller) * frac;
+
+    double lo = std::sqrt((double) smaller), hi = std::sqrt((double) larger);
+    double root = lo + (hi - lo) * frac;
+
+    // squaring can round to just outside [smaller, larger]
+    T res = (T) (root * root);
+    return res < smaller ? smaller : (res > larger ? larger : res);
+}
+
+template <typename T>
+T quantile(std::vector<T> &vec, double p, bool squared = false) {
     /* Finds the p-th quantile of vec, changing its order in doing so
      * (unless it's already sorted). Assumes that vec contains no nan
      * values.
@@ -74,6 +97,9 @@ T quantile(std::vector<T> &vec, double p) {
      *
      * 3. The minimum or maximum values in vec are assigned to quantiles for
      *      probabilities outside that range.
+     *
+     * If squared is true, the interpolation is between square roots; see
+     * interpolate().
      */
     typedef typename std::vector<T>::size_type sz;
 
@@ -107,48 +133,180 @@ T quantile(std::vector<T> &vec, double p) {
             T larger = *std::min_element(vec.begin() + i + 1, vec.end());
 
             // interpolate
-            return smaller + (larger - smaller) * (t - i);
+            return interpolate(smaller, larger, t - i, squared);
         }
     }
 }
 
+// How fix_terms and friends find the quantile they cap at: exactly, from a
+// sample (see approx_quantile), or exactly unless there are at least
+// APPROX_CAP_THRESHOLD terms.
+enum CapMode { CAP_EXACT, CAP_APPROX, CAP_AUTO };
+
+const size_t APPROX_CAP_THRESHOLD = 100000;
+const size_t APPROX_CAP_SAMPLES = 20000;
+
 template <typename T>
-void fix_terms(std::vector<T> &terms, double ub = .99) {
-    /* Takes a vector of elements and replaces any infinite or very-large
-     * elements with the value of the highest non-very-large element, as well
-     * as throwing away any nan values, possibly changing the order.
-     * "Very-large" is defined as the ub-th quantile if ub < 1, otherwise the
-     * largest non-inf element. Note that values of -inf are not altered.
+T approx_quantile(const std::vector<T> &vec, double p,
+                  size_t num_samples = APPROX_CAP_SAMPLES,
+                  bool squared = false) {
+    /* Estimates the p-th quantile of vec, which must contain no nans, as the
+     * quantile() of num_samples elements picked at random (with replacement).
+     *
+     * The rank of the answer is off from p by about sqrt(p (1-p) / samples):
+     * for p = .99 and 20000 samples, that's a standard deviation of .0007, so
+     * it's almost always between the .9879 and .9921 quantiles. The samples
+     * are picked the same way each time, so the answer for a given vec
+     * doesn't change from run to run.
      */
-    typedef typename std::vector<T>::size_type sz;
+    size_t n = vec.size();
+    std::vector<T> sample(num_samples);
+
+    boost::uint32_t state = 2166136261u ^ (boost::uint32_t) n;
+    for (size_t i = 0; i < num_samples; i++) {
+        state = state * 1664525u + 1013904223u;
+        sample[i] = vec[(size_t) (((boost::uint64_t) state * n) >> 32)];
+    }
+    return quantile(sample, p, squared);
+}
 
+template <typename T>
+bool find_cutoff(std::vector<T> &terms, double ub, CapMode mode,
+                 T &cutoff, size_t &split, bool squared = false) {
+    /* Finds the value that fix_terms caps terms at, possibly changing the
+     * order of terms, which must be nonempty and contain no nans.
+     *
+     * Returns true if terms is also left partitioned around the cutoff: the
+     * elements before split are <= cutoff, and those from split on are >= it
+     * (so all of them are capped). Otherwise, each element has to be
+     * compared with the cutoff.
+     *
+     * squared is as in quantile().
+     */
     using std::max_element;
-    using std::nth_element;
-    using std::replace_if;
-    using std::remove_if;
+    using std::min_element;
 
-    T cutoff;
-    bool find_noninf_max = true;
+    size_t n = terms.size();
 
-    // throw away any nans
-    terms.erase(remove_if(terms.begin(), terms.end(), std::isnan<T>),
-                terms.end());
+    // sampling only saves time if there are more terms than samples
+    bool approx = n > APPROX_CAP_SAMPLES && (mode == CAP_APPROX
+            || (mode == CAP_AUTO && n >= APPROX_CAP_THRESHOLD));
+
+    if (ub < 1 && approx) {
+        cutoff = approx_quantile(terms, ub, APPROX_CAP_SAMPLES, squared);
+        if (!std::isinf(cutoff) && !std::isnan(cutoff))
+            return false;
+
+    } else if (ub < 1) {
+        // find the ub-th percentile, as quantile() does
+        if (ub > (n-.5) / n) {
+            cutoff = *max_element(terms.begin(), terms.end());
+            split = n;
+        } else if (ub < .5 / n) {
+            cutoff = *min_element(terms.begin(), terms.end());
+            split = 0;
+        } else {
+            double t = n * ub - .5;
+            size_t i = (size_t) std::floor(t);
+            std::nth_element(terms.begin(), terms.begin() + i, terms.end());
+
+            if (i == t) {
+                cutoff = terms[i];
+            } else {
+                T smaller = terms[i];
+                T larger = *min_element(terms.begin() + i + 1, terms.end());
+                cutoff = interpolate(smaller, larger, t - i, squared);
+            }
+            split = i + 1;
+        }
 
-    // try finding the ub-th percentile
-    if (ub < 1) {
-        cutoff = quantile(terms, ub);
-        find_noninf_max = std::isinf(cutoff) || std::isnan(cutoff);
+        if (!std::isinf(cutoff) && !std::isnan(cutoff))
+            return true;
     }
 
     // just use the highest non-inf element
-    if (find_noninf_max) {
-        cutoff = *max_element(terms.begin(), terms.end(), cmp_with_inf<T>);
-    }
+    cutoff = *max_element(terms.begin(), terms.end(), cmp_with_inf<T>);
+    return false;
+}
+
+template <typename T>
+void fix_terms(std::vector<T> &terms, double ub = .99,
+               CapMode mode = CAP_EXACT, bool squared = false) {
+    /* Takes a vector of elements and replaces any infinite or very-large
+     * elements with the value of the highest non-very-large element, as well
+     * as throwing away any nan values, possibly changing the order.
+     * "Very-large" is defined as the ub-th quantile if ub < 1 (found as mode
+     * says), otherwise the largest non-inf element. Note that values of -inf
+     * are not altered.
+     *
+     * If the terms are squares, passing squared makes the cap the square of
+     * what it would be for their roots (see interpolate()).
+     */
+    // throw away any nans
+    terms.erase(std::remove_if(terms.begin(), terms.end(), std::isnan<T>),
+                terms.end());
+    if (terms.empty())
+        return;
 
     // replace anything greater than cutoff with cutoff
-    replace_if(terms.begin(), terms.end(), greater_than<T>(cutoff), cutoff);
+    T cutoff;
+    size_t split;
+    if (find_cutoff(terms, ub, mode, cutoff, split, squared))
+        std::fill(terms.begin() + split, terms.end(), cutoff);
+    else
+        std::replace_if(terms.begin(), terms.end(),
+                        greater_than<T>(cutoff), cutoff);
+}
+
+inline double sum_terms(const double *terms, size_t n) {
+    return sum_doubles(terms, n);
 }
 
+template <typename T>
+double sum_terms(const T *terms, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += terms[i];
+    return total;
+}
+
+template <typename T>
+double capped_sum(std::vector<T> &terms, double ub = .99,
+                  CapMode mode = CAP_EXACT) {
+    /* The sum of what fix_terms(terms, ub, mode) would leave in terms, without
+     * writing the capped values back. Like fix_terms, it throws away any nans
+     * and may change the order of terms.
+     *
+     * Everything from the partition on is capped to the same value, so that
+     * part is added up with one multiplication; only when the cutoff came
+     * from the non-inf max does it need to look at every element again.
+     */
+    terms.erase(std::remove_if(terms.begin(), terms.end(), std::isnan<T>),
+                terms.end());
+    if (terms.empty())
+        return 0;
+
+    T cutoff;
+    size_t split;
+    if (find_cutoff(terms, ub, mode, cutoff, split))
+        return sum_terms(&terms[0], split)
+             + (double) (terms.size() - split) * cutoff;
+
+    double total = 0;
+    for (size_t i = 0; i < terms.size(); i++)
+        total += terms[i] > cutoff ? cutoff : terms[i];
+    return total;
+}
+
+template <typename T>
+double capped_mean(std::vector<T> &terms, double ub = .99,
+                   CapMode mode = CAP_EXACT) {
+    /* The mean of what fix_terms(terms, ub, mode) would leave in terms; see
+     * capped_sum. Divides by the number of non-nan terms.
+     */
+    double total = capped_sum(terms, ub, mode);
+    return total / terms.size();
+}
 }
 
 #endif
@@ -0,0 +1,283 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_GEMM_INDEX_HPP_
+#define NPDIVS_GEMM_INDEX_HPP_
+#include "np-divs/basics.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <flann/flann.hpp>
+
+#include "np-divs/bag_index.hpp"
+#include "np-divs/kernels.hpp"
+
+namespace npdivs {
+
+template <typename Distance>
+class GemmIndex : public BagIndex<Distance> {
+    /* An exact brute-force search that, rather than finding each distance on
+     * its own like flann's linear index, gets a whole block of them at a time
+     * from ||x - y||^2 = ||x||^2 + ||y||^2 - 2 <x, y>, where the dot products
+     * are a small matrix multiply (see kernels.hpp's dot_products). That's
+     * much kinder to the caches and the vector units once dim gets big.
+     *
+     * The expansion loses precision to cancellation, so the points are
+     * centered first, and it's only used to rule points out: each distance
+     * it gives is off by at most tol * (||x||^2 + ||y||^2) (see
+     * error_factor), so anything whose lower bound is past the k-th smallest
+     * upper bound can't be a neighbor. The rest have their distances
+     * recomputed with Distance on the original data. That's usually only a
+     * few more than k, but can be the whole bag when the points are nearly
+     * tied or far from the mean; either way the results are those of flann's
+     * linear search, up to ties.
+     *
+     * This assumes that Distance is flann::L2 or something that orders points
+     * the same way. The bag matrix must outlive the index.
+     */
+    typedef BagIndex<Distance> super;
+
+    public:
+    typedef typename super::ElementType ElementType;
+    typedef typename super::DistanceType DistanceType;
+
+    private:
+    typedef std::pair<float, int> Candidate;
+
+    // how many queries and points go into each dot_products call; the dot
+    // products for a block are 16KB, which sits comfortably in L1
+    static const size_t QUERY_BLOCK = 32;
+    static const size_t POINT_BLOCK = 128;
+
+    // how many candidates a query can pile up, beyond 4 per neighbor, before
+    // the ones that have been ruled out since are thrown away
+    static const size_t MIN_CANDIDATE_ROOM = 32;
+
+    flann::Matrix<ElementType> data;
+    Distance distance;
+
+    size_t len; // data.cols rounded up to a multiple of 16
+    std::vector<double> mean;
+    std::vector<float> points; // centered rows, each zero-padded to len
+    std::vector<float> norms; // the squared norms of points' rows
+    float tol; // see error_factor
+
+    // writes row, minus the mean, to out, padded with zeros to len; the
+    // subtraction is in double, so it's only rounded relative to the result
+    void center(const ElementType *row, float *out) const {
+        for (size_t d = 0; d < data.cols; d++)
+            out[d] = static_cast<float>(row[d] - mean[d]);
+        std::fill(out + data.cols, out + len, 0.f);
+    }
+
+    static float squared_norm(const float *x, size_t len) {
+        float norm = 0;
+        for (size_t d = 0; d < len; d++)
+            norm += x[d] * x[d];
+        return norm;
+    }
+
+    static float error_factor(size_t len) {
+        /* Each float sum of len products is off by at most about len * u
+         * times the sum of their absolute values, where u is half of
+         * epsilon, in whatever order dot_products adds them. That bounds
+         * the error in the norms and the dot product by len * u * (||x||^2 +
+         * ||y||^2), and the centering and Distance's own rounding add a few
+         * u times the same again. Twice that is plenty of slack.
+         */
+        return (4 * len + 16) * std::numeric_limits<float>::epsilon();
+    }
+
+    // sorted, the knn smallest upper bounds on the distances seen so far
+    static void add_upper(float upper, float *uppers, size_t knn) {
+        if (!(upper < uppers[knn - 1]))
+            return;
+        size_t pos = knn - 1;
+        for (; pos > 0 && upper < uppers[pos - 1]; pos--)
+            uppers[pos] = uppers[pos - 1];
+        uppers[pos] = upper;
+    }
+
+    // throws away the candidates whose lower bounds are past bound
+    static void prune(std::vector<Candidate> &cands, float bound) {
+        size_t kept = 0;
+        for (size_t j = 0; j < cands.size(); j++)
+            if (!(cands[j].first > bound))
+                cands[kept++] = cands[j];
+        cands.resize(kept);
+    }
+
+    public:
+    explicit GemmIndex(const flann::Matrix<ElementType> &data,
+                       Distance distance = Distance())
+        :
+            data(data), distance(distance),
+            len((data.cols + 15) / 16 * 16),
+            mean(data.cols, 0.), points(data.rows * len), norms(data.rows),
+            tol(error_factor(len))
+    {
+        for (size_t i = 0; i < data.rows; i++)
+            for (size_t d = 0; d < data.cols; d++)
+                mean[d] += data[i][d];
+        if (data.rows > 0)
+            for (size_t d = 0; d < data.cols; d++)
+                mean[d] /= data.rows;
+
+        for (size_t i = 0; i < data.rows; i++) {
+            float *p = &points[i * len];
+            center(data[i], p);
+            norms[i] = squared_norm(p, len);
+        }
+    }
+
+    virtual void knnSearch(const flann::Matrix<ElementType> &queries,
+                           flann::Matrix<int> &indices,
+                           flann::Matrix<DistanceType> &dists,
+                           size_t knn,
+                           const flann::SearchParams &params) const
+    {
+        SearchScratch scratch;
+        knnSearchWith(queries, indices, dists, knn, params, scratch);
+    }
+
+    virtual void knnSearchWith(const flann::Matrix<ElementType> &queries,
+                               flann::Matrix<int> &indices,
+                               flann::Matrix<DistanceType> &dists,
+                               size_t knn,
+                               const flann::SearchParams &params,
+                               SearchScratch &scratch) const
+    {   /* The search is exact, so params is ignored. Like flann's, fills in
+         * -1 and infinity past the end if there are fewer than knn points.
+         */
+        if (knn == 0)
+            return;
+
+        const size_t n = data.rows;
+        const float inf = std::numeric_limits<float>::infinity();
+
+        std::vector<float> &qs = scratch.floats[0];
+        std::vector<float> &q_norms = scratch.floats[1];
+        std::vector<float> &dots = scratch.floats[2];
+        std::vector<float> &uppers = scratch.floats[3];
+        std::vector<std::vector<Candidate> > &cands = scratch.candidates;
+        std::vector<std::pair<double, int> > &exact = scratch.exact;
+
+        qs.resize(QUERY_BLOCK * len);
+        q_norms.resize(QUERY_BLOCK);
+        dots.resize(QUERY_BLOCK * POINT_BLOCK);
+        uppers.resize(QUERY_BLOCK * knn);
+        cands.resize(QUERY_BLOCK);
+        size_t room[QUERY_BLOCK];
+
+        for (size_t q0 = 0; q0 < queries.rows; q0 += QUERY_BLOCK) {
+            const size_t nq = std::min(QUERY_BLOCK, queries.rows - q0);
+
+            for (size_t q = 0; q < nq; q++) {
+                center(queries[q0 + q], &qs[q * len]);
+                q_norms[q] = squared_norm(&qs[q * len], len);
+                std::fill(&uppers[q * knn], &uppers[q * knn] + knn, inf);
+                cands[q].clear();
+                room[q] = 4 * knn + MIN_CANDIDATE_ROOM;
+            }
+
+            // keep everything that might be among the knn nearest
+            for (size_t p0 = 0; p0 < n; p0 += POINT_BLOCK) {
+                const size_t np = std::min(POINT_BLOCK, n - p0);
+                dot_products(&qs[0], nq, &points[p0 * len], np, len,
+                             &dots[0]);
+
+                for (size_t q = 0; q < nq; q++) {
+                    float *u = &uppers[q * knn];
+                    std::vector<Candidate> &c = cands[q];
+                    const float *row_dots = &dots[q * np];
+
+                    for (size_t p = 0; p < np; p++) {
+                        float d = q_norms[q] + norms[p0 + p]
+                                - 2 * row_dots[p];
+                        float err = tol * (q_norms[q] + norms[p0 + p]);
+                        add_upper(d + err, u, knn);
+                        if (!(d - err > u[knn - 1]))
+                            c.push_back(Candidate(d - err, int(p0 + p)));
+                    }
+
+                    if (c.size() > room[q]) {
+                        prune(c, u[knn - 1]);
+                        room[q] = std::max(room[q], 2 * c.size());
+                    }
+                }
+            }
+
+            // redo the candidates' distances properly, and keep the best
+            for (size_t q = 0; q < nq; q++) {
+                const ElementType *query = queries[q0 + q];
+                std::vector<Candidate> &c = cands[q];
+                prune(c, uppers[q * knn + knn - 1]);
+
+                exact.resize(c.size());
+                for (size_t j = 0; j < c.size(); j++) {
+                    const int id = c[j].second;
+                    exact[j] = std::make_pair(
+                            double(distance(query, data[id], data.cols)), id);
+                }
+                const size_t found = std::min(knn, exact.size());
+                std::partial_sort(exact.begin(), exact.begin() + found,
+                                  exact.end());
+
+                int *idx_row = indices[q0 + q];
+                DistanceType *dist_row = dists[q0 + q];
+                for (size_t j = 0; j < knn; j++) {
+                    if (j < found) {
+                        idx_row[j] = exact[j].second;
+                        dist_row[j] = DistanceType(exact[j].first);
+                    } else {
+                        idx_row[j] = -1;
+                        dist_row[j] =
+                            std::numeric_limits<DistanceType>::infinity();
+                    }
+                }
+            }
+        }
+    }
+
+    virtual size_t size() const { return data.rows; }
+    virtual size_t veclen() const { return data.cols; }
+
+    virtual size_t usedMemory() const {
+        return mean.capacity() * sizeof(double)
+             + (points.capacity() + norms.capacity()) * sizeof(float);
+    }
+};
+
+}
+
+#endif
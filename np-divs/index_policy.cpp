@@ -0,0 +1,91 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/index_policy.hpp"
+
+#include <string>
+
+#include <flann/flann.hpp>
+
+#include "np-divs/bag_index.hpp"
+
+namespace npdivs {
+
+IndexPolicy::IndexPolicy()
+    :
+        linear_max_rows(32),
+        gemm_min_dim(8),
+        gemm_max_rows(50000),
+        forest_min_dim(4),
+        forest_trees(0)
+{ }
+
+IndexPolicy::IndexPolicy(const flann::IndexParams &params) {
+    const IndexPolicy defaults;
+    linear_max_rows = flann::get_param(params, "linear_max_rows",
+                                       defaults.linear_max_rows);
+    gemm_min_dim = flann::get_param(params, "gemm_min_dim",
+                                    defaults.gemm_min_dim);
+    gemm_max_rows = flann::get_param(params, "gemm_max_rows",
+                                     defaults.gemm_max_rows);
+    forest_min_dim = flann::get_param(params, "forest_min_dim",
+                                      defaults.forest_min_dim);
+    forest_trees = flann::get_param(params, "trees", defaults.forest_trees);
+}
+
+flann::IndexParams IndexPolicy::index_params() const {
+    // a kd-tree, to anything that only knows flann's indices
+    flann::IndexParams ps = flann::KDTreeSingleIndexParams();
+    ps[NPDIVS_ALGORITHM] = std::string("auto");
+    ps["linear_max_rows"] = linear_max_rows;
+    ps["gemm_min_dim"] = gemm_min_dim;
+    ps["gemm_max_rows"] = gemm_max_rows;
+    ps["forest_min_dim"] = forest_min_dim;
+    ps["trees"] = forest_trees;
+    return ps;
+}
+
+flann::IndexParams IndexPolicy::choose(size_t rows, size_t dim) const {
+    flann::IndexParams ps;
+    if (dim >= size_t(gemm_min_dim)
+            && (gemm_max_rows <= 0 || rows <= size_t(gemm_max_rows))) {
+        ps = flann::LinearIndexParams();
+        ps[NPDIVS_ALGORITHM] = std::string("gemm");
+    } else if (rows <= size_t(linear_max_rows)) {
+        ps = flann::LinearIndexParams();
+    } else if (forest_trees > 0 && dim >= size_t(forest_min_dim)) {
+        ps = flann::KDTreeIndexParams(forest_trees);
+    } else {
+        ps = flann::KDTreeSingleIndexParams();
+    }
+    return ps;
+}
+
+}
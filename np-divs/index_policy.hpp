@@ -0,0 +1,77 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_INDEX_POLICY_HPP_
+#define NPDIVS_INDEX_POLICY_HPP_
+#include "np-divs/basics.hpp"
+
+#include <cstddef>
+
+#include <flann/flann.hpp>
+
+namespace npdivs {
+
+struct IndexPolicy {
+    /* What the "auto" index (index_params_from_str("auto")) builds for each
+     * bag, from its size and dimension, instead of the same kind of index
+     * for every bag: gemm brute force in high dimensions, where kd-trees end
+     * up looking at every point anyway, unless the bag is so big that its
+     * quadratic cost catches up with a tree's; a linear scan for small bags,
+     * whose trees would cost more to build and walk than a scan; and a
+     * kd-tree (or, if forest_trees is set, an approximate kd-forest past
+     * forest_min_dim) for the rest.
+     *
+     * The defaults are provisional: they come from runs against a stand-in
+     * for flann, not flann's own kd-tree. `make bench_index_policy` times
+     * each kind of index over a grid of sizes and dimensions and suggests
+     * thresholds for the machine and flann it's built with; pass what it
+     * suggests as e.g.
+     * "auto:linear_max_rows=32:gemm_min_dim=8:gemm_max_rows=50000".
+     */
+    int linear_max_rows; // bags with at most this many points are scanned
+    int gemm_min_dim;    // from this many dimensions up, gemm...
+    int gemm_max_rows;   // ...for bags with at most this many; 0 for any
+    int forest_min_dim;  // a kd-forest from here up, where there's no gemm...
+    int forest_trees;    // ...of this many trees; 0 for never
+
+    IndexPolicy();
+
+    // the policy held by "auto" index params; missing values are defaults
+    explicit IndexPolicy(const flann::IndexParams &params);
+
+    // "auto" index params for this policy
+    flann::IndexParams index_params() const;
+
+    // the params for the index of one bag with rows points in dim dimensions
+    flann::IndexParams choose(size_t rows, size_t dim) const;
+};
+
+}
+#endif
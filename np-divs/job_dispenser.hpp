@@ -0,0 +1,342 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_JOB_DISPENSER_HPP_
+#define NPDIVS_JOB_DISPENSER_HPP_
+#include "np-divs/basics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace npdivs {
+
+class JobDispenser : boost::noncopyable {
+    /* Hands out the (i, j) pairs of a divergence matrix to worker threads.
+     *
+     * Jobs are numbered 0 .. size()-1; next() claims a number by bumping an
+     * atomic counter and decodes it into a pair on the fly, so there's no
+     * lock to fight over and nothing stored per job.
+     *
+     * If triangular, the jobs are the lower triangle of a rows x rows matrix
+     * (diagonal included) in row-major order: (0,0), (1,0), (1,1), (2,0), ...
+     * Otherwise they're every element of a rows x cols matrix, row-major.
+     *
+     * If tile is more than 1, the matrix is cut into tile x tile blocks,
+     * which are handed out in that same order, one block at a time, with
+     * the jobs inside each block row-major. All the threads work through a
+     * block together, so the bags and indices they touch are just the ones
+     * for the block's rows and columns, and stay in the (shared) cache.
+     *
+     * order_by_cost() changes the order so that the expensive jobs go first;
+     * see there.
+     */
+
+    const size_t rows;
+    const size_t cols;
+    const bool triangular;
+    const size_t num_jobs;
+
+    size_t tile;
+    size_t col_tiles;
+    std::vector<size_t> tile_starts; // the first job in each tile
+
+    // only if ordered by cost: which tile (in the natural order) each entry
+    // of tile_starts is, and the bags in each row and column of the matrix
+    std::vector<size_t> tile_order;
+    std::vector<size_t> row_perm, col_perm;
+
+    boost::atomic<size_t> next_job;
+
+    const size_t show_progress;
+    boost::function<void (size_t)> print_progress;
+    boost::mutex progress_mutex;
+
+    public:
+
+    JobDispenser(size_t rows, size_t cols, bool triangular,
+                 size_t show_progress = 0,
+                 boost::function<void (size_t)> print_progress =
+                    boost::function<void (size_t)>(),
+                 size_t tile = 1)
+        :
+            rows(rows), cols(cols), triangular(triangular),
+            num_jobs(triangular ? rows * (rows + 1) / 2 : rows * cols),
+            tile(tile), col_tiles(0),
+            next_job(0),
+            show_progress(show_progress), print_progress(print_progress)
+    {
+        if (tile > 1)
+            build_tiles();
+    }
+
+    size_t size() const { return num_jobs; }
+
+    // Reorders the jobs so the most expensive come first, and the cheap ones
+    // fill in at the end while the last big ones finish: otherwise with bags
+    // of very different sizes one thread can be left grinding through a
+    // giant pair long after the others have run dry.
+    //
+    // The bags (of each side) are sorted by size, biggest first, so that
+    // tiles group bags of about the same size, and then the tiles are
+    // sorted by estimated cost (see search_cost). Tiles are kept to at most
+    // about a million, so that can bump up the tile size.
+    //
+    // Must be called before any jobs are handed out.
+    void order_by_cost(const std::vector<size_t> &row_sizes,
+                       const std::vector<size_t> &col_sizes,
+                       int dim, bool linear_index)
+    {
+        const size_t w = width();
+        tile = std::max(tile, (std::max(rows, w) + 1023) / 1024);
+        build_tiles();
+
+        row_perm = sort_by_size(row_sizes);
+        col_perm = triangular ? row_perm : sort_by_size(col_sizes);
+
+        // the cost of searching bag b for all of bag a's points is
+        // size(a) * query_cost(b), so a tile's total cost is in terms of
+        // sums of those over its rows and columns
+        std::vector<double> row_n(rows + 1, 0), row_q(rows + 1, 0);
+        for (size_t i = 0; i < rows; i++) {
+            size_t n = row_sizes[row_perm[i]];
+            row_n[i + 1] = row_n[i] + n;
+            row_q[i + 1] = row_q[i] + search_cost(1, n, dim, linear_index);
+        }
+        std::vector<double> col_n(w + 1, 0), col_q(w + 1, 0);
+        for (size_t j = 0; j < w; j++) {
+            size_t n = col_sizes[col_perm[j]];
+            col_n[j + 1] = col_n[j] + n;
+            col_q[j + 1] = col_q[j] + search_cost(1, n, dim, linear_index);
+        }
+
+        size_t num_tiles = tile_starts.size();
+        std::vector<std::pair<double, size_t> > costs(num_tiles);
+        for (size_t t = 0; t < num_tiles; t++) {
+            size_t ti, tj;
+            decode_in(t, triangular, col_tiles, ti, tj);
+            size_t i0 = ti * tile, i1 = std::min(rows, i0 + tile);
+            size_t j0 = tj * tile, j1 = std::min(w, j0 + tile);
+
+            double rn = row_n[i1] - row_n[i0], rq = row_q[i1] - row_q[i0];
+            double cn = col_n[j1] - col_n[j0], cq = col_q[j1] - col_q[j0];
+
+            // a diagonal tile's lower triangle does each pair once, which
+            // works out to half of both directions for the whole square
+            double cost = rn * cq + cn * rq;
+            if (triangular && ti == tj)
+                cost /= 2;
+
+            // negate to sort biggest first; ties stay in the natural order
+            costs[t] = std::make_pair(-cost, t);
+        }
+        std::sort(costs.begin(), costs.end());
+
+        tile_order.resize(num_tiles);
+        tile_starts.resize(num_tiles);
+        size_t start = 0;
+        for (size_t t = 0; t < num_tiles; t++) {
+            tile_order[t] = costs[t].second;
+            tile_starts[t] = start;
+            start += tile_jobs(tile_order[t]);
+        }
+    }
+
+    // A rough estimate of the work to find the nearest neighbors of
+    // `queries` points in an index of `points` points in `dim` dimensions:
+    // linear in the number of points for a linear scan, and like the classic
+    // worst-case kd-tree bound of points^(1 - 1/dim) for trees.
+    static double search_cost(size_t queries, size_t points, int dim,
+                              bool linear_index) {
+        double n = (double) points;
+        double per_query = linear_index ? n
+            : std::min(n, std::pow(n, 1 - 1. / std::max(dim, 1))
+                          + std::log(n + 1) / std::log(2.));
+        return queries * per_query;
+    }
+
+    // Claims the next job, putting its pair in i and j. Returns false once
+    // there aren't any left (or abort() has been called).
+    //
+    // Calls print_progress with the number of jobs left (counting this one)
+    // whenever that's a multiple of show_progress.
+    bool next(size_t &i, size_t &j) {
+        size_t job = next_job.fetch_add(1, boost::memory_order_relaxed);
+        if (job >= num_jobs)
+            return false;
+
+        size_t left = num_jobs - job;
+        if (show_progress && left % show_progress == 0) {
+            boost::mutex::scoped_lock the_lock(progress_mutex);
+            print_progress(left);
+        }
+
+        decode(job, i, j);
+        return true;
+    }
+
+    // Makes every later call to next() return false, so that other threads
+    // stop once they finish what they're working on.
+    void abort() {
+        next_job.store(num_jobs, boost::memory_order_relaxed);
+    }
+
+    // Finds the pair for job number job.
+    void decode(size_t job, size_t &i, size_t &j) const {
+        if (tile_starts.empty()) {
+            decode_in(job, triangular, cols, i, j);
+            return;
+        }
+
+        size_t t = std::upper_bound(tile_starts.begin(), tile_starts.end(),
+                                    job) - tile_starts.begin() - 1;
+        size_t job_in_tile = job - tile_starts[t];
+        if (!tile_order.empty())
+            t = tile_order[t];
+
+        size_t ti, tj;
+        decode_in(t, triangular, col_tiles, ti, tj);
+
+        size_t w = std::min(tile, width() - tj * tile);
+        decode_in(job_in_tile, triangular && ti == tj, w, i, j);
+        i += ti * tile;
+        j += tj * tile;
+
+        if (!row_perm.empty()) {
+            i = row_perm[i];
+            j = col_perm[j];
+            // keep to the lower triangle, though the workers don't care
+            if (triangular && j > i)
+                std::swap(i, j);
+        }
+    }
+
+    private:
+
+    size_t width() const { return triangular ? rows : cols; }
+
+    void build_tiles() {
+        size_t row_tiles = (rows + tile - 1) / tile;
+        col_tiles = (width() + tile - 1) / tile;
+
+        tile_starts.clear();
+        size_t start = 0;
+        size_t num_tiles = triangular ? row_tiles * (row_tiles + 1) / 2
+                                      : row_tiles * col_tiles;
+        for (size_t t = 0; t < num_tiles; t++) {
+            tile_starts.push_back(start);
+            start += tile_jobs(t);
+        }
+    }
+
+    // The number of jobs in tile number t (in the natural order).
+    size_t tile_jobs(size_t t) const {
+        size_t ti, tj;
+        decode_in(t, triangular, col_tiles, ti, tj);
+        size_t h = std::min(tile, rows - ti * tile);
+        if (triangular && ti == tj)
+            return h * (h + 1) / 2;
+        return h * std::min(tile, width() - tj * tile);
+    }
+
+    static bool bigger_first(const std::pair<size_t, size_t> &a,
+                             const std::pair<size_t, size_t> &b) {
+        return a.first > b.first;
+    }
+
+    static std::vector<size_t> sort_by_size(const std::vector<size_t> &sizes)
+    {
+        std::vector<std::pair<size_t, size_t> > by_size(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++)
+            by_size[i] = std::make_pair(sizes[i], i);
+        std::stable_sort(by_size.begin(), by_size.end(), bigger_first);
+
+        std::vector<size_t> perm(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++)
+            perm[i] = by_size[i].second;
+        return perm;
+    }
+
+    // Finds the pair for job number job in a row-major ordering of a matrix
+    // with ncols columns, or of its lower triangle.
+    static void decode_in(size_t job, bool triangular, size_t ncols,
+                          size_t &i, size_t &j) {
+        if (!triangular) {
+            i = job / ncols;
+            j = job % ncols;
+            return;
+        }
+
+        // row i starts at job i(i+1)/2; solve for i, then fix up any
+        // floating-point error in the square root
+        i = (size_t) ((std::sqrt(8. * job + 1) - 1) / 2);
+        while (i * (i + 1) / 2 > job)
+            i--;
+        while ((i + 1) * (i + 2) / 2 <= job)
+            i++;
+        j = job - i * (i + 1) / 2;
+    }
+};
+
+inline size_t shared_cache_size() {
+    /* The size of the largest CPU cache, in bytes, or a guess if we can't
+     * tell.
+     */
+    long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size <= 0)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    return size > 0 ? (size_t) size : 8 * 1024 * 1024;
+}
+
+inline size_t choose_tile_size(size_t bytes_per_bag,
+                               size_t cache_bytes = shared_cache_size()) {
+    /* A tile touches tile row bags and tile column bags (and their indices);
+     * pick the biggest one whose working set fits in half the cache, leaving
+     * the rest for the search scratch space and everything else.
+     */
+    size_t tile = cache_bytes / 2 / (2 * std::max(bytes_per_bag, (size_t) 1));
+    return std::max(tile, (size_t) 1);
+}
+
+}
+
+#endif
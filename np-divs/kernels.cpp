@@ -0,0 +1,844 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/kernels.hpp"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <boost/throw_exception.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NPDIVS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace npdivs {
+
+using std::string;
+
+////////////////////////////////////////////////////////////////////////////////
+// scalar versions: the reference results
+
+namespace {
+
+void divide_floats_scalar(const float *a, const float *b, size_t n,
+                          float *out) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = a[i] / b[i];
+}
+
+void log_floats_scalar(const float *x, size_t n, double *out) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = std::log((double) x[i]);
+}
+
+void pow_floats_scalar(const float *x, size_t n, double ex, double log_mult,
+                       double *out) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = std::exp(ex * std::log((double) x[i]) + log_mult);
+}
+
+double sum_exp_as_floats_scalar(const double *y, size_t n, double ex) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += (float) std::exp(ex * y[i]);
+    return total;
+}
+
+double sum_doubles_scalar(const double *x, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += x[i];
+    return total;
+}
+
+void dot_products_scalar(const float *x, size_t nx, const float *y,
+                         size_t ny, size_t len, float *out) {
+    for (size_t i = 0; i < nx; i++)
+        for (size_t j = 0; j < ny; j++) {
+            const float *a = x + i * len, *b = y + j * len;
+            float total = 0;
+            for (size_t d = 0; d < len; d++)
+                total += a[d] * b[d];
+            out[i * ny + j] = total;
+        }
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 and AVX-512 versions
+//
+// These are compiled with target attributes rather than flags for the whole
+// file, so that the library still runs on CPUs without them. log and exp are
+// the rational approximations from Cephes (exp) and fdlibm (log), which
+// are good to about an ulp.
+
+#ifdef NPDIVS_X86_KERNELS
+
+#define NPDIVS_AVX2 __attribute__((target("avx2")))
+#define NPDIVS_AVX512 __attribute__((target("avx512f")))
+
+// gcc 12's AVX-512 intrinsics fill unused lanes from _mm*_undefined_*, which
+// -Wall reports as uninitialized once they're inlined into our helpers
+#if defined(__GNUC__) && !defined(__clang__)
+#define NPDIVS_AVX512_QUIET_BEGIN \
+    _Pragma("GCC diagnostic push") \
+    _Pragma("GCC diagnostic ignored \"-Wuninitialized\"") \
+    _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define NPDIVS_AVX512_QUIET_END _Pragma("GCC diagnostic pop")
+#else
+#define NPDIVS_AVX512_QUIET_BEGIN
+#define NPDIVS_AVX512_QUIET_END
+#endif
+
+namespace {
+
+// exp(x) overflows above this, and rounds to 0 below the second
+const double EXP_HI = 709.782712893383996843;
+const double EXP_LO = -745.133219101941108420;
+
+const double LOG2E = 1.4426950408889634073599;
+const double LN2_HI = 6.93145751953125e-1; // ln 2 = LN2_HI + LN2_LO
+const double LN2_LO = 1.42860682030941723212e-6;
+const double EXP_P[] = { 1.26177193074810590878e-4,
+                         3.02994407707441961300e-2,
+                         9.99999999999999999910e-1 };
+const double EXP_Q[] = { 3.00198505138664455042e-6,
+                         2.52448340349684104192e-3,
+                         2.27265548208155028766e-1,
+                         2.00000000000000000009e0 };
+
+const double SQRTH = 0.70710678118654752440;
+const double LOG_HI = 6.93147180369123816490e-01; // ln 2 = LOG_HI + LOG_LO
+const double LOG_LO = 1.90821492927058770002e-10;
+const double LOG_LG[] = { 6.666666666666735130e-01,
+                          3.999999999940941908e-01,
+                          2.857142874366239149e-01,
+                          2.222219843214978396e-01,
+                          1.818357216161805012e-01,
+                          1.531383769920937332e-01,
+                          1.479819860511658591e-01 };
+
+
+// Splits eight floats into m * 2^e with m in [.5, 1), for the logs. Doesn't
+// handle 0, inf, nan or negatives; the callers fix those up afterwards.
+NPDIVS_AVX2 inline void split_floats(__m256 x, __m256 &m, __m256i &e) {
+    // scale subnormals up so that they have an exponent
+    const __m256 subnormal = _mm256_cmp_ps(x,
+            _mm256_set1_ps(std::numeric_limits<float>::min()), _CMP_LT_OQ);
+    x = _mm256_blendv_ps(x, _mm256_mul_ps(x, _mm256_set1_ps(33554432.f)),
+                         subnormal); // 2^25
+    const __m256i shift = _mm256_and_si256(_mm256_castps_si256(subnormal),
+                                           _mm256_set1_epi32(25));
+
+    const __m256i bits = _mm256_castps_si256(x);
+    e = _mm256_sub_epi32(
+            _mm256_and_si256(_mm256_srli_epi32(bits, 23),
+                             _mm256_set1_epi32(0xff)),
+            _mm256_add_epi32(_mm256_set1_epi32(126), shift));
+    m = _mm256_castsi256_ps(_mm256_or_si256(
+            _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+            _mm256_set1_epi32(0x3f000000)));
+}
+
+
+NPDIVS_AVX2 inline __m256d exp_avx2(__m256d x) {
+    const __m256d c = _mm256_min_pd(_mm256_max_pd(x,
+                _mm256_set1_pd(EXP_LO)), _mm256_set1_pd(EXP_HI));
+
+    const __m256d fn = _mm256_floor_pd(_mm256_add_pd(
+                _mm256_mul_pd(c, _mm256_set1_pd(LOG2E)), _mm256_set1_pd(.5)));
+    __m256d r = _mm256_sub_pd(c, _mm256_mul_pd(fn, _mm256_set1_pd(LN2_HI)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(fn, _mm256_set1_pd(LN2_LO)));
+
+    const __m256d rr = _mm256_mul_pd(r, r);
+    __m256d p = _mm256_set1_pd(EXP_P[0]);
+    p = _mm256_add_pd(_mm256_mul_pd(p, rr), _mm256_set1_pd(EXP_P[1]));
+    p = _mm256_add_pd(_mm256_mul_pd(p, rr), _mm256_set1_pd(EXP_P[2]));
+    p = _mm256_mul_pd(p, r);
+    __m256d q = _mm256_set1_pd(EXP_Q[0]);
+    q = _mm256_add_pd(_mm256_mul_pd(q, rr), _mm256_set1_pd(EXP_Q[1]));
+    q = _mm256_add_pd(_mm256_mul_pd(q, rr), _mm256_set1_pd(EXP_Q[2]));
+    q = _mm256_add_pd(_mm256_mul_pd(q, rr), _mm256_set1_pd(EXP_Q[3]));
+    r = _mm256_div_pd(p, _mm256_sub_pd(q, p));
+    r = _mm256_add_pd(_mm256_set1_pd(1.), _mm256_add_pd(r, r));
+
+    // multiply by 2^n in two steps, so that neither factor leaves the range
+    // of normal doubles even when the answer is huge or subnormal
+    const __m128i n = _mm256_cvtpd_epi32(fn);
+    const __m128i n1 = _mm_srai_epi32(n, 1);
+    const __m128i n2 = _mm_sub_epi32(n, n1);
+    const __m256i bias = _mm256_set1_epi64x(1023);
+    r = _mm256_mul_pd(r, _mm256_castsi256_pd(_mm256_slli_epi64(
+                _mm256_add_epi64(_mm256_cvtepi32_epi64(n1), bias), 52)));
+    r = _mm256_mul_pd(r, _mm256_castsi256_pd(_mm256_slli_epi64(
+                _mm256_add_epi64(_mm256_cvtepi32_epi64(n2), bias), 52)));
+
+    r = _mm256_blendv_pd(r, _mm256_set1_pd(
+                std::numeric_limits<double>::infinity()),
+            _mm256_cmp_pd(x, _mm256_set1_pd(EXP_HI), _CMP_GT_OQ));
+    r = _mm256_blendv_pd(r, _mm256_setzero_pd(),
+            _mm256_cmp_pd(x, _mm256_set1_pd(EXP_LO), _CMP_LT_OQ));
+    return _mm256_blendv_pd(r, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+NPDIVS_AVX2 inline __m256d log_avx2(__m256d x, __m256d m, __m128i e) {
+    /* log(x), given the split of x into m * 2^e. */
+    __m256d fe = _mm256_cvtepi32_pd(e);
+
+    const __m256d small = _mm256_cmp_pd(m, _mm256_set1_pd(SQRTH), _CMP_LT_OQ);
+    fe = _mm256_sub_pd(fe, _mm256_and_pd(small, _mm256_set1_pd(1.)));
+    const __m256d f = _mm256_sub_pd(
+            _mm256_add_pd(m, _mm256_and_pd(small, m)), _mm256_set1_pd(1.));
+
+    // log(1+f) = f - f^2/2 + s (f^2/2 + R(s^2)), where s = f / (2+f)
+    const __m256d s = _mm256_div_pd(f, _mm256_add_pd(_mm256_set1_pd(2.), f));
+    const __m256d z = _mm256_mul_pd(s, s);
+    const __m256d w = _mm256_mul_pd(z, z);
+    __m256d t1 = _mm256_set1_pd(LOG_LG[5]);
+    t1 = _mm256_add_pd(_mm256_mul_pd(t1, w), _mm256_set1_pd(LOG_LG[3]));
+    t1 = _mm256_add_pd(_mm256_mul_pd(t1, w), _mm256_set1_pd(LOG_LG[1]));
+    t1 = _mm256_mul_pd(t1, w);
+    __m256d t2 = _mm256_set1_pd(LOG_LG[6]);
+    t2 = _mm256_add_pd(_mm256_mul_pd(t2, w), _mm256_set1_pd(LOG_LG[4]));
+    t2 = _mm256_add_pd(_mm256_mul_pd(t2, w), _mm256_set1_pd(LOG_LG[2]));
+    t2 = _mm256_add_pd(_mm256_mul_pd(t2, w), _mm256_set1_pd(LOG_LG[0]));
+    t2 = _mm256_mul_pd(t2, z);
+    const __m256d hfsq = _mm256_mul_pd(_mm256_set1_pd(.5),
+                                       _mm256_mul_pd(f, f));
+
+    __m256d y = _mm256_mul_pd(s, _mm256_add_pd(hfsq, _mm256_add_pd(t1, t2)));
+    y = _mm256_add_pd(y, _mm256_mul_pd(fe, _mm256_set1_pd(LOG_LO)));
+    y = _mm256_sub_pd(_mm256_sub_pd(hfsq, y), f);
+    y = _mm256_sub_pd(_mm256_mul_pd(fe, _mm256_set1_pd(LOG_HI)), y);
+
+    // log 0 = -inf, log inf = inf, log of a negative or nan is nan
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    y = _mm256_blendv_pd(y, _mm256_sub_pd(zero, inf),
+                         _mm256_cmp_pd(x, zero, _CMP_EQ_OQ));
+    y = _mm256_blendv_pd(y, inf, _mm256_cmp_pd(x, inf, _CMP_EQ_OQ));
+    return _mm256_blendv_pd(y, _mm256_set1_pd(
+                std::numeric_limits<double>::quiet_NaN()),
+            _mm256_cmp_pd(x, zero, _CMP_NGE_UQ));
+}
+
+NPDIVS_AVX2 inline void log8_avx2(__m256 x, __m256d &lo, __m256d &hi) {
+    /* The logs of eight floats, as two sets of four doubles. */
+    __m256 m;
+    __m256i e;
+    split_floats(x, m, e);
+
+    lo = log_avx2(_mm256_cvtps_pd(_mm256_castps256_ps128(x)),
+                  _mm256_cvtps_pd(_mm256_castps256_ps128(m)),
+                  _mm256_castsi256_si128(e));
+    hi = log_avx2(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)),
+                  _mm256_cvtps_pd(_mm256_extractf128_ps(m, 1)),
+                  _mm256_extracti128_si256(e, 1));
+}
+
+NPDIVS_AVX2 inline __m256 load_tail_ps(const float *x, size_t n, float pad) {
+    /* Loads the last n < 8 elements of x, padded out with pad. */
+    float buf[8];
+    for (size_t i = 0; i < 8; i++)
+        buf[i] = i < n ? x[i] : pad;
+    return _mm256_loadu_ps(buf);
+}
+
+NPDIVS_AVX2 inline double hsum_avx2(__m256d v) {
+    double buf[4];
+    _mm256_storeu_pd(buf, v);
+    return (buf[0] + buf[1]) + (buf[2] + buf[3]);
+}
+
+
+NPDIVS_AVX2 void divide_floats_avx2(const float *a, const float *b, size_t n,
+                                    float *out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_div_ps(
+                    _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    for (; i < n; i++)
+        out[i] = a[i] / b[i];
+}
+
+NPDIVS_AVX2 void log_floats_avx2(const float *x, size_t n, double *out) {
+    __m256d lo, hi;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        log8_avx2(_mm256_loadu_ps(x + i), lo, hi);
+        _mm256_storeu_pd(out + i, lo);
+        _mm256_storeu_pd(out + i + 4, hi);
+    }
+    if (i < n) {
+        double buf[8];
+        log8_avx2(load_tail_ps(x + i, n - i, 1.f), lo, hi);
+        _mm256_storeu_pd(buf, lo);
+        _mm256_storeu_pd(buf + 4, hi);
+        for (size_t j = 0; i < n; i++, j++)
+            out[i] = buf[j];
+    }
+}
+
+NPDIVS_AVX2 inline void pow8_avx2(__m256 x, double ex, double log_mult,
+                                  __m256d &lo, __m256d &hi) {
+    const __m256d vex = _mm256_set1_pd(ex), vlm = _mm256_set1_pd(log_mult);
+    log8_avx2(x, lo, hi);
+    lo = exp_avx2(_mm256_add_pd(_mm256_mul_pd(lo, vex), vlm));
+    hi = exp_avx2(_mm256_add_pd(_mm256_mul_pd(hi, vex), vlm));
+}
+
+NPDIVS_AVX2 void pow_floats_avx2(const float *x, size_t n, double ex,
+                                 double log_mult, double *out) {
+    __m256d lo, hi;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        pow8_avx2(_mm256_loadu_ps(x + i), ex, log_mult, lo, hi);
+        _mm256_storeu_pd(out + i, lo);
+        _mm256_storeu_pd(out + i + 4, hi);
+    }
+    if (i < n) {
+        double buf[8];
+        pow8_avx2(load_tail_ps(x + i, n - i, 1.f), ex, log_mult, lo, hi);
+        _mm256_storeu_pd(buf, lo);
+        _mm256_storeu_pd(buf + 4, hi);
+        for (size_t j = 0; i < n; i++, j++)
+            out[i] = buf[j];
+    }
+}
+
+NPDIVS_AVX2 inline __m256d exp_as_floats_avx2(__m256d y, __m256d vex) {
+    return _mm256_cvtps_pd(_mm256_cvtpd_ps(exp_avx2(_mm256_mul_pd(y, vex))));
+}
+
+NPDIVS_AVX2 double sum_exp_as_floats_avx2(const double *y, size_t n,
+                                          double ex) {
+    const __m256d vex = _mm256_set1_pd(ex);
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_add_pd(acc,
+                exp_as_floats_avx2(_mm256_loadu_pd(y + i), vex));
+
+    double total = hsum_avx2(acc);
+    if (i < n) {
+        double buf[4] = { 0, 0, 0, 0 };
+        for (size_t j = 0; i + j < n; j++)
+            buf[j] = y[i + j];
+        _mm256_storeu_pd(buf, exp_as_floats_avx2(_mm256_loadu_pd(buf), vex));
+        for (size_t j = 0; i < n; i++, j++)
+            total += buf[j];
+    }
+    return total;
+}
+
+NPDIVS_AVX2 double sum_doubles_avx2(const double *x, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+    }
+    double total = hsum_avx2(_mm256_add_pd(acc0, acc1));
+    for (; i < n; i++)
+        total += x[i];
+    return total;
+}
+
+NPDIVS_AVX2 inline float hsum_ps_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+}
+
+NPDIVS_AVX2 inline float dot_avx2(const float *a, const float *b,
+                                  size_t len) {
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t d = 0; d < len; d += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + d),
+                                               _mm256_loadu_ps(b + d)));
+    return hsum_ps_avx2(acc);
+}
+
+// acc += u * v
+#define NPDIVS_MADD_AVX2(acc, u, v) \
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(u, v))
+
+NPDIVS_AVX2 void dot_products_avx2(const float *x, size_t nx,
+                                   const float *y, size_t ny,
+                                   size_t len, float *out) {
+    /* Two rows of x against four of y at a time, so that each load feeds
+     * several multiplies; the eight sums fit in registers.
+     */
+    size_t i = 0;
+    for (; i + 2 <= nx; i += 2) {
+        const float *x0 = x + i * len, *x1 = x0 + len;
+        float *out0 = out + i * ny, *out1 = out0 + ny;
+
+        size_t j = 0;
+        for (; j + 4 <= ny; j += 4) {
+            const float *y0 = y + j * len, *y1 = y0 + len,
+                        *y2 = y1 + len, *y3 = y2 + len;
+            __m256 a00 = _mm256_setzero_ps(), a01 = a00, a02 = a00, a03 = a00,
+                   a10 = a00, a11 = a00, a12 = a00, a13 = a00;
+            for (size_t d = 0; d < len; d += 8) {
+                const __m256 u0 = _mm256_loadu_ps(x0 + d),
+                             u1 = _mm256_loadu_ps(x1 + d);
+                __m256 v = _mm256_loadu_ps(y0 + d);
+                NPDIVS_MADD_AVX2(a00, u0, v); NPDIVS_MADD_AVX2(a10, u1, v);
+                v = _mm256_loadu_ps(y1 + d);
+                NPDIVS_MADD_AVX2(a01, u0, v); NPDIVS_MADD_AVX2(a11, u1, v);
+                v = _mm256_loadu_ps(y2 + d);
+                NPDIVS_MADD_AVX2(a02, u0, v); NPDIVS_MADD_AVX2(a12, u1, v);
+                v = _mm256_loadu_ps(y3 + d);
+                NPDIVS_MADD_AVX2(a03, u0, v); NPDIVS_MADD_AVX2(a13, u1, v);
+            }
+            out0[j] = hsum_ps_avx2(a00); out0[j+1] = hsum_ps_avx2(a01);
+            out0[j+2] = hsum_ps_avx2(a02); out0[j+3] = hsum_ps_avx2(a03);
+            out1[j] = hsum_ps_avx2(a10); out1[j+1] = hsum_ps_avx2(a11);
+            out1[j+2] = hsum_ps_avx2(a12); out1[j+3] = hsum_ps_avx2(a13);
+        }
+        for (; j < ny; j++) {
+            out0[j] = dot_avx2(x0, y + j * len, len);
+            out1[j] = dot_avx2(x1, y + j * len, len);
+        }
+    }
+    for (; i < nx; i++)
+        for (size_t j = 0; j < ny; j++)
+            out[i * ny + j] = dot_avx2(x + i * len, y + j * len, len);
+}
+
+#undef NPDIVS_MADD_AVX2
+
+
+NPDIVS_AVX512_QUIET_BEGIN
+
+NPDIVS_AVX512 inline __m512d exp_avx512(__m512d x) {
+    const __m512d c = _mm512_min_pd(_mm512_max_pd(x,
+                _mm512_set1_pd(EXP_LO)), _mm512_set1_pd(EXP_HI));
+
+    const __m512d fn = _mm512_roundscale_pd(_mm512_add_pd(
+                _mm512_mul_pd(c, _mm512_set1_pd(LOG2E)), _mm512_set1_pd(.5)),
+            _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_sub_pd(c, _mm512_mul_pd(fn, _mm512_set1_pd(LN2_HI)));
+    r = _mm512_sub_pd(r, _mm512_mul_pd(fn, _mm512_set1_pd(LN2_LO)));
+
+    const __m512d rr = _mm512_mul_pd(r, r);
+    __m512d p = _mm512_set1_pd(EXP_P[0]);
+    p = _mm512_add_pd(_mm512_mul_pd(p, rr), _mm512_set1_pd(EXP_P[1]));
+    p = _mm512_add_pd(_mm512_mul_pd(p, rr), _mm512_set1_pd(EXP_P[2]));
+    p = _mm512_mul_pd(p, r);
+    __m512d q = _mm512_set1_pd(EXP_Q[0]);
+    q = _mm512_add_pd(_mm512_mul_pd(q, rr), _mm512_set1_pd(EXP_Q[1]));
+    q = _mm512_add_pd(_mm512_mul_pd(q, rr), _mm512_set1_pd(EXP_Q[2]));
+    q = _mm512_add_pd(_mm512_mul_pd(q, rr), _mm512_set1_pd(EXP_Q[3]));
+    r = _mm512_div_pd(p, _mm512_sub_pd(q, p));
+    r = _mm512_add_pd(_mm512_set1_pd(1.), _mm512_add_pd(r, r));
+
+    // as in exp_avx2
+    const __m256i n = _mm512_cvtpd_epi32(fn);
+    const __m256i n1 = _mm256_srai_epi32(n, 1);
+    const __m256i n2 = _mm256_sub_epi32(n, n1);
+    const __m512i bias = _mm512_set1_epi64(1023);
+    r = _mm512_mul_pd(r, _mm512_castsi512_pd(_mm512_slli_epi64(
+                _mm512_add_epi64(_mm512_cvtepi32_epi64(n1), bias), 52)));
+    r = _mm512_mul_pd(r, _mm512_castsi512_pd(_mm512_slli_epi64(
+                _mm512_add_epi64(_mm512_cvtepi32_epi64(n2), bias), 52)));
+
+    r = _mm512_mask_mov_pd(r,
+            _mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_HI), _CMP_GT_OQ),
+            _mm512_set1_pd(std::numeric_limits<double>::infinity()));
+    r = _mm512_mask_mov_pd(r,
+            _mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_LO), _CMP_LT_OQ),
+            _mm512_setzero_pd());
+    return _mm512_mask_mov_pd(r, _mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), x);
+}
+
+NPDIVS_AVX512 inline __m512d log8_avx512(__m256 x8) {
+    /* The logs of eight floats. */
+    __m256 m8;
+    __m256i e;
+    split_floats(x8, m8, e);
+
+    const __m512d x = _mm512_cvtps_pd(x8);
+    const __m512d m = _mm512_cvtps_pd(m8);
+    __m512d fe = _mm512_cvtepi32_pd(e);
+
+    const __mmask8 small = _mm512_cmp_pd_mask(m, _mm512_set1_pd(SQRTH),
+                                              _CMP_LT_OQ);
+    fe = _mm512_mask_sub_pd(fe, small, fe, _mm512_set1_pd(1.));
+    const __m512d f = _mm512_sub_pd(_mm512_mask_add_pd(m, small, m, m),
+                                    _mm512_set1_pd(1.));
+
+    // log(1+f) = f - f^2/2 + s (f^2/2 + R(s^2)), where s = f / (2+f)
+    const __m512d s = _mm512_div_pd(f, _mm512_add_pd(_mm512_set1_pd(2.), f));
+    const __m512d z = _mm512_mul_pd(s, s);
+    const __m512d w = _mm512_mul_pd(z, z);
+    __m512d t1 = _mm512_set1_pd(LOG_LG[5]);
+    t1 = _mm512_add_pd(_mm512_mul_pd(t1, w), _mm512_set1_pd(LOG_LG[3]));
+    t1 = _mm512_add_pd(_mm512_mul_pd(t1, w), _mm512_set1_pd(LOG_LG[1]));
+    t1 = _mm512_mul_pd(t1, w);
+    __m512d t2 = _mm512_set1_pd(LOG_LG[6]);
+    t2 = _mm512_add_pd(_mm512_mul_pd(t2, w), _mm512_set1_pd(LOG_LG[4]));
+    t2 = _mm512_add_pd(_mm512_mul_pd(t2, w), _mm512_set1_pd(LOG_LG[2]));
+    t2 = _mm512_add_pd(_mm512_mul_pd(t2, w), _mm512_set1_pd(LOG_LG[0]));
+    t2 = _mm512_mul_pd(t2, z);
+    const __m512d hfsq = _mm512_mul_pd(_mm512_set1_pd(.5),
+                                       _mm512_mul_pd(f, f));
+
+    __m512d y = _mm512_mul_pd(s, _mm512_add_pd(hfsq, _mm512_add_pd(t1, t2)));
+    y = _mm512_add_pd(y, _mm512_mul_pd(fe, _mm512_set1_pd(LOG_LO)));
+    y = _mm512_sub_pd(_mm512_sub_pd(hfsq, y), f);
+    y = _mm512_sub_pd(_mm512_mul_pd(fe, _mm512_set1_pd(LOG_HI)), y);
+
+    // as in log_avx2
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d inf = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+    y = _mm512_mask_mov_pd(y, _mm512_cmp_pd_mask(x, zero, _CMP_EQ_OQ),
+                           _mm512_sub_pd(zero, inf));
+    y = _mm512_mask_mov_pd(y, _mm512_cmp_pd_mask(x, inf, _CMP_EQ_OQ), inf);
+    return _mm512_mask_mov_pd(y, _mm512_cmp_pd_mask(x, zero, _CMP_NGE_UQ),
+            _mm512_set1_pd(std::numeric_limits<double>::quiet_NaN()));
+}
+
+NPDIVS_AVX512_QUIET_END
+
+NPDIVS_AVX512 void divide_floats_avx512(const float *a, const float *b,
+                                        size_t n, float *out) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(out + i, _mm512_div_ps(
+                    _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    if (i < n) {
+        const __mmask16 tail = (__mmask16) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(out + i, tail, _mm512_div_ps(
+                    _mm512_mask_loadu_ps(_mm512_set1_ps(1.f), tail, a + i),
+                    _mm512_mask_loadu_ps(_mm512_set1_ps(1.f), tail, b + i)));
+    }
+}
+
+NPDIVS_AVX512 void log_floats_avx512(const float *x, size_t n, double *out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm512_storeu_pd(out + i, log8_avx512(_mm256_loadu_ps(x + i)));
+    if (i < n) {
+        const __mmask8 tail = (__mmask8) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_pd(out + i, tail,
+                log8_avx512(load_tail_ps(x + i, n - i, 1.f)));
+    }
+}
+
+NPDIVS_AVX512 inline __m512d pow8_avx512(__m256 x, __m512d vex, __m512d vlm) {
+    return exp_avx512(_mm512_add_pd(_mm512_mul_pd(log8_avx512(x), vex), vlm));
+}
+
+NPDIVS_AVX512 void pow_floats_avx512(const float *x, size_t n, double ex,
+                                     double log_mult, double *out) {
+    const __m512d vex = _mm512_set1_pd(ex), vlm = _mm512_set1_pd(log_mult);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm512_storeu_pd(out + i, pow8_avx512(_mm256_loadu_ps(x + i),
+                                              vex, vlm));
+    if (i < n) {
+        const __mmask8 tail = (__mmask8) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_pd(out + i, tail,
+                pow8_avx512(load_tail_ps(x + i, n - i, 1.f), vex, vlm));
+    }
+}
+
+NPDIVS_AVX512 inline double hsum_avx512(__m512d v) {
+    /* By hand, through memory: gcc 12's _mm512_reduce_add_pd, and its
+     * casts to the 256-bit halves, trip -Wuninitialized. */
+    double buf[8];
+    _mm512_storeu_pd(buf, v);
+    return hsum_avx2(_mm256_add_pd(_mm256_loadu_pd(buf),
+                                   _mm256_loadu_pd(buf + 4)));
+}
+
+NPDIVS_AVX512_QUIET_BEGIN
+
+NPDIVS_AVX512 inline __m512d exp_as_floats_avx512(__m512d y, __m512d vex) {
+    return _mm512_cvtps_pd(_mm512_cvtpd_ps(
+                exp_avx512(_mm512_mul_pd(y, vex))));
+}
+
+NPDIVS_AVX512_QUIET_END
+
+NPDIVS_AVX512 double sum_exp_as_floats_avx512(const double *y, size_t n,
+                                              double ex) {
+    const __m512d vex = _mm512_set1_pd(ex);
+    __m512d acc = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm512_add_pd(acc,
+                exp_as_floats_avx512(_mm512_loadu_pd(y + i), vex));
+    if (i < n) {
+        const __mmask8 tail = (__mmask8) ((1u << (n - i)) - 1);
+        acc = _mm512_mask_add_pd(acc, tail, acc, exp_as_floats_avx512(
+                    _mm512_maskz_loadu_pd(tail, y + i), vex));
+    }
+    return hsum_avx512(acc);
+}
+
+NPDIVS_AVX512 double sum_doubles_avx512(const double *x, size_t n) {
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(x + i));
+        acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(x + i + 8));
+    }
+    for (; i + 8 <= n; i += 8)
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(x + i));
+    if (i < n)
+        acc1 = _mm512_add_pd(acc1, _mm512_maskz_loadu_pd(
+                    (__mmask8) ((1u << (n - i)) - 1), x + i));
+    return hsum_avx512(_mm512_add_pd(acc0, acc1));
+}
+
+NPDIVS_AVX512 inline float hsum_ps_avx512(__m512 v) {
+    // by hand, as in hsum_avx512
+    float buf[16];
+    _mm512_storeu_ps(buf, v);
+    return hsum_ps_avx2(_mm256_add_ps(_mm256_loadu_ps(buf),
+                                      _mm256_loadu_ps(buf + 8)));
+}
+
+NPDIVS_AVX512 inline float dot_avx512(const float *a, const float *b,
+                                      size_t len) {
+    __m512 acc = _mm512_setzero_ps();
+    for (size_t d = 0; d < len; d += 16)
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + d), _mm512_loadu_ps(b + d),
+                              acc);
+    return hsum_ps_avx512(acc);
+}
+
+// acc += u * v
+#define NPDIVS_MADD_AVX512(acc, u, v) acc = _mm512_fmadd_ps(u, v, acc)
+
+NPDIVS_AVX512 void dot_products_avx512(const float *x, size_t nx,
+                                       const float *y, size_t ny,
+                                       size_t len, float *out) {
+    /* As dot_products_avx2, but sixteen floats at a time. */
+    size_t i = 0;
+    for (; i + 2 <= nx; i += 2) {
+        const float *x0 = x + i * len, *x1 = x0 + len;
+        float *out0 = out + i * ny, *out1 = out0 + ny;
+
+        size_t j = 0;
+        for (; j + 4 <= ny; j += 4) {
+            const float *y0 = y + j * len, *y1 = y0 + len,
+                        *y2 = y1 + len, *y3 = y2 + len;
+            __m512 a00 = _mm512_setzero_ps(), a01 = a00, a02 = a00, a03 = a00,
+                   a10 = a00, a11 = a00, a12 = a00, a13 = a00;
+            for (size_t d = 0; d < len; d += 16) {
+                const __m512 u0 = _mm512_loadu_ps(x0 + d),
+                             u1 = _mm512_loadu_ps(x1 + d);
+                __m512 v = _mm512_loadu_ps(y0 + d);
+                NPDIVS_MADD_AVX512(a00, u0, v); NPDIVS_MADD_AVX512(a10, u1, v);
+                v = _mm512_loadu_ps(y1 + d);
+                NPDIVS_MADD_AVX512(a01, u0, v); NPDIVS_MADD_AVX512(a11, u1, v);
+                v = _mm512_loadu_ps(y2 + d);
+                NPDIVS_MADD_AVX512(a02, u0, v); NPDIVS_MADD_AVX512(a12, u1, v);
+                v = _mm512_loadu_ps(y3 + d);
+                NPDIVS_MADD_AVX512(a03, u0, v); NPDIVS_MADD_AVX512(a13, u1, v);
+            }
+            out0[j] = hsum_ps_avx512(a00);
+            out0[j+1] = hsum_ps_avx512(a01);
+            out0[j+2] = hsum_ps_avx512(a02);
+            out0[j+3] = hsum_ps_avx512(a03);
+            out1[j] = hsum_ps_avx512(a10);
+            out1[j+1] = hsum_ps_avx512(a11);
+            out1[j+2] = hsum_ps_avx512(a12);
+            out1[j+3] = hsum_ps_avx512(a13);
+        }
+        for (; j < ny; j++) {
+            out0[j] = dot_avx512(x0, y + j * len, len);
+            out1[j] = dot_avx512(x1, y + j * len, len);
+        }
+    }
+    for (; i < nx; i++)
+        for (size_t j = 0; j < ny; j++)
+            out[i * ny + j] = dot_avx512(x + i * len, y + j * len, len);
+}
+
+#undef NPDIVS_MADD_AVX512
+
+}
+
+#endif // NPDIVS_X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////
+// dispatch
+
+namespace {
+
+struct KernelTable {
+    void (*divide_floats)(const float *, const float *, size_t, float *);
+    void (*log_floats)(const float *, size_t, double *);
+    void (*pow_floats)(const float *, size_t, double, double, double *);
+    double (*sum_exp_as_floats)(const double *, size_t, double);
+    double (*sum_doubles)(const double *, size_t);
+    void (*dot_products)(const float *, size_t, const float *, size_t,
+                         size_t, float *);
+};
+
+const KernelTable scalar_table = {
+    divide_floats_scalar, log_floats_scalar, pow_floats_scalar,
+    sum_exp_as_floats_scalar, sum_doubles_scalar, dot_products_scalar
+};
+
+#ifdef NPDIVS_X86_KERNELS
+const KernelTable avx2_table = {
+    divide_floats_avx2, log_floats_avx2, pow_floats_avx2,
+    sum_exp_as_floats_avx2, sum_doubles_avx2, dot_products_avx2
+};
+const KernelTable avx512_table = {
+    divide_floats_avx512, log_floats_avx512, pow_floats_avx512,
+    sum_exp_as_floats_avx512, sum_doubles_avx512, dot_products_avx512
+};
+#endif
+
+const KernelTable *table_for(KernelISA isa) {
+    switch (isa) {
+#ifdef NPDIVS_X86_KERNELS
+        case KERNELS_AVX2: return &avx2_table;
+        case KERNELS_AVX512: return &avx512_table;
+#endif
+        default: return &scalar_table;
+    }
+}
+
+// scalar until the library's static initializers run, so that it's never
+// a null pointer
+KernelISA current_isa = KERNELS_SCALAR;
+const KernelTable *current = &scalar_table;
+
+struct PickBestKernels {
+    PickBestKernels() {
+        current_isa = best_kernel_isa();
+        current = table_for(current_isa);
+    }
+} pick_best_kernels;
+
+}
+
+
+bool kernel_isa_supported(KernelISA isa) {
+    switch (isa) {
+        case KERNELS_SCALAR:
+            return true;
+#ifdef NPDIVS_X86_KERNELS
+        case KERNELS_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+        case KERNELS_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+KernelISA best_kernel_isa() {
+    if (kernel_isa_supported(KERNELS_AVX512))
+        return KERNELS_AVX512;
+    if (kernel_isa_supported(KERNELS_AVX2))
+        return KERNELS_AVX2;
+    return KERNELS_SCALAR;
+}
+
+KernelISA get_kernel_isa() {
+    return current_isa;
+}
+
+void set_kernel_isa(KernelISA isa) {
+    if (!kernel_isa_supported(isa)) {
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "this CPU doesn't support the " + kernel_isa_name(isa)
+                    + " kernels"));
+    }
+    current_isa = isa;
+    current = table_for(isa);
+}
+
+string kernel_isa_name(KernelISA isa) {
+    switch (isa) {
+        case KERNELS_SCALAR: return "scalar";
+        case KERNELS_AVX2: return "avx2";
+        case KERNELS_AVX512: return "avx512";
+        default: return "unknown";
+    }
+}
+
+KernelISA kernel_isa_from_str(const string &name) {
+    if (name == "scalar")
+        return KERNELS_SCALAR;
+    else if (name == "avx2")
+        return KERNELS_AVX2;
+    else if (name == "avx512")
+        return KERNELS_AVX512;
+    BOOST_THROW_EXCEPTION(std::domain_error(
+                "unknown kernel instruction set '" + name + "'"));
+}
+
+
+void divide_floats(const float *a, const float *b, size_t n, float *out) {
+    current->divide_floats(a, b, n, out);
+}
+
+void log_floats(const float *x, size_t n, double *out) {
+    current->log_floats(x, n, out);
+}
+
+void pow_floats(const float *x, size_t n, double ex, double mult,
+                double *out) {
+    current->pow_floats(x, n, ex, mult, out);
+}
+
+double sum_exp_as_floats(const double *y, size_t n, double ex) {
+    return current->sum_exp_as_floats(y, n, ex);
+}
+
+double sum_doubles(const double *x, size_t n) {
+    return current->sum_doubles(x, n);
+}
+
+void dot_products(const float *x, size_t nx, const float *y, size_t ny,
+                  size_t len, float *out) {
+    current->dot_products(x, nx, y, ny, len, out);
+}
+
+}
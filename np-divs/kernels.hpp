@@ -0,0 +1,93 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_KERNELS_HPP_
+#define NPDIVS_KERNELS_HPP_
+#include "np-divs/basics.hpp"
+
+#include <cstddef>
+#include <string>
+
+namespace npdivs {
+
+// The elementwise loops the DivFuncs spend their time in, working directly on
+// the float rho/nu buffers. Each has a plain scalar version and, on x86 with
+// GCC or clang, AVX2 and AVX-512 versions; the best one the CPU supports is
+// picked when the library is loaded.
+//
+// The vector versions compute log and exp themselves, so their results can
+// differ from the scalar ones (which use the C library) in the last bit or
+// so, and their sums are added up in a different order.
+enum KernelISA {
+    KERNELS_SCALAR,
+    KERNELS_AVX2,
+    KERNELS_AVX512
+};
+
+KernelISA get_kernel_isa();
+bool kernel_isa_supported(KernelISA isa);
+KernelISA best_kernel_isa();
+
+// Switches every thread over to isa, e.g. to get the scalar reference results
+// or to benchmark; throws std::domain_error if the CPU doesn't support it.
+// Don't call this while np_divs is running.
+void set_kernel_isa(KernelISA isa);
+
+std::string kernel_isa_name(KernelISA isa);
+KernelISA kernel_isa_from_str(const std::string &name);
+
+
+// out[i] = a[i] / b[i]
+void divide_floats(const float *a, const float *b, size_t n, float *out);
+
+// out[i] = log(x[i])
+void log_floats(const float *x, size_t n, double *out);
+
+// out[i] = x[i]^ex * exp(log_mult), for x[i] >= 0, computed as
+// exp(ex log x[i] + log_mult) so that neither factor has to fit in a double
+void pow_floats(const float *x, size_t n, double ex, double log_mult,
+                double *out);
+
+// the sum of exp(ex * y[i]), rounding each term to a float before adding it
+double sum_exp_as_floats(const double *y, size_t n, double ex);
+
+// the sum of x[i]
+double sum_doubles(const double *x, size_t n);
+
+// out[i * ny + j] = the dot product of rows i of x and j of y, where x has nx
+// rows and y has ny, one after the other, each of len floats; len must be a
+// multiple of 16 (pad the rows with zeros). This is the matrix multiply the
+// gemm search engine spends its time in.
+void dot_products(const float *x, size_t nx, const float *y, size_t ny,
+                  size_t len, float *out);
+
+}
+
+#endif
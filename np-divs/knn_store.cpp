@@ -0,0 +1,265 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/knn_store.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace npdivs {
+
+using std::string;
+using std::vector;
+
+namespace {
+// version 2 holds squared distances; version 1 stores held plain ones
+const char KNN_STORE_MAGIC[16] = "NPDIVSKNN2";
+
+// the fixed part of the header, after the magic string
+enum {
+    H_COMPLETE, H_SAME_BAGS, H_NUM_X, H_NUM_Y, H_DIM, H_K, H_FIXED_FIELDS
+};
+
+void throw_io_error(const string &what, const string &path) {
+    boost::format err = boost::format("KNNStore: couldn't %s '%s': %s")
+        % what % path % std::strerror(errno);
+    BOOST_THROW_EXCEPTION(std::runtime_error(err.str()));
+}
+
+void throw_format_error(const string &what, const string &path) {
+    boost::format err = boost::format("KNNStore: '%s' %s") % path % what;
+    BOOST_THROW_EXCEPTION(std::runtime_error(err.str()));
+}
+}
+
+KNNStore::KNNStore(const string &path)
+    : path(path), writable(false), map(NULL), map_size(0), data(NULL)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw_io_error("open", path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw_io_error("stat", path);
+    }
+    map_size = st.st_size;
+
+    size_t min_size = sizeof(KNN_STORE_MAGIC)
+                    + H_FIXED_FIELDS * sizeof(boost::uint64_t);
+    if (map_size < min_size) {
+        close(fd);
+        throw_format_error("is too short to be a kNN store", path);
+    }
+
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        throw_io_error("map", path);
+    }
+
+    // the destructor won't run if we throw from here on, so clean up
+    try {
+        const char *bytes = (const char *) map;
+        if (std::memcmp(bytes, KNN_STORE_MAGIC, sizeof(KNN_STORE_MAGIC)) != 0)
+            throw_format_error("isn't a kNN store", path);
+
+        const boost::uint64_t *h = (const boost::uint64_t *)
+            (bytes + sizeof(KNN_STORE_MAGIC));
+        if (!h[H_COMPLETE])
+            throw_format_error("was never finished", path);
+
+        same_bags = h[H_SAME_BAGS] != 0;
+        size_t num_x = h[H_NUM_X], num_y = h[H_NUM_Y];
+        dimension = (int) h[H_DIM];
+        k_ = (int) h[H_K];
+
+        size_t num_row_counts = num_x + (same_bags ? 0 : num_y);
+        if (map_size < min_size + num_row_counts * sizeof(boost::uint64_t))
+            throw_format_error("is truncated", path);
+
+        const boost::uint64_t *rows = h + H_FIXED_FIELDS;
+        x_rows.assign(rows, rows + num_x);
+        if (same_bags)
+            y_rows = x_rows;
+        else
+            y_rows.assign(rows + num_x, rows + num_x + num_y);
+
+        compute_layout();
+        if (map_size != header_size() + total_floats * sizeof(float))
+            throw_format_error("is the wrong size", path);
+    } catch (...) {
+        munmap(map, map_size);
+        throw;
+    }
+
+    data = (float *) ((char *) map + header_size());
+}
+
+KNNStore::KNNStore(const string &path, int dim, int k,
+                   const vector<size_t> &rows)
+    : path(path), writable(true), same_bags(true), dimension(dim), k_(k),
+      x_rows(rows), y_rows(rows), map(NULL), map_size(0), data(NULL)
+{
+    create();
+}
+
+KNNStore::KNNStore(const string &path, int dim, int k,
+                   const vector<size_t> &x_rows, const vector<size_t> &y_rows)
+    : path(path), writable(true), same_bags(false), dimension(dim), k_(k),
+      x_rows(x_rows), y_rows(y_rows), map(NULL), map_size(0), data(NULL)
+{
+    create();
+}
+
+void KNNStore::create() {
+    compute_layout();
+    map_size = header_size() + total_floats * sizeof(float);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw_io_error("create", path);
+
+    if (ftruncate(fd, map_size) != 0) {
+        close(fd);
+        throw_io_error("resize", path);
+    }
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        throw_io_error("map", path);
+    }
+
+    char *bytes = (char *) map;
+    std::memcpy(bytes, KNN_STORE_MAGIC, sizeof(KNN_STORE_MAGIC));
+
+    boost::uint64_t *h = (boost::uint64_t *) (bytes + sizeof(KNN_STORE_MAGIC));
+    h[H_COMPLETE] = 0;
+    h[H_SAME_BAGS] = same_bags;
+    h[H_NUM_X] = x_rows.size();
+    h[H_NUM_Y] = y_rows.size();
+    h[H_DIM] = dimension;
+    h[H_K] = k_;
+
+    boost::uint64_t *rows = h + H_FIXED_FIELDS;
+    std::copy(x_rows.begin(), x_rows.end(), rows);
+    if (!same_bags)
+        std::copy(y_rows.begin(), y_rows.end(), rows + x_rows.size());
+
+    data = (float *) (bytes + header_size());
+}
+
+KNNStore::~KNNStore() {
+    if (map != NULL)
+        munmap(map, map_size);
+}
+
+void KNNStore::finish() {
+    if (!writable)
+        BOOST_THROW_EXCEPTION(std::logic_error(
+                    "KNNStore: can't finish a store opened for reading"));
+
+    // make sure the data's all there before we say it is
+    if (msync(map, map_size, MS_SYNC) != 0)
+        throw_io_error("sync", path);
+
+    boost::uint64_t *h = (boost::uint64_t *)
+        ((char *) map + sizeof(KNN_STORE_MAGIC));
+    h[H_COMPLETE] = 1;
+
+    if (msync(map, map_size, MS_SYNC) != 0)
+        throw_io_error("sync", path);
+}
+
+size_t KNNStore::header_size() const {
+    size_t num_row_counts = x_rows.size() + (same_bags ? 0 : y_rows.size());
+    return sizeof(KNN_STORE_MAGIC)
+        + (H_FIXED_FIELDS + num_row_counts) * sizeof(boost::uint64_t);
+}
+
+void KNNStore::compute_layout() {
+    size_t num_x = x_rows.size(), num_y = y_rows.size();
+
+    x_starts.resize(num_x);
+    x_total = 0;
+    for (size_t i = 0; i < num_x; i++) {
+        x_starts[i] = x_total;
+        x_total += x_rows[i];
+    }
+
+    y_starts.resize(num_y);
+    y_total = 0;
+    for (size_t j = 0; j < num_y; j++) {
+        y_starts[j] = y_total;
+        y_total += y_rows[j];
+    }
+
+    rho_y_off = same_bags ? 0 : x_total;
+    nu_xy_off = same_bags ? x_total : x_total + y_total;
+    nu_yx_off = nu_xy_off + x_total * num_y;
+    total_floats = same_bags ? nu_yx_off : nu_yx_off + y_total * num_x;
+}
+
+float* KNNStore::rho_x(size_t i) const {
+    return data + x_starts[i];
+}
+
+float* KNNStore::rho_y(size_t j) const {
+    return data + rho_y_off + y_starts[j];
+}
+
+float* KNNStore::nu_xy(size_t i, size_t j) const {
+    // all of x_i's blocks are together, one per y bag
+    return data + nu_xy_off + x_starts[i] * num_y() + j * x_rows[i];
+}
+
+float* KNNStore::nu_yx(size_t i, size_t j) const {
+    if (same_bags)
+        return nu_xy(j, i);
+    return data + nu_yx_off + y_starts[j] * num_x() + i * y_rows[j];
+}
+
+}
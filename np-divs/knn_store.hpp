@@ -0,0 +1,129 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_KNN_STORE_HPP_
+#define NPDIVS_KNN_STORE_HPP_
+#include "np-divs/basics.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+namespace npdivs {
+
+class KNNStore : boost::noncopyable {
+    /* A memory-mapped file holding everything the DivFuncs look at for a
+     * set of bags: each bag's rho (distances from its points to their k-th
+     * neighbor in the same bag) and, for each pair of bags, both nus
+     * (distances from one bag's points to their k-th neighbor in the other).
+     * Like everything np_divs passes around, the distances are squared.
+     *
+     * np_divs writes one of these when DivParams::knn_store is set, and
+     * np_divs_from_store can then evaluate any other DivFuncs from it without
+     * building an index or doing a single search.
+     *
+     * The file is a small header (the magic string, whether it's a same-bags
+     * store, the number of x and y bags, dim, k, and each bag's row count)
+     * followed by float arrays at offsets computed from the row counts:
+     *
+     *   - rho for each x bag, then (unless it's same-bags) for each y bag
+     *   - nu_xy(i, j) for each i, j: x_i's points in y_j, x_i.rows floats
+     *   - unless it's same-bags, nu_yx(i, j) for each j, i: y_j's points
+     *     in x_i, y_j.rows floats
+     *
+     * For a same-bags store, y is x and nu_yx(i, j) is just nu_xy(j, i).
+     *
+     * The header has a flag that's only set by finish(), so that a store
+     * whose writer died partway through can't be opened. Stores are written
+     * in the native byte order and aren't portable between architectures.
+     */
+
+    std::string path;
+    bool writable;
+
+    bool same_bags;
+    int dimension;
+    int k_;
+    std::vector<size_t> x_rows, y_rows;
+
+    // offsets (in floats, from data) of each section, and of each bag
+    // within the bags' concatenation
+    std::vector<size_t> x_starts, y_starts;
+    size_t x_total, y_total;
+    size_t rho_y_off, nu_xy_off, nu_yx_off, total_floats;
+
+    void *map;
+    size_t map_size;
+    float *data;
+
+    void create();
+    void compute_layout();
+    size_t header_size() const;
+
+    public:
+
+    // opens an existing, finished store read-only
+    explicit KNNStore(const std::string &path);
+
+    // creates a new store for the distances from some bags to themselves
+    KNNStore(const std::string &path, int dim, int k,
+             const std::vector<size_t> &rows);
+
+    // creates a new store for the distances between x bags and y bags
+    KNNStore(const std::string &path, int dim, int k,
+             const std::vector<size_t> &x_rows,
+             const std::vector<size_t> &y_rows);
+
+    ~KNNStore();
+
+    // marks the store as complete and flushes it to disk
+    void finish();
+
+    bool is_same_bags() const { return same_bags; }
+    size_t num_x() const { return x_rows.size(); }
+    size_t num_y() const { return y_rows.size(); }
+    int dim() const { return dimension; }
+    int k() const { return k_; }
+
+    size_t x_bag_rows(size_t i) const { return x_rows[i]; }
+    size_t y_bag_rows(size_t j) const { return y_rows[j]; }
+
+    // these are only writable for a store that's being created
+    float* rho_x(size_t i) const;
+    float* rho_y(size_t j) const;
+    float* nu_xy(size_t i, size_t j) const;
+    float* nu_yx(size_t i, size_t j) const;
+};
+
+}
+#endif
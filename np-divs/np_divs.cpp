@@ -108,4 +108,159 @@ template void np_divs(
     const DivParams &div_params,
     bool verify_results_alloced);
 
+
+////////////////////////////////////////////////////////////////////////////////
+// Evaluating div funcs from a KNNStore
+
+namespace {
+class store_divcalc_worker : boost::noncopyable {
+    const KNNStore &store;
+    const boost::ptr_vector<DivFunc> &div_funcs;
+    flann::Matrix<double> *results;
+    JobDispenser &jobs;
+    boost::exception_ptr &error;
+
+    WorkerStats *stats; // NULL unless we're keeping track
+
+    DivFuncBatch batch;
+    DivScratch div_scratch;
+    std::vector<double> df_results;
+
+    // sets results[df][i][j] for each div func, and if it's a same-bags
+    // store, [df][j][i] too; the div funcs read straight out of the map
+    void do_job(size_t i, size_t j) {
+        DistSpan rho_x(store.rho_x(i), store.x_bag_rows(i)),
+                 nu_x(store.nu_xy(i, j), store.x_bag_rows(i));
+
+        if (store.is_same_bags() && i == j) {
+            DivPair pair(rho_x, nu_x, rho_x, nu_x);
+            batch(&pair, 1, store.dim(), store.k(), &df_results[0], true,
+                  &div_scratch);
+            for (size_t df = 0; df < div_funcs.size(); df++)
+                results[df][i][i] = df_results[df];
+            return;
+        }
+
+        DistSpan rho_y(store.rho_y(j), store.y_bag_rows(j)),
+                 nu_y(store.nu_yx(i, j), store.y_bag_rows(j));
+        DivPair pairs[] = { DivPair(rho_x, nu_x, rho_y, nu_y),
+                            DivPair(rho_y, nu_y, rho_x, nu_x) };
+        const size_t num_pairs = store.is_same_bags() ? 2 : 1;
+
+        batch(pairs, num_pairs, store.dim(), store.k(), &df_results[0], true,
+              &div_scratch);
+        for (size_t df = 0; df < div_funcs.size(); df++) {
+            results[df][i][j] = df_results[df * num_pairs];
+            if (num_pairs == 2)
+                results[df][j][i] = df_results[df * num_pairs + 1];
+        }
+    }
+
+    public:
+    store_divcalc_worker(const KNNStore &store,
+            const boost::ptr_vector<DivFunc> &div_funcs,
+            flann::Matrix<double> *results,
+            JobDispenser &jobs,
+            boost::exception_ptr &error,
+            WorkerStats *stats = NULL)
+        :
+            store(store), div_funcs(div_funcs), results(results),
+            jobs(jobs), error(error), stats(stats),
+            batch(div_funcs), df_results(2 * div_funcs.size())
+        { }
+
+    // the memory this worker is holding onto for the div funcs
+    size_t scratch_bytes() const {
+        return div_scratch.bytes()
+             + df_results.capacity() * sizeof(double);
+    }
+
+    void operator()() {
+        size_t i, j;
+        try {
+            while (jobs.next(i, j)) {
+                if (stats) {
+                    // there are no searches, so it's all div func time
+                    double start = wall_clock();
+                    do_job(i, j);
+                    double seconds = wall_clock() - start;
+                    stats->busy_seconds += seconds;
+                    stats->div_func_seconds += seconds;
+                    stats->jobs++;
+                } else {
+                    do_job(i, j);
+                }
+            }
+        } catch (...) {
+            error = boost::current_exception();
+            jobs.abort();
+        }
+    }
+};
+}
+
+void np_divs_from_store(
+        const KNNStore &store,
+        const boost::ptr_vector<DivFunc> &div_funcs,
+        flann::Matrix<double>* results,
+        const DivParams &params,
+        bool ver_alloc)
+{
+    size_t num_x = store.num_x(), num_y = store.num_y();
+
+    if (ver_alloc)
+        verify_allocated(results, div_funcs.size(), num_x, num_y);
+
+    boost::ptr_vector<DivFunc> prepared;
+    prepare_div_funcs(div_funcs, store.dim(),
+                      std::vector<int>(1, store.k()), prepared);
+
+    boost::shared_ptr<ThreadPool> pool = get_thread_pool(params);
+    size_t num_threads = pool->size();
+
+    // only the pair phase happens here; the others stay at zero
+    DivStats *stats = params.stats;
+    if (stats)
+        stats->clear();
+    PhaseTimer timer(pool.get());
+
+    JobDispenser jobs(num_x, num_y, store.is_same_bags(),
+                      params.show_progress, params.print_progress);
+
+    size_t num_jobs = jobs.size();
+    if (params.show_progress && num_jobs % params.show_progress != 0) {
+        params.print_progress(num_jobs);
+    }
+
+    boost::ptr_vector<store_divcalc_worker> workers;
+    std::vector<boost::exception_ptr> errors(num_threads);
+    std::vector<WorkerStats> worker_stats(num_threads);
+    std::vector<boost::function<void ()> > tasks;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        workers.push_back(new store_divcalc_worker(
+                    store, prepared, results, jobs, errors[i],
+                    stats ? &worker_stats[i] : NULL));
+        tasks.push_back(boost::ref(workers[i]));
+    }
+
+    pool->run(tasks);
+
+    for (size_t i = 0; i < num_threads; i++)
+        if (errors[i])
+            boost::rethrow_exception(errors[i]);
+
+    if (params.show_progress)
+        params.print_progress(0);
+
+    if (stats) {
+        timer.stop(stats->pairs);
+        stats->total = stats->pairs;
+        for (size_t i = 0; i < num_threads; i++) {
+            stats->add_worker(worker_stats[i], true);
+            stats->scratch_bytes += workers[i].scratch_bytes();
+        }
+    }
+}
+
 } // end namespace
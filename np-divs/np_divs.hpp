@@ -35,7 +35,6 @@
 #include <algorithm>
 #include <cstdlib>
 #include <iostream>
-#include <queue>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -44,6 +43,7 @@
 #include <boost/exception_ptr.hpp>
 #include <boost/format.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/throw_exception.hpp>
 #include <boost/utility.hpp>
@@ -51,10 +51,19 @@
 
 #include <flann/flann.hpp>
 
+#include "np-divs/bag_cache.hpp"
+#include "np-divs/bag_index.hpp"
+#include "np-divs/div-funcs/div_batch.hpp"
 #include "np-divs/div-funcs/div_func.hpp"
 #include "np-divs/div-funcs/div_l2.hpp"
 #include "np-divs/div_params.hpp"
+#include "np-divs/div_stats.hpp"
 #include "np-divs/dkn.hpp"
+#include "np-divs/dual_tree.hpp"
+#include "np-divs/gemm_index.hpp"
+#include "np-divs/index_policy.hpp"
+#include "np-divs/job_dispenser.hpp"
+#include "np-divs/knn_store.hpp"
 #include "np-divs/matrix_arrays.hpp"
 
 namespace npdivs {
@@ -121,6 +130,18 @@ void np_divs(
     const DivParams &div_params,
     bool verify_results_alloced = true);
 
+void np_divs_from_store(
+    const KNNStore &store,
+    const boost::ptr_vector<DivFunc> &div_funcs,
+    flann::Matrix<double>* results,
+    const DivParams &div_params,
+    bool verify_results_alloced = true);
+// Evaluates div_funcs on the rhos and nus saved by an earlier np_divs call
+// with div_params.knn_store set; results are store.num_x() by store.num_y().
+// Only the threading, progress and stats settings of div_params are used;
+// the stats only have the pair phase (which is also the total) and the
+// workers' div func times, since there are no searches.
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -128,6 +149,19 @@ void np_divs(
 
 inline size_t get_num_threads(size_t num_threads);
 
+inline boost::shared_ptr<ThreadPool> get_thread_pool(const DivParams &params);
+// params.thread_pool if it's set, otherwise a new one of params.num_threads
+
+inline void check_ks(const std::vector<int> &ks, const DivParams &params);
+// throws a std::domain_error if any k is less than 1, or if there's more than
+// one and params asks for something that only handles a single k
+
+inline void prepare_div_funcs(const boost::ptr_vector<DivFunc> &div_funcs,
+                              size_t dim, const std::vector<int> &ks,
+                              boost::ptr_vector<DivFunc> &prepared);
+// fills prepared with copies of div_funcs that have had prepare() called for
+// dim and each of ks
+
 template <typename T>
 void verify_allocated(
         flann::Matrix<T> *matrices,
@@ -135,24 +169,142 @@ void verify_allocated(
 // throws a std::length_error if they're not the right size
 
 template <typename Distance>
-flann::Index<Distance>** make_indices(
+BagIndex<Distance>** make_indices(
+        const flann::Matrix<typename Distance::ElementType> *datasets,
+        size_t n,
+        const flann::IndexParams index_params,
+        ThreadPool &pool,
+        const BagCache *cache = NULL,
+        std::string *cache_keys = NULL);
+// if cache is passed, loads/saves indices there and puts each bag's cache
+// key into cache_keys (which must have room for n)
+
+template <typename Distance>
+BagIndex<Distance>** make_indices(
         const flann::Matrix<typename Distance::ElementType> *datasets,
         size_t n,
-        const flann::IndexParams index_params);
+        const flann::IndexParams index_params,
+        size_t num_threads=1);
 
 template <typename Distance>
-inline void free_indices(flann::Index<Distance>** indices, size_t n);
+inline void free_indices(BagIndex<Distance>** indices, size_t n);
+
+template <typename Distance>
+BagIndex<Distance>* build_bag_index(
+        const flann::Matrix<typename Distance::ElementType> &bag,
+        const flann::IndexParams &index_params);
+// a ready-to-search index of the kind index_params asks for; throws a
+// std::domain_error for an unknown npdivs_algorithm
 
 
 template <typename Distance>
 std::vector<std::vector<float> > get_rhos(
         const flann::Matrix<typename Distance::ElementType> *bags,
-        flann::Index<Distance> **indices,
+        BagIndex<Distance> **indices,
+        size_t n,
+        int k,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        const BagCache *cache = NULL,
+        const std::string *cache_keys = NULL,
+        size_t split_rows = 0,
+        DivStats *stats = NULL);
+// The rhos are squared distances, as flann::L2 gives them (see the squared
+// argument to DivFunc::operator()).
+// cache_keys should be as filled in by make_indices; split_rows is as in
+// DivParams; if stats is passed, the searches are added to its counts
+
+template <typename Distance>
+std::vector<std::vector<std::vector<float> > > get_rhos(
+        const flann::Matrix<typename Distance::ElementType> *bags,
+        BagIndex<Distance> **indices,
+        size_t n,
+        const std::vector<int> &ks,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        const BagCache *cache = NULL,
+        const std::string *cache_keys = NULL,
+        size_t split_rows = 0,
+        DivStats *stats = NULL);
+// the rhos for each of ks, from one search per bag: result[i][ki] is for bag
+// i and ks[ki]
+
+template <typename Distance>
+std::vector<std::vector<float> > get_rhos(
+        const flann::Matrix<typename Distance::ElementType> *bags,
+        BagIndex<Distance> **indices,
         size_t n,
         int k,
         const flann::SearchParams &search_params = SEARCH_PARAMS,
         size_t num_threads=1);
 
+template <typename Scalar>
+std::vector<size_t> bag_rows(const flann::Matrix<Scalar> *bags, size_t n);
+
+template <typename Distance>
+size_t bags_bytes(
+        const flann::Matrix<typename Distance::ElementType> *bags,
+        BagIndex<Distance> **indices,
+        size_t n);
+// the total memory used by these bags and their indices
+
+template <typename Distance>
+size_t indices_memory(BagIndex<Distance> **indices, size_t n);
+// the memory the indices report using, not counting the bags
+
+inline size_t rhos_memory(const std::vector<std::vector<float> > &rhos);
+inline size_t rhos_memory(
+        const std::vector<std::vector<std::vector<float> > > &rhos);
+// the memory held by a set of rho vectors
+
+inline bool is_linear_index(const flann::IndexParams &index_params);
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+void split_DKN(
+        Index<Distance> &index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        ResultType *dkn,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        int k,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        size_t split_rows,
+        bool take_sqrt = true);
+// DKN, but if query has at least split_rows rows (and split_rows isn't 0),
+// the search is split into chunks of rows that run as tasks on pool
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+void split_DKN(
+        Index<Distance> &index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        const int *ks,
+        size_t num_ks,
+        ResultType *const *dkns,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        size_t split_rows,
+        bool take_sqrt = true);
+// the same, for several k at once
+
+template <typename Distance, typename ResultType>
+void bag_DKN(
+        BagIndex<Distance> &index,
+        const BagIndex<Distance> &query_index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        const int *ks,
+        size_t num_ks,
+        ResultType *const *dkns,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        size_t split_rows,
+        bool take_sqrt = true);
+// split_DKN, for a query that's the bag query_index was built on: if index
+// can search for a whole bag at once, it does that (without splitting)
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Functor classes used to do the computation work
@@ -162,51 +314,144 @@ class divcalc_worker : boost::noncopyable {
     protected:
 
     typedef flann::Matrix<typename Distance::ElementType> Matrix;
-    typedef flann::Index<Distance> Index;
+    typedef BagIndex<Distance> Index;
     typedef std::vector<float> DistVec;
     typedef std::vector<DistVec> DistVecVec;
-    typedef std::pair<size_t, size_t> size_pair;
 
-    const int k;
+    const std::vector<int> &ks;
+    const size_t num_ks;
     const int dim;
 
     const boost::ptr_vector<DivFunc> &div_funcs;
     const size_t num_dfs;
 
     const flann::SearchParams &search_params;
-    const size_t show_progress;
-    boost::function<void (size_t)> print_progress;
 
     flann::Matrix<double> *results;
-    boost::mutex &jobs_mutex;
-    std::queue<size_pair> &jobs;
+    JobDispenser &jobs;
+
+    KNNStore *store; // if not NULL, where to save the nus
+
+    ThreadPool &pool;
+    const size_t split_rows;
 
     boost::exception_ptr &error;
 
+    WorkerStats *stats; // NULL unless we're keeping track
+
+    // scratch space that lives as long as the worker, so that once it's seen
+    // the biggest bags the pair loop doesn't need to touch the heap
+    DKNWorkspace<typename Distance::ResultType> workspace;
+    DistVec nu_x, nu_y; // the nus for each k, one after the other
+    std::vector<float *> nu_ptrs;
+
+    // evaluates the div funcs together, sharing what work it can, in
+    // div_scratch
+    DivFuncBatch batch;
+    DivScratch div_scratch;
+    std::vector<double> df_results;
+
+    // sets nu to the squared distances from each point in query, the bag of
+    // query_index, to its ks[0]-th nearest neighbor in index, then to its
+    // ks[1]-th, and so on, reusing this worker's scratch space
+    void search_nu(Index &index, const Index &query_index,
+                   const Matrix &query, DistVec &nu) {
+        double start = stats_clock();
+
+        nu.resize(num_ks * query.rows);
+        for (size_t ki = 0; ki < num_ks; ki++)
+            nu_ptrs[ki] = nu.empty() ? NULL : &nu[0] + ki * query.rows;
+        bag_DKN<Distance, float>(index, query_index, query, &ks[0], num_ks,
+                                 &nu_ptrs[0], workspace, search_params, pool,
+                                 split_rows, false);
+
+        if (stats) {
+            stats->search_seconds += wall_clock() - start;
+            stats->knn_searches++;
+            stats->knn_queries += query.rows;
+            stats->points_searched += index.size();
+        }
+    }
+
+    // the time, if we're keeping stats (otherwise don't bother)
+    double stats_clock() const {
+        return stats ? wall_clock() : 0;
+    }
+
+    // the part of nu (as from search_nu) for ks[ki], with rows rows
+    static DistSpan nu_span(const DistVec &nu, size_t ki, size_t rows) {
+        return DistSpan(nu.empty() ? NULL : &nu[0] + ki * rows, rows);
+    }
+
+    // sets results[df * num_ks + ki][i][j] for each div func and k, and if
+    // both is true, [j][i] too, from the same batch calls
+    void eval_div_funcs(const DistVecVec &rho_x, const DistVec &nu_x,
+                        const DistVecVec &rho_y, const DistVec &nu_y,
+                        size_t i, size_t j, bool both = false)
+    {
+        double start = stats_clock();
+
+        const size_t num_pairs = both ? 2 : 1;
+        for (size_t ki = 0; ki < num_ks; ki++) {
+            DistSpan rx(rho_x[ki]), ry(rho_y[ki]);
+            DistSpan nx = nu_span(nu_x, ki, rx.size),
+                     ny = nu_span(nu_y, ki, ry.size);
+            DivPair pairs[] = { DivPair(rx, nx, ry, ny),
+                                DivPair(ry, ny, rx, nx) };
+
+            batch(pairs, num_pairs, dim, ks[ki], &df_results[0], true,
+                  &div_scratch);
+            for (size_t df = 0; df < num_dfs; df++) {
+                const double *res = &df_results[df * num_pairs];
+                results[df * num_ks + ki][i][j] = res[0];
+                if (both)
+                    results[df * num_ks + ki][j][i] = res[1];
+            }
+        }
+
+        if (stats)
+            stats->div_func_seconds += wall_clock() - start;
+    }
+
+    // the store only holds a single k, which comes first in nu
+    void save_nu(const DistVec &nu, float *dest) {
+        if (store)
+            std::copy(nu.begin(), nu.begin() + nu.size() / num_ks, dest);
+    }
+
 
     public:
 
     divcalc_worker(
-            int k,
+            const std::vector<int> &ks,
             int dim,
             const boost::ptr_vector<DivFunc> &div_funcs,
             const flann::SearchParams &search_params,
-            size_t show_progress,
-            boost::function<void (size_t)> print_progress,
             flann::Matrix<double> *results,
-            boost::mutex &jobs_mutex,
-            std::queue<size_pair> &jobs,
-            boost::exception_ptr &error)
+            JobDispenser &jobs,
+            KNNStore *store,
+            ThreadPool &pool,
+            size_t split_rows,
+            boost::exception_ptr &error,
+            WorkerStats *stats = NULL)
         :
-            k(k), dim(dim), div_funcs(div_funcs), num_dfs(div_funcs.size()),
+            ks(ks), num_ks(ks.size()), dim(dim),
+            div_funcs(div_funcs), num_dfs(div_funcs.size()),
             search_params(search_params),
-            show_progress(show_progress), print_progress(print_progress),
-            results(results),
-            jobs_mutex(jobs_mutex), jobs(jobs), error(error)
+            results(results), jobs(jobs), store(store),
+            pool(pool), split_rows(split_rows), error(error), stats(stats),
+            nu_ptrs(ks.size()),
+            batch(div_funcs), df_results(2 * div_funcs.size())
         { }
 
     virtual ~divcalc_worker() {};
 
+    // the memory this worker is holding onto for searches and div funcs
+    size_t scratch_bytes() const {
+        return workspace.bytes() + div_scratch.bytes()
+             + (nu_x.capacity() + nu_y.capacity()) * sizeof(float);
+    }
+
     virtual void do_job(size_t i, size_t j) = 0;
 
     void operator()();
@@ -217,48 +462,49 @@ class divcalc_samebags_worker : public divcalc_worker<Distance> {
     typedef divcalc_worker<Distance> super;
 
     typedef flann::Matrix<typename Distance::ElementType> Matrix;
-    typedef flann::Index<Distance> Index;
+    typedef BagIndex<Distance> Index;
     typedef std::vector<float> DistVec;
     typedef std::vector<DistVec> DistVecVec;
-    typedef std::pair<size_t, size_t> size_pair;
 
     protected:
 
     // some crazy C++ template stuff means inherited name won't be auto-resolved
     // see: http://stackoverflow.com/q/4010281/344821
-    using super::k;
+    using super::ks;
     using super::dim;
     using super::div_funcs;
     using super::num_dfs;
     using super::search_params;
-    using super::show_progress;
-    using super::print_progress;
     using super::results;
-    using super::jobs_mutex;
     using super::jobs;
+    using super::store;
+    using super::stats;
+    using super::nu_x;
+    using super::nu_y;
 
     const Matrix *bags;
     Index **indices;
-    const std::vector<DistVec> &rhos;
+    const std::vector<DistVecVec> &rhos;
 
     public:
 
     divcalc_samebags_worker(
             const Matrix *bags,
             Index **indices,
-            const DistVecVec &rhos,
+            const std::vector<DistVecVec> &rhos,
             const boost::ptr_vector<DivFunc> &div_funcs,
-            int k, int dim,
+            const std::vector<int> &ks, int dim,
             const flann::SearchParams &search_params,
-            size_t show_progress,
-            boost::function<void (size_t)> print_progress,
             flann::Matrix<double> *results,
-            boost::mutex &jobs_mutex, std::queue<size_pair> &jobs,
-            boost::exception_ptr &error)
+            JobDispenser &jobs,
+            KNNStore *store,
+            ThreadPool &pool,
+            size_t split_rows,
+            boost::exception_ptr &error,
+            WorkerStats *stats = NULL)
         :
-            super(k, dim, div_funcs, search_params,
-                    show_progress, print_progress,
-                    results, jobs_mutex, jobs, error),
+            super(ks, dim, div_funcs, search_params, results, jobs, store,
+                  pool, split_rows, error, stats),
             bags(bags), indices(indices), rhos(rhos)
         { }
 
@@ -270,45 +516,47 @@ class divcalc_diffbags_worker : public divcalc_worker<Distance> {
     typedef divcalc_worker<Distance> super;
 
     typedef flann::Matrix<typename Distance::ElementType> Matrix;
-    typedef flann::Index<Distance> Index;
+    typedef BagIndex<Distance> Index;
     typedef std::vector<float> DistVec;
     typedef std::vector<DistVec> DistVecVec;
-    typedef std::pair<size_t, size_t> size_pair;
 
     protected:
 
-    using super::k;
+    using super::ks;
     using super::dim;
     using super::div_funcs;
     using super::num_dfs;
     using super::search_params;
-    using super::show_progress;
-    using super::print_progress;
     using super::results;
-    using super::jobs_mutex;
     using super::jobs;
+    using super::store;
+    using super::stats;
+    using super::nu_x;
+    using super::nu_y;
 
     const Matrix *x_bags, *y_bags;
     Index **x_indices, **y_indices;
-    const std::vector<DistVec> &x_rhos, &y_rhos;
+    const std::vector<DistVecVec> &x_rhos, &y_rhos;
 
     public:
     divcalc_diffbags_worker(
             const Matrix *x_bags, const Matrix *y_bags,
             Index **x_indices, Index **y_indices,
-            const DistVecVec &x_rhos, const DistVecVec &y_rhos,
+            const std::vector<DistVecVec> &x_rhos,
+            const std::vector<DistVecVec> &y_rhos,
             const boost::ptr_vector<DivFunc> &div_funcs,
-            int k, int dim,
+            const std::vector<int> &ks, int dim,
             const flann::SearchParams &search_params,
-            size_t show_progress,
-            boost::function<void (size_t)> print_progress,
             flann::Matrix<double> *results,
-            boost::mutex &jobs_mutex, std::queue<size_pair> &jobs,
-            boost::exception_ptr &error)
+            JobDispenser &jobs,
+            KNNStore *store,
+            ThreadPool &pool,
+            size_t split_rows,
+            boost::exception_ptr &error,
+            WorkerStats *stats = NULL)
         :
-            super(k, dim, div_funcs, search_params,
-                    show_progress, print_progress,
-                    results, jobs_mutex, jobs, error),
+            super(ks, dim, div_funcs, search_params, results, jobs, store,
+                  pool, split_rows, error, stats),
             x_bags(x_bags), y_bags(y_bags),
             x_indices(x_indices), y_indices(y_indices),
             x_rhos(x_rhos), y_rhos(y_rhos)
@@ -362,95 +610,130 @@ void np_divs(
     typedef flann::L2<Scalar> Distance;
 
     typedef flann::Matrix<Scalar> Matrix;
-    typedef flann::Index<Distance> Index;
+    typedef BagIndex<Distance> Index;
     typedef vector<float> DistVec;
 
     size_t num_dfs = div_funcs.size();
     size_t dim = bags[0].cols;
 
     // some setup
+    const vector<int> &ks = params.get_ks();
+    size_t num_ks = ks.size();
+    check_ks(ks, params);
+
     if (ver_alloc)
-        verify_allocated(results, num_dfs, num_bags, num_bags);
+        verify_allocated(results, num_dfs * num_ks, num_bags, num_bags);
+
+    // the workers get copies of the div funcs, with their constants worked
+    // out for this dim and ks
+    boost::ptr_vector<DivFunc> prepared;
+    prepare_div_funcs(div_funcs, dim, ks, prepared);
 
-    int k = params.k;
-    if (k < 1)
-        BOOST_THROW_EXCEPTION(std::domain_error("np_divs: k<1 is nonsensical"));
-    size_t num_threads = get_num_threads(params.num_threads);
+    boost::shared_ptr<ThreadPool> pool = get_thread_pool(params);
+    size_t num_threads = pool->size();
+
+    DivStats *stats = params.stats;
+    if (stats)
+        stats->clear();
+    PhaseTimer total_timer(pool.get()), timer(pool.get());
+
+    const flann::IndexParams index_params = params.get_index_params();
+    boost::scoped_ptr<BagCache> cache;
+    vector<std::string> keys(num_bags);
+    if (!params.cache_dir.empty())
+        cache.reset(new BagCache(params.cache_dir, index_params,
+                                 ks[0], params.search_params));
 
     // build kd-trees or whatever
     Index** indices = make_indices<Distance>(
-            bags, num_bags, params.index_params);
+            bags, num_bags, index_params, *pool, cache.get(), &keys[0]);
+
+    if (stats) {
+        timer.stop(stats->indices);
+        timer.restart();
+    }
 
     // do nearest-neighbor searches for each bag to itself
-    const vector<DistVec> &rhos =
-        get_rhos(bags, indices, num_bags, k, params.search_params, num_threads);
+    const vector<vector<DistVec> > &rhos = get_rhos(bags, indices, num_bags,
+            ks, params.search_params, *pool, cache.get(), &keys[0],
+            params.split_rows, stats);
+
+    if (stats)
+        timer.stop(stats->rhos);
+
+    boost::scoped_ptr<KNNStore> store;
+    if (!params.knn_store.empty()) {
+        store.reset(new KNNStore(params.knn_store, dim, ks[0],
+                                 bag_rows(bags, num_bags)));
+        for (size_t i = 0; i < num_bags; i++)
+            std::copy(rhos[i][0].begin(), rhos[i][0].end(), store->rho_x(i));
+    }
 
-    size_t num_jobs = num_bags * (num_bags + 1) / 2;
+    // this will tell threads what to do, without storing every pair
+    size_t tile = params.tile_size;
+    if (tile == 0)
+        tile = choose_tile_size(bags_bytes(bags, indices, num_bags) / num_bags);
+
+    JobDispenser jobs(num_bags, num_bags, true,
+                      params.show_progress, params.print_progress, tile);
+    if (params.cost_order) {
+        const vector<size_t> &rows = bag_rows(bags, num_bags);
+        jobs.order_by_cost(rows, rows, dim,
+                           is_linear_index(index_params));
+    }
+
+    size_t num_jobs = jobs.size();
     if (params.show_progress && num_jobs % params.show_progress != 0) {
         params.print_progress(num_jobs);
     }
 
-    // this queue will tell threads what to do
-    std::queue<std::pair<size_t, size_t> > jobs;
+    // compute away!
+    //
+    // the only non-const things the workers share are jobs (which is
+    // thread-safe), the indices (which are thread-safe for searching) and
+    // results, which is fine since the threads only touch separate parts of
+    // it.
+    //
+    // we keep the worker objects in this ptr_vector so
+    // that they don't get copied but also have the correct lifetime
+    boost::ptr_vector<divcalc_samebags_worker<Distance> > workers;
+    std::vector<boost::exception_ptr> errors(num_threads);
+    std::vector<WorkerStats> worker_stats(num_threads);
+    std::vector<boost::function<void ()> > tasks;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        workers.push_back(new divcalc_samebags_worker<Distance>(
+            bags, indices, rhos, prepared, ks, dim, params.search_params,
+            results, jobs, store.get(), *pool, params.split_rows, errors[i],
+            stats ? &worker_stats[i] : NULL
+        ));
+        tasks.push_back(boost::ref(workers[i]));
+    }
 
-    // to avoid simultaneous access to jobs. the only other non-const things
-    // are the indices (which are thread-safe for searching) and results, which
-    // is fine since the threads only touch separate parts of it.
-    boost::mutex jobs_mutex;
+    timer.restart();
+    pool->run(tasks);
 
-    // compute away!
-    if (num_threads == 1) {
-        boost::exception_ptr error;
-        divcalc_samebags_worker<Distance> worker(
-                bags, indices, rhos, div_funcs, k, dim, params.search_params,
-                params.show_progress, params.print_progress,
-                results, jobs_mutex, jobs, error
-        );
-
-        // ignore the queue, just use do_job directly
-        const size_t mod = params.show_progress;
-
-        for (size_t i = 0; i < num_bags; i++) {
-            for (size_t j = 0; j <= i; j++) {
-                if (mod && num_jobs % mod == 0)
-                    params.print_progress(num_jobs);
-
-                worker.do_job(i, j);
-                num_jobs--;
-            }
-        }
+    for (size_t i = 0; i < num_threads; i++)
+        if (errors[i])
+            boost::rethrow_exception(errors[i]);
 
-    } else {
-        // put jobs in the queue
-        for (size_t i = 0; i < num_bags; i++)
-            for (size_t j = 0; j <= i; j++)
-                jobs.push(std::pair<size_t, size_t>(i, j));
+    if (params.show_progress)
+        params.print_progress(0);
 
-        // we keep the worker objects in this ptr_vector so
-        // that they don't get copied but also have the correct lifetime
-        boost::ptr_vector<divcalc_samebags_worker<Distance> > workers;
-        std::vector<boost::exception_ptr> errors(num_threads);
-        boost::thread_group worker_threads;
+    if (store)
+        store->finish();
 
+    if (stats) {
+        timer.stop(stats->pairs);
         for (size_t i = 0; i < num_threads; i++) {
-            // create the worker
-            workers.push_back(new divcalc_samebags_worker<Distance>(
-                bags, indices, rhos, div_funcs, k, dim, params.search_params,
-                params.show_progress, params.print_progress,
-                results, jobs_mutex, jobs, errors[i]
-            ));
-            worker_threads.create_thread(boost::ref(workers[i]));
+            stats->add_worker(worker_stats[i], true);
+            stats->scratch_bytes += workers[i].scratch_bytes();
         }
-
-        worker_threads.join_all();
-        for (size_t i = 0; i < num_threads; i++)
-            if (errors[i])
-                boost::rethrow_exception(errors[i]);
+        stats->index_bytes = indices_memory(indices, num_bags);
+        stats->rho_bytes = rhos_memory(rhos);
+        total_timer.stop(stats->total);
     }
 
-    if (params.show_progress)
-        params.print_progress(0);
-
     free_indices(indices, num_bags);
 }
 
@@ -498,14 +781,16 @@ void np_divs(
      * each of the passed div_funcs, and writes them into the preallocated
      * array of matrices (div_funcs.size() bags, each with num_x rows and
      * num_y cols) to the passed div_funcs. Rows of each matrix are an x_bag,
-     * columns are a y_bag.
+     * columns are a y_bag. If div_params.ks is set, there are
+     * div_funcs.size() * ks.size() matrices instead, one for each div func
+     * and k (see DivParams).
      *
      * Runs on num_threads threads; if num_threads is 0 (the default), uses one
      * thread per core/hyperthreading unit, as determined by
      * boost::thread::hardware_concurrency (or 1 if that information is
-     * unavailable). Note that if you use boost 1.34 or lower, this function is
-     * unavailable and so num_threads will always default to 1. If num_threads
-     * is 1, doesn't actually spawn any new threads.
+     * unavailable). If num_threads is 1, doesn't actually spawn any new
+     * threads. If div_params.thread_pool is set, uses that pool's threads
+     * instead of starting new ones.
      *
      * By default, conducts a quick check that the result matrices were
      * allocated properly; if you're sure that you did and want to skip this
@@ -517,7 +802,7 @@ void np_divs(
     typedef flann::L2<Scalar> Distance;
 
     typedef flann::Matrix<Scalar> Matrix;
-    typedef flann::Index<Distance> Index;
+    typedef BagIndex<Distance> Index;
     typedef vector<float> DistVec;
 
     // save work if we're actually comparing bags to themselves
@@ -529,97 +814,135 @@ void np_divs(
     size_t dim = x_bags[0].cols;
     // TODO: check that y_bags[0] (all bags?) is the same dimensions
 
-    int k = ps.k;
-    if (k < 1)
-        BOOST_THROW_EXCEPTION(std::domain_error("np_divs: k<1 is nonsensical"));
-    size_t num_threads = get_num_threads(ps.num_threads);
+    const vector<int> &ks = ps.get_ks();
+    size_t num_ks = ks.size();
+    check_ks(ks, ps);
+
+    boost::shared_ptr<ThreadPool> pool = get_thread_pool(ps);
+    size_t num_threads = pool->size();
 
     if (ver_alloc)
-        verify_allocated(results, num_dfs, num_x, num_y);
+        verify_allocated(results, num_dfs * num_ks, num_x, num_y);
+
+    // as in the same-bags version
+    boost::ptr_vector<DivFunc> prepared;
+    prepare_div_funcs(div_funcs, dim, ks, prepared);
+
+    DivStats *stats = ps.stats;
+    if (stats)
+        stats->clear();
+    PhaseTimer total_timer(pool.get()), timer(pool.get());
 
     // build kd trees or whatever
-    Index** x_indices = make_indices<Distance>(x_bags, num_x, ps.index_params);
-    Index** y_indices = make_indices<Distance>(y_bags, num_y, ps.index_params);
+    const flann::IndexParams index_params = ps.get_index_params();
+    boost::scoped_ptr<BagCache> cache;
+    vector<std::string> x_keys(num_x), y_keys(num_y);
+    if (!ps.cache_dir.empty())
+        cache.reset(new BagCache(ps.cache_dir, index_params, ks[0],
+                                 ps.search_params));
+
+    Index** x_indices = make_indices<Distance>(
+            x_bags, num_x, index_params, *pool, cache.get(), &x_keys[0]);
+    Index** y_indices = make_indices<Distance>(
+            y_bags, num_y, index_params, *pool, cache.get(), &y_keys[0]);
+
+    if (stats) {
+        timer.stop(stats->indices);
+        timer.restart();
+    }
 
     // do nearest-neighbor searches for each bag to itself
-    const vector<DistVec> &x_rhos =
-           get_rhos(x_bags, x_indices, num_x, k, ps.search_params, num_threads);
-    const vector<DistVec> &y_rhos =
-           get_rhos(y_bags, y_indices, num_y, k, ps.search_params, num_threads);
+    const vector<vector<DistVec> > &x_rhos = get_rhos(x_bags, x_indices, num_x,
+            ks, ps.search_params, *pool, cache.get(), &x_keys[0],
+            ps.split_rows, stats);
+    const vector<vector<DistVec> > &y_rhos = get_rhos(y_bags, y_indices, num_y,
+            ks, ps.search_params, *pool, cache.get(), &y_keys[0],
+            ps.split_rows, stats);
+
+    if (stats)
+        timer.stop(stats->rhos);
+
+    boost::scoped_ptr<KNNStore> store;
+    if (!ps.knn_store.empty()) {
+        store.reset(new KNNStore(ps.knn_store, dim, ks[0],
+                    bag_rows(x_bags, num_x), bag_rows(y_bags, num_y)));
+        for (size_t i = 0; i < num_x; i++)
+            std::copy(x_rhos[i][0].begin(), x_rhos[i][0].end(),
+                      store->rho_x(i));
+        for (size_t j = 0; j < num_y; j++)
+            std::copy(y_rhos[j][0].begin(), y_rhos[j][0].end(),
+                      store->rho_y(j));
+    }
 
     // compute the divergences!
     //
     // TODO - check that we actually need nu_y
 
-    // this queue will tell threads what to do
-    std::queue<std::pair<size_t, size_t> > jobs;
+    // this will tell threads what to do, without storing every pair
+    size_t tile = ps.tile_size;
+    if (tile == 0)
+        tile = choose_tile_size((bags_bytes(x_bags, x_indices, num_x)
+                               + bags_bytes(y_bags, y_indices, num_y))
+                               / (num_x + num_y));
+
+    JobDispenser jobs(num_x, num_y, false,
+                      ps.show_progress, ps.print_progress, tile);
+    if (ps.cost_order)
+        jobs.order_by_cost(bag_rows(x_bags, num_x), bag_rows(y_bags, num_y),
+                           dim, is_linear_index(index_params));
 
-    size_t num_jobs = num_x * num_y;
+    size_t num_jobs = jobs.size();
     if (ps.show_progress && num_jobs % ps.show_progress != 0) {
         ps.print_progress(num_jobs);
     }
 
-    // to avoid simultaneous access to jobs. the only other non-const things
-    // are the indices (which are thread-safe for searching) and results, which
-    // is fine since the threads only touch separate parts of it.
-    boost::mutex jobs_mutex;
-
-    if (num_threads <= 1) {
-        boost::exception_ptr error;
-        divcalc_diffbags_worker<Distance> worker(
+    // the only non-const things the workers share are jobs (which is
+    // thread-safe), the indices (which are thread-safe for searching) and
+    // results, which is fine since the threads only touch separate parts of
+    // it.
+    //
+    // we keep the worker objects in this ptr_vector so
+    // that they don't get copied but also have the correct lifetime
+    boost::ptr_vector<divcalc_diffbags_worker<Distance> > workers;
+    std::vector<boost::exception_ptr> errors(num_threads);
+    std::vector<WorkerStats> worker_stats(num_threads);
+    std::vector<boost::function<void ()> > tasks;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        workers.push_back(new divcalc_diffbags_worker<Distance>(
             x_bags, y_bags, x_indices, y_indices, x_rhos, y_rhos,
-            div_funcs, k, dim, ps.search_params,
-            ps.show_progress, ps.print_progress,
-            results, jobs_mutex, jobs, error
-        );
-
-        const size_t mod = ps.show_progress;
+            prepared, ks, dim, ps.search_params,
+            results, jobs, store.get(), *pool, ps.split_rows, errors[i],
+            stats ? &worker_stats[i] : NULL
+        ));
+        tasks.push_back(boost::ref(workers[i]));
+    }
 
-        // forget the queue and lock, just do_job directly
-        for (size_t i = 0; i < num_x; i++) {
-            for (size_t j = 0; j < num_y; j++) {
-                if (mod && num_jobs % mod == 0)
-                    ps.print_progress(num_jobs);
+    timer.restart();
+    pool->run(tasks);
 
-                worker.do_job(i, j);
-                num_jobs--;
-            }
-        }
+    for (size_t i = 0; i < num_threads; i++)
+        if (errors[i])
+            boost::rethrow_exception(errors[i]);
 
-    } else {
-        // queue up our jobs
-        for (size_t i = 0; i < num_x; i++)
-            for (size_t j = 0; j < num_y; j++)
-                jobs.push(std::pair<size_t, size_t>(i, j));
+    if (ps.show_progress)
+        ps.print_progress(0);
 
-        // launch worker threads
-        // we keep the worker objects in this ptr_vector so
-        // that they don't get copied but also have the correct lifetime
-        boost::ptr_vector<divcalc_diffbags_worker<Distance> > workers;
-        std::vector<boost::exception_ptr> errors(num_threads);
-        boost::thread_group worker_threads;
+    if (store)
+        store->finish();
 
+    if (stats) {
+        timer.stop(stats->pairs);
         for (size_t i = 0; i < num_threads; i++) {
-            // create the worker
-            workers.push_back(new divcalc_diffbags_worker<Distance>(
-                x_bags, y_bags, x_indices, y_indices, x_rhos, y_rhos,
-                div_funcs, k, dim, ps.search_params,
-                ps.show_progress, ps.print_progress,
-                results, jobs_mutex, jobs, errors[i]
-            ));
-            worker_threads.create_thread(boost::ref(workers[i]));
+            stats->add_worker(worker_stats[i], true);
+            stats->scratch_bytes += workers[i].scratch_bytes();
         }
-
-        worker_threads.join_all();
-        for (size_t i = 0; i < num_threads; i++)
-            if (errors[i])
-                boost::rethrow_exception(errors[i]);
+        stats->index_bytes = indices_memory(x_indices, num_x)
+                           + indices_memory(y_indices, num_y);
+        stats->rho_bytes = rhos_memory(x_rhos) + rhos_memory(y_rhos);
+        total_timer.stop(stats->total);
     }
 
-    if (ps.show_progress)
-        ps.print_progress(0);
-
-
     free_indices(x_indices, num_x);
     free_indices(y_indices, num_y);
 }
@@ -629,35 +952,25 @@ void np_divs(
 
 template <typename Distance>
 void divcalc_worker<Distance>::operator()() {
-    size_pair job;
+    size_t i, j;
     try {
-        while (true) {
-            { // lock applies only in this scope
-                boost::mutex::scoped_lock the_lock(jobs_mutex);
-
-                size_t sz = jobs.size();
-                if (sz == 0)
-                    return;
-
-                if (show_progress && sz % show_progress == 0) {
-                    print_progress(sz);
-                }
-
-                job = jobs.front();
-                jobs.pop();
+        while (jobs.next(i, j)) {
+            if (stats) {
+                double start = wall_clock();
+                this->do_job(i, j);
+                stats->busy_seconds += wall_clock() - start;
+                stats->jobs++;
+            } else {
+                this->do_job(i, j);
             }
-
-            this->do_job(job.first, job.second);
         }
+
         error = boost::exception_ptr();
     } catch (...) {
         error = boost::current_exception();
 
-        {   // clear jobs so other threads know to abort
-            boost::mutex::scoped_lock the_lock(jobs_mutex);
-            while (!jobs.empty())
-                jobs.pop();
-        }
+        // tell the other threads to stop
+        jobs.abort();
     }
 }
 
@@ -666,28 +979,23 @@ void divcalc_samebags_worker<Distance>::do_job(size_t i, size_t j) {
     if (i == j) {
         const Matrix &bag = bags[i];
         Index &index = *indices[i];
-        const DistVec &rho = rhos[i];
+        const DistVecVec &rho = rhos[i];
 
-        const DistVec &nu = DKN<Distance, float>(index, bag, k, search_params);
+        this->search_nu(index, index, bag, nu_x);
+        this->save_nu(nu_x, store ? store->nu_xy(i, i) : NULL);
 
-        for (size_t df = 0; df < num_dfs; df++) {
-            results[df][i][i] = div_funcs[df](rho, nu, rho, nu, dim, k);
-        }
+        this->eval_div_funcs(rho, nu_x, rho, nu_x, i, i);
     } else {
         const Matrix  &x_bag = bags[i],       &y_bag = bags[j];
         Index         &x_index = *indices[i], &y_index = *indices[j]; 
-        const DistVec &rho_x = rhos[i],       &rho_y = rhos[j];
+        const DistVecVec &rho_x = rhos[i],    &rho_y = rhos[j];
 
-        const DistVec &nu_x =
-            DKN<Distance, float>(y_index, x_bag, k, search_params);
-        const DistVec &nu_y =
-            DKN<Distance, float>(x_index, y_bag, k, search_params);
+        this->search_nu(y_index, x_index, x_bag, nu_x);
+        this->search_nu(x_index, y_index, y_bag, nu_y);
+        this->save_nu(nu_x, store ? store->nu_xy(i, j) : NULL);
+        this->save_nu(nu_y, store ? store->nu_xy(j, i) : NULL);
 
-        for (size_t df = 0; df < num_dfs; df++) {
-            const DivFunc &div_func = div_funcs[df];
-            results[df][i][j] = div_func(rho_x, nu_x, rho_y, nu_y, dim, k);
-            results[df][j][i] = div_func(rho_y, nu_y, rho_x, nu_x, dim, k);
-        }
+        this->eval_div_funcs(rho_x, nu_x, rho_y, nu_y, i, j, true);
     }
 }
 
@@ -695,15 +1003,15 @@ template <typename Distance>
 void divcalc_diffbags_worker<Distance>::do_job(size_t i, size_t j) {
     const Matrix  &x_bag = x_bags[i],        &y_bag = y_bags[j];
     Index         &x_index = *x_indices[i],  &y_index = *y_indices[j];
-    const DistVec &rho_x = x_rhos[i],        &rho_y = y_rhos[j];
+    const DistVecVec &rho_x = x_rhos[i],     &rho_y = y_rhos[j];
 
     // compute away
-    const DistVec &nu_x = DKN<Distance,float>(y_index, x_bag, k, search_params);
-    const DistVec &nu_y = DKN<Distance,float>(x_index, y_bag, k, search_params);
+    this->search_nu(y_index, x_index, x_bag, nu_x);
+    this->search_nu(x_index, y_index, y_bag, nu_y);
+    this->save_nu(nu_x, store ? store->nu_xy(i, j) : NULL);
+    this->save_nu(nu_y, store ? store->nu_yx(i, j) : NULL);
 
-    for (size_t df = 0; df < num_dfs; df++) {
-        results[df][i][j] = div_funcs[df](rho_x, nu_x, rho_y, nu_y, dim, k);
-    }
+    this->eval_div_funcs(rho_x, nu_x, rho_y, nu_y, i, j);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -718,6 +1026,137 @@ size_t get_num_threads(size_t num_threads) {
     return num_threads > 0 ? num_threads : 1;
 }
 
+bool is_linear_index(const flann::IndexParams &index_params) {
+    return flann::get_param<flann::flann_algorithm_t>(index_params,
+            "algorithm", flann::FLANN_INDEX_KDTREE_SINGLE)
+        == flann::FLANN_INDEX_LINEAR;
+}
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+class dkn_chunk {
+    /* One piece of a split_DKN: the search for rows [start, end) of query.
+     * Gets its own workspace, since it may run on any thread.
+     */
+    typedef flann::Matrix<typename Distance::ElementType> Matrix;
+
+    Index<Distance> *index;
+    Matrix query;
+    std::vector<int> ks;
+    std::vector<ResultType *> dkns;
+    const flann::SearchParams *search_params;
+    bool take_sqrt;
+
+    public:
+    dkn_chunk(Index<Distance> &index, const Matrix &query,
+              size_t start, size_t end,
+              const int *ks, size_t num_ks, ResultType *const *dkns,
+              const flann::SearchParams &search_params, bool take_sqrt)
+        :
+            index(&index),
+            query(query[start], end - start, query.cols, query.stride),
+            ks(ks, ks + num_ks), dkns(dkns, dkns + num_ks),
+            search_params(&search_params), take_sqrt(take_sqrt)
+    {
+        for (size_t ki = 0; ki < num_ks; ki++)
+            this->dkns[ki] += start;
+    }
+
+    void operator()() const {
+        DKNWorkspace<typename Distance::ResultType> workspace;
+        DKN<Distance, ResultType>(*index, query, &ks[0], ks.size(),
+                                  &dkns[0], workspace, *search_params,
+                                  take_sqrt);
+    }
+};
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+void split_DKN(
+        Index<Distance> &index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        ResultType *dkn,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        int k,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        size_t split_rows,
+        bool take_sqrt)
+{
+    ResultType *dkns[] = { dkn };
+    split_DKN<Distance, ResultType>(index, query, &k, 1, dkns, workspace,
+                                    search_params, pool, split_rows,
+                                    take_sqrt);
+}
+
+template <typename Distance, typename ResultType,
+          template <typename> class Index>
+void split_DKN(
+        Index<Distance> &index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        const int *ks,
+        size_t num_ks,
+        ResultType *const *dkns,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        size_t split_rows,
+        bool take_sqrt)
+{   /* The other threads are usually busy with their own jobs; these chunks
+     * just wait in the pool's queue until one of them is free, and in the
+     * meantime this thread works through them itself. So this mostly helps
+     * at the end of a stage, when there's nothing else left to do.
+     */
+    size_t rows = query.rows;
+    if (split_rows == 0 || rows < split_rows || pool.size() == 1) {
+        DKN<Distance, ResultType>(index, query, ks, num_ks, dkns, workspace,
+                                  search_params, take_sqrt);
+        return;
+    }
+
+    // a few chunks per thread, so they come out about even
+    size_t num_chunks = std::min(4 * pool.size(), rows);
+    size_t chunk_size = (rows + num_chunks - 1) / num_chunks;
+
+    std::vector<boost::function<void ()> > tasks;
+    for (size_t start = 0; start < rows; start += chunk_size) {
+        size_t end = std::min(start + chunk_size, rows);
+        tasks.push_back(dkn_chunk<Distance, ResultType, Index>(
+                    index, query, start, end, ks, num_ks, dkns,
+                    search_params, take_sqrt));
+    }
+    pool.run(tasks);
+}
+
+boost::shared_ptr<ThreadPool> get_thread_pool(const DivParams &params) {
+    if (params.thread_pool)
+        return params.thread_pool;
+    return boost::shared_ptr<ThreadPool>(new ThreadPool(
+                get_num_threads(params.num_threads), params.pin_threads));
+}
+
+void check_ks(const std::vector<int> &ks, const DivParams &params) {
+    for (size_t ki = 0; ki < ks.size(); ki++)
+        if (ks[ki] < 1)
+            BOOST_THROW_EXCEPTION(std::domain_error(
+                        "np_divs: k<1 is nonsensical"));
+
+    if (ks.size() > 1 && !params.knn_store.empty())
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "np_divs: knn_store only supports a single k"));
+}
+
+void prepare_div_funcs(const boost::ptr_vector<DivFunc> &div_funcs,
+                       size_t dim, const std::vector<int> &ks,
+                       boost::ptr_vector<DivFunc> &prepared) {
+    prepared.clear();
+    for (size_t df = 0; df < div_funcs.size(); df++) {
+        prepared.push_back(new_clone(div_funcs[df]));
+        for (size_t ki = 0; ki < ks.size(); ki++)
+            prepared.back().prepare(dim, ks[ki]);
+    }
+}
+
 template <typename T>
 void verify_allocated(
         flann::Matrix<T> *matrices, size_t num_matrices,
@@ -737,28 +1176,188 @@ void verify_allocated(
     }
 }
 
+template <typename Distance, typename ResultType>
+void bag_DKN(
+        BagIndex<Distance> &index,
+        const BagIndex<Distance> &query_index,
+        const flann::Matrix<typename Distance::ElementType> &query,
+        const int *ks,
+        size_t num_ks,
+        ResultType *const *dkns,
+        DKNWorkspace<typename Distance::ResultType> &workspace,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        size_t split_rows,
+        bool take_sqrt)
+{
+    typedef typename Distance::ResultType DistanceType;
+
+    if (!index.searches_bags()) {
+        split_DKN<Distance, ResultType>(index, query, ks, num_ks, dkns,
+                workspace, search_params, pool, split_rows, take_sqrt);
+        return;
+    }
+
+    int k = *std::max_element(ks, ks + num_ks);
+    flann::Matrix<int> indices = workspace.indices(query.rows, k);
+    flann::Matrix<DistanceType> dists = workspace.dists(query.rows, k);
+
+    index.knnSearchBag(query_index, query, indices, dists, k, search_params);
+    copy_dkns(dists, ks, num_ks, dkns, take_sqrt);
+}
+
 template <typename Distance>
-flann::Index<Distance>** make_indices(
+class index_builder : boost::noncopyable {
+    typedef BagIndex<Distance> Index;
+    typedef flann::Matrix<typename Distance::ElementType> Matrix;
+
+    const Matrix *datasets;
+    const flann::IndexParams &index_params;
+    Index **indices;
+
+    const BagCache *cache;
+    std::string *cache_keys;
+
+    JobDispenser &jobs;
+    boost::exception_ptr &error;
+
+    public:
+    index_builder(const Matrix *datasets,
+            const flann::IndexParams &index_params,
+            Index **indices,
+            const BagCache *cache, std::string *cache_keys,
+            JobDispenser &jobs,
+            boost::exception_ptr &error)
+        :
+            datasets(datasets), index_params(index_params),
+            indices(indices), cache(cache), cache_keys(cache_keys),
+            jobs(jobs), error(error)
+        { }
+
+    void operator()() {
+        size_t i, j;
+        try {
+            while (jobs.next(i, j)) {
+                // nobody else touches indices[i], so no need to lock
+                if (cache) {
+                    cache_keys[i] = cache->key(datasets[i]);
+                    flann::Index<Distance> *loaded =
+                        cache->load_index<Distance>(cache_keys[i],
+                                                    datasets[i]);
+                    if (loaded != NULL) {
+                        indices[i] = new FlannBagIndex<Distance>(loaded);
+                        continue;
+                    }
+                }
+
+                indices[i] = build_bag_index<Distance>(
+                        datasets[i], index_params);
+
+                // only flann's indices are worth saving; ours are quick to
+                // build
+                flann::Index<Distance> *flann_idx = indices[i]->flann_index();
+                if (cache && flann_idx != NULL)
+                    cache->save_index(cache_keys[i], *flann_idx);
+            }
+        } catch (...) {
+            error = boost::current_exception();
+
+            // tell other threads not to continue on
+            jobs.abort();
+        }
+    }
+};
+
+template <typename Distance>
+BagIndex<Distance>** make_indices(
         const flann::Matrix<typename Distance::ElementType> *datasets,
         size_t number,
-        const flann::IndexParams index_params)
-{
-    typedef flann::Index<Distance> Index;
+        const flann::IndexParams index_params,
+        ThreadPool &pool,
+        const BagCache *cache,
+        std::string *cache_keys)
+{   /* Builds an index for each of the datasets, spread across the pool's
+     * threads. If any of them fail, frees the ones that were made and
+     * rethrows the exception.
+     *
+     * If cache is passed, indices saved there are loaded rather than built,
+     * and newly built ones are saved.
+     */
+    typedef BagIndex<Distance> Index;
+
+    // calloc to avoid calling constructors, and so that any we don't get to
+    // are NULL
+    Index** indices = (Index**) calloc(number, sizeof(Index*));
+
+    size_t num_threads = std::min(pool.size(), number);
 
-    // malloc to avoid calling constructors
-    Index** indices = (Index**) malloc(sizeof(Index*) * number);
+    JobDispenser jobs(number, 1, false);
 
-    for (size_t i = 0; i < number; i++) {
-        Index* idx = new Index(datasets[i], index_params);
-        idx->buildIndex();
-        indices[i] = idx;
+    boost::ptr_vector<index_builder<Distance> > workers;
+    std::vector<boost::exception_ptr> errors(num_threads);
+    std::vector<boost::function<void ()> > tasks;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        workers.push_back(new index_builder<Distance>(
+                    datasets, index_params, indices, cache, cache_keys,
+                    jobs, errors[i]
+        ));
+        tasks.push_back(boost::ref(workers[i]));
+    }
+
+    pool.run(tasks);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        if (errors[i]) {
+            free_indices(indices, number);
+            boost::rethrow_exception(errors[i]);
+        }
     }
 
     return indices;
 }
 
 template <typename Distance>
-void free_indices(flann::Index<Distance>** indices, size_t n) {
+BagIndex<Distance>** make_indices(
+        const flann::Matrix<typename Distance::ElementType> *datasets,
+        size_t number,
+        const flann::IndexParams index_params,
+        size_t num_threads)
+{
+    ThreadPool pool(num_threads);
+    return make_indices<Distance>(datasets, number, index_params, pool);
+}
+
+template <typename Distance>
+BagIndex<Distance>* build_bag_index(
+        const flann::Matrix<typename Distance::ElementType> &bag,
+        const flann::IndexParams &index_params)
+{
+    const std::string algo = npdivs_algorithm(index_params);
+    if (algo == "auto")
+        return build_bag_index<Distance>(bag,
+                IndexPolicy(index_params).choose(bag.rows, bag.cols));
+    else if (algo == "gemm")
+        return new GemmIndex<Distance>(bag);
+    else if (algo == "dual_tree")
+        return new DualTreeIndex<Distance>(bag);
+    else if (!algo.empty())
+        BOOST_THROW_EXCEPTION(std::domain_error(
+                    "unknown npdivs_algorithm " + algo));
+
+    BagIndex<Distance> *index = new FlannBagIndex<Distance>(
+            new flann::Index<Distance>(bag, index_params));
+    try {
+        index->flann_index()->buildIndex();
+    } catch (...) {
+        delete index;
+        throw;
+    }
+    return index;
+}
+
+template <typename Distance>
+void free_indices(BagIndex<Distance>** indices, size_t n) {
     for (size_t i = 0; i < n; i++)
         delete indices[i];
     free(indices);
@@ -767,69 +1366,101 @@ void free_indices(flann::Index<Distance>** indices, size_t n) {
 
 template <typename Distance>
 class rho_getter : boost::noncopyable {
-    typedef flann::Index<Distance> Index;
-    typedef typename Distance::ResultType Scalar;
-    typedef flann::Matrix<Scalar> Matrix;
+    typedef BagIndex<Distance> Index;
+    typedef flann::Matrix<typename Distance::ElementType> Matrix;
     typedef std::vector<float> DistVec;
+    typedef std::vector<DistVec> DistVecVec;
 
     const Matrix * bags;
     Index ** indices;
-    int k;
+    const std::vector<int> &ks;
     const flann::SearchParams &search_params;
 
-    std::vector<DistVec> &rhos;
-    boost::mutex &rhos_mutex;
+    std::vector<DistVecVec> &rhos;
+
+    const BagCache *cache;
+    const std::string *cache_keys;
 
-    std::queue<size_t> &jobs;
-    boost::mutex &jobs_mutex;
+    JobDispenser &jobs;
+
+    ThreadPool &pool;
+    const size_t split_rows;
 
     boost::exception_ptr &error;
 
+    WorkerStats &stats;
+
+    // each bag's nearest neighbor is itself, so search for one more
+    std::vector<int> search_ks;
+
+    DKNWorkspace<typename Distance::ResultType> workspace;
+    std::vector<float *> rho_ptrs;
+
+    bool load_cached(size_t i) {
+        if (!cache)
+            return false;
+        for (size_t ki = 0; ki < ks.size(); ki++)
+            if (!cache->load_rho(cache_keys[i], bags[i].rows, rhos[i][ki],
+                                 ks[ki]))
+                return false;
+        return true;
+    }
+
     public:
-    rho_getter(const Matrix *bags, Index **indices, int k,
+    rho_getter(const Matrix *bags, Index **indices,
+            const std::vector<int> &ks,
             const flann::SearchParams &search_params,
-            std::vector<DistVec> &rhos, boost::mutex &rhos_mutex,
-            std::queue<size_t> &jobs, boost::mutex &jobs_mutex,
-            boost::exception_ptr &error)
+            std::vector<DistVecVec> &rhos,
+            const BagCache *cache, const std::string *cache_keys,
+            JobDispenser &jobs,
+            ThreadPool &pool, size_t split_rows,
+            boost::exception_ptr &error,
+            WorkerStats &stats)
         :
-            bags(bags), indices(indices), k(k), search_params(search_params),
-            rhos(rhos), rhos_mutex(rhos_mutex),
-            jobs(jobs), jobs_mutex(jobs_mutex),
-            error(error)
-        { }
+            bags(bags), indices(indices), ks(ks),
+            search_params(search_params),
+            rhos(rhos), cache(cache), cache_keys(cache_keys),
+            jobs(jobs), pool(pool), split_rows(split_rows), error(error),
+            stats(stats), search_ks(ks), rho_ptrs(ks.size())
+    {
+        for (size_t ki = 0; ki < ks.size(); ki++)
+            search_ks[ki]++;
+    }
 
     void operator()(){
-        size_t i;
+        size_t i, j;
         try {
-            while (true) {
-                // get a job
-                {
-                    boost::mutex::scoped_lock the_lock(jobs_mutex);
-
-                    if (jobs.size() == 0) return;
-
-                    i = jobs.front();
-                    jobs.pop();
+            while (jobs.next(i, j)) {
+                // rhos is already the right size, and nobody else touches
+                // rhos[i], so there's no need to lock
+                DistVecVec &rho = rhos[i];
+                if (load_cached(i))
+                    continue;
+
+                for (size_t ki = 0; ki < ks.size(); ki++) {
+                    rho[ki].resize(bags[i].rows);
+                    rho_ptrs[ki] = rho[ki].empty() ? NULL : &rho[ki][0];
                 }
+                if (bags[i].rows == 0)
+                    continue; // nothing to search for
 
-                // compute
-                const DistVec &rho = DKN<Distance, float>(
-                        *indices[i], bags[i], k+1, search_params);
+                bag_DKN<Distance, float>(*indices[i], *indices[i], bags[i],
+                        &search_ks[0], ks.size(), &rho_ptrs[0], workspace,
+                        search_params, pool, split_rows, false);
 
-                // write out results
-                {
-                    boost::mutex::scoped_lock the_lock(rhos_mutex);
-                    rhos[i] = rho;
-                }
+                stats.knn_searches++;
+                stats.knn_queries += bags[i].rows;
+                stats.points_searched += indices[i]->size();
+
+                if (cache)
+                    for (size_t ki = 0; ki < ks.size(); ki++)
+                        cache->save_rho(cache_keys[i], rho[ki], ks[ki]);
             }
         } catch (...) {
             error = boost::current_exception();
 
-            {   // clear jobs so other threads don't continue on
-                boost::mutex::scoped_lock the_lock(jobs_mutex);
-                while (!jobs.empty())
-                    jobs.pop();
-            }
+            // tell other threads not to continue on
+            jobs.abort();
         }
     };
 };
@@ -838,50 +1469,132 @@ class rho_getter : boost::noncopyable {
 template <typename Distance>
 std::vector<std::vector<float> > get_rhos(
         const flann::Matrix<typename Distance::ElementType> *bags,
-        flann::Index<Distance> **indices,
+        BagIndex<Distance> **indices,
         size_t n,
         int k,
         const flann::SearchParams &search_params,
-        size_t num_threads)
+        ThreadPool &pool,
+        const BagCache *cache,
+        const std::string *cache_keys,
+        size_t split_rows,
+        DivStats *stats)
+{
+    std::vector<std::vector<std::vector<float> > > all_rhos = get_rhos(
+            bags, indices, n, std::vector<int>(1, k), search_params, pool,
+            cache, cache_keys, split_rows, stats);
+
+    std::vector<std::vector<float> > rhos(n);
+    for (size_t i = 0; i < n; i++)
+        rhos[i].swap(all_rhos[i][0]);
+    return rhos;
+}
+
+template <typename Distance>
+std::vector<std::vector<std::vector<float> > > get_rhos(
+        const flann::Matrix<typename Distance::ElementType> *bags,
+        BagIndex<Distance> **indices,
+        size_t n,
+        const std::vector<int> &ks,
+        const flann::SearchParams &search_params,
+        ThreadPool &pool,
+        const BagCache *cache,
+        const std::string *cache_keys,
+        size_t split_rows,
+        DivStats *stats)
 {
     // TODO - if dimension is small enough, don't thread
 
-    std::vector<std::vector<float> > rhos;
+    std::vector<std::vector<std::vector<float> > > rhos(n,
+            std::vector<std::vector<float> >(ks.size()));
 
-    if (num_threads == 1) {
-        rhos.reserve(n);
-        for (size_t i = 0; i < n; i++)
-            rhos.push_back(DKN<Distance, float>(*indices[i], bags[i], k+1, search_params));
+    size_t num_threads = std::min(pool.size(), n);
 
-    } else {
-        rhos.resize(n);
+    JobDispenser jobs(n, 1, false);
 
-        boost::ptr_vector<rho_getter<Distance> > workers;
-        std::vector<boost::exception_ptr> errors(num_threads);
+    boost::ptr_vector<rho_getter<Distance> > workers;
+    std::vector<boost::exception_ptr> errors(num_threads);
+    std::vector<WorkerStats> worker_stats(num_threads);
+    std::vector<boost::function<void ()> > tasks;
 
-        boost::thread_group worker_threads;
-        boost::mutex rhos_mutex, jobs_mutex;
+    for (size_t i = 0; i < num_threads; i++) {
+        workers.push_back(new rho_getter<Distance>(
+                    bags, indices, ks, search_params, rhos, cache, cache_keys,
+                    jobs, pool, split_rows, errors[i], worker_stats[i]
+        ));
+        tasks.push_back(boost::ref(workers[i]));
+    }
 
-        std::queue<size_t> jobs;
-        for (size_t i = 0; i < n; i++)
-            jobs.push(i);
+    pool.run(tasks);
 
-        for (size_t i = 0; i < num_threads; i++) {
-            workers.push_back(new rho_getter<Distance>(
-                        bags, indices, k, search_params,
-                        rhos, rhos_mutex, jobs, jobs_mutex, errors[i]
-            ));
-            worker_threads.create_thread(boost::ref(workers[i]));
-        }
+    for (size_t i = 0; i < num_threads; i++)
+        if (errors[i])
+            boost::rethrow_exception(errors[i]);
 
-        worker_threads.join_all();
+    if (stats)
         for (size_t i = 0; i < num_threads; i++)
-            if (errors[i])
-                boost::rethrow_exception(errors[i]);
-    }
+            stats->add_worker(worker_stats[i], false);
 
     return rhos;
 }
 
+template <typename Distance>
+std::vector<std::vector<float> > get_rhos(
+        const flann::Matrix<typename Distance::ElementType> *bags,
+        BagIndex<Distance> **indices,
+        size_t n,
+        int k,
+        const flann::SearchParams &search_params,
+        size_t num_threads)
+{
+    ThreadPool pool(num_threads);
+    return get_rhos(bags, indices, n, k, search_params, pool);
+}
+
+template <typename Scalar>
+std::vector<size_t> bag_rows(const flann::Matrix<Scalar> *bags, size_t n) {
+    std::vector<size_t> rows(n);
+    for (size_t i = 0; i < n; i++)
+        rows[i] = bags[i].rows;
+    return rows;
+}
+
+template <typename Distance>
+size_t indices_memory(BagIndex<Distance> **indices, size_t n) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++)
+        bytes += indices[i]->usedMemory();
+    return bytes;
+}
+
+inline size_t rhos_memory(const std::vector<std::vector<float> > &rhos) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < rhos.size(); i++)
+        bytes += rhos[i].capacity() * sizeof(float);
+    return bytes;
+}
+
+inline size_t rhos_memory(
+        const std::vector<std::vector<std::vector<float> > > &rhos) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < rhos.size(); i++)
+        bytes += rhos_memory(rhos[i]);
+    return bytes;
+}
+
+template <typename Distance>
+size_t bags_bytes(
+        const flann::Matrix<typename Distance::ElementType> *bags,
+        BagIndex<Distance> **indices,
+        size_t n)
+{
+    typedef typename Distance::ElementType Scalar;
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++)
+        bytes += bags[i].rows * bags[i].cols * sizeof(Scalar)
+               + indices[i]->usedMemory();
+    return bytes;
+}
+
 } // close namespace
 #endif
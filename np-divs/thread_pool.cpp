@@ -0,0 +1,192 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#include "np-divs/thread_pool.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/version.hpp>
+
+namespace npdivs {
+
+namespace {
+
+size_t resolve_num_threads(size_t num_threads) {
+#if BOOST_VERSION >= 103500
+    if (num_threads == 0)
+        num_threads = boost::thread::hardware_concurrency();
+#endif
+    return num_threads > 0 ? num_threads : 1;
+}
+
+void pin_thread(size_t thread_num) {
+    /* Binds the calling thread to one of the CPUs it's allowed to run on
+     * (as inherited from the process, which taskset or a cgroup may have
+     * restricted), going round them by thread_num. */
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+
+    size_t num_allowed = CPU_COUNT(&allowed);
+    if (num_allowed == 0)
+        return;
+
+    size_t skip = thread_num % num_allowed;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        if (skip-- == 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            return;
+        }
+    }
+#endif
+}
+
+}
+
+ThreadPool::ThreadPool(size_t num_threads_, bool pin_threads_)
+    :
+        num_threads(resolve_num_threads(num_threads_)),
+        pin_threads(pin_threads_),
+        shutting_down(false)
+{
+    // the thread calling run() is the other one
+    for (size_t i = 1; i < num_threads; i++) {
+        boost::thread *t = threads.create_thread(
+                boost::bind(&ThreadPool::work, this, i));
+#ifdef __linux__
+        clockid_t clock;
+        if (pthread_getcpuclockid(t->native_handle(), &clock) == 0)
+            thread_clocks.push_back(clock);
+#else
+        (void) t;
+#endif
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        shutting_down = true;
+    }
+    task_added.notify_all();
+    threads.join_all();
+}
+
+double ThreadPool::cpu_seconds() const {
+    double total = 0;
+    for (size_t i = 0; i < thread_clocks.size(); i++) {
+        struct timespec ts;
+        if (clock_gettime(thread_clocks[i], &ts) == 0)
+            total += ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+    return total;
+}
+
+void ThreadPool::work(size_t thread_num) {
+    if (pin_threads)
+        pin_thread(thread_num);
+
+    boost::mutex::scoped_lock lock(mutex);
+    while (true) {
+        while (tasks.empty() && !shutting_down)
+            task_added.wait(lock);
+
+        if (tasks.empty())
+            return; // must be shutting down
+
+        Task task = tasks.front();
+        tasks.pop_front();
+        do_task(task, lock);
+    }
+}
+
+void ThreadPool::do_task(Task &task, boost::mutex::scoped_lock &lock) {
+    // called with the lock held; releases it while the task runs
+    boost::exception_ptr error;
+
+    lock.unlock();
+    try {
+        task.func();
+    } catch (...) {
+        error = boost::current_exception();
+    }
+    lock.lock();
+
+    if (error && !task.batch->error)
+        task.batch->error = error;
+
+    if (--task.batch->remaining == 0)
+        task_done.notify_all();
+}
+
+void ThreadPool::run(const std::vector< boost::function<void ()> > &batch) {
+    if (batch.empty())
+        return;
+
+    Batch this_batch;
+    this_batch.remaining = batch.size();
+
+    boost::mutex::scoped_lock lock(mutex);
+    for (size_t i = 0; i < batch.size(); i++)
+        tasks.push_back(Task(batch[i], &this_batch));
+    task_added.notify_all();
+
+    // help out until our batch is done, with our own tasks only; once the
+    // pool threads have taken all of those, wait for them to finish
+    while (this_batch.remaining > 0) {
+        std::deque<Task>::iterator it = tasks.begin();
+        while (it != tasks.end() && it->batch != &this_batch)
+            ++it;
+
+        if (it != tasks.end()) {
+            Task task = *it;
+            tasks.erase(it);
+            do_task(task, lock);
+        } else {
+            task_done.wait(lock);
+        }
+    }
+
+    if (this_batch.error)
+        boost::rethrow_exception(this_batch.error);
+}
+
+}
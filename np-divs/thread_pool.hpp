@@ -0,0 +1,116 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Dougal J. Sutherland (dsutherl@cs.cmu.edu).             *
+ * All rights reserved.                                                        *
+ *                                                                             *
+ * Redistribution and use in source and binary forms, with or without          *
+ * modification, are permitted provided that the following conditions are met: *
+ *                                                                             *
+ *     * Redistributions of source code must retain the above copyright        *
+ *       notice, this list of conditions and the following disclaimer.         *
+ *                                                                             *
+ *     * Redistributions in binary form must reproduce the above copyright     *
+ *       notice, this list of conditions and the following disclaimer in the   *
+ *       documentation and/or other materials provided with the distribution.  *
+ *                                                                             *
+ *     * Neither the name of Carnegie Mellon University nor the                *
+ *       names of the contributors may be used to endorse or promote products  *
+ *       derived from this software without specific prior written permission. *
+ *                                                                             *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE   *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE  *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE   *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR         *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF        *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS    *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN     *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)     *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE  *
+ * POSSIBILITY OF SUCH DAMAGE.                                                 *
+ ******************************************************************************/
+#ifndef NPDIVS_THREAD_POOL_HPP_
+#define NPDIVS_THREAD_POOL_HPP_
+#include "np-divs/basics.hpp"
+
+#include <deque>
+#include <vector>
+
+#include <time.h>
+
+#include <boost/exception_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace npdivs {
+
+class ThreadPool : boost::noncopyable {
+    /* A fixed set of threads that run batches of tasks for np_divs.
+     *
+     * Creating one and passing it in DivParams::thread_pool lets repeated
+     * np_divs calls (and all of the phases within a call) share the same
+     * threads, rather than starting and joining new ones each time.
+     *
+     * A pool of size n starts n-1 threads: the thread that calls run() does
+     * its share of the work too, so a pool of size 1 never starts any. That
+     * also means tasks can safely call run() themselves, since the waiting
+     * thread keeps working through its own batch's tasks rather than
+     * blocking on them. It doesn't pick up other batches' tasks, though, so
+     * a quick batch never ends up waiting behind someone else's long task.
+     *
+     * If pin_threads is true, each pool thread is bound to a single CPU out
+     * of those the process may use (currently only on Linux; elsewhere it's
+     * ignored). The thread calling run() is left alone.
+     */
+
+    struct Batch {
+        size_t remaining;
+        boost::exception_ptr error;
+    };
+
+    struct Task {
+        boost::function<void ()> func;
+        Batch *batch;
+        Task(boost::function<void ()> func, Batch *batch)
+            : func(func), batch(batch) { }
+    };
+
+    const size_t num_threads;
+    const bool pin_threads;
+
+    std::deque<Task> tasks;
+    bool shutting_down;
+
+    boost::mutex mutex;
+    boost::condition_variable task_added;
+    boost::condition_variable task_done;
+    boost::thread_group threads;
+    std::vector<clockid_t> thread_clocks; // empty where there aren't any
+
+    void work(size_t thread_num);
+    void do_task(Task &task, boost::mutex::scoped_lock &lock);
+
+    public:
+
+    // 0 threads means boost::thread::hardware_concurrency()
+    explicit ThreadPool(size_t num_threads = 0, bool pin_threads = false);
+    ~ThreadPool();
+
+    // The number of threads that work on a batch, including the caller.
+    size_t size() const { return num_threads; }
+
+    bool pinned() const { return pin_threads; }
+
+    // CPU seconds the pool's own threads have used so far (not counting the
+    // ones calling run()), or 0 where there are no per-thread CPU clocks.
+    double cpu_seconds() const;
+
+    // Runs each of the tasks on some thread in the pool (possibly the
+    // calling one), and returns once they've all finished. If any of them
+    // threw, rethrows one of those exceptions.
+    void run(const std::vector< boost::function<void ()> > &batch);
+};
+
+}
+
+#endif
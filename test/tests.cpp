@@ -31,23 +31,43 @@
 #include "np-divs/basics.hpp"
 #include <gtest/gtest.h>
 
+#include "np-divs/bag_cache.hpp"
+#include "np-divs/div-funcs/div_batch.hpp"
+#include "np-divs/div-funcs/div_alpha.hpp"
 #include "np-divs/div-funcs/div_func.hpp"
+#include "np-divs/div-funcs/from_str.hpp"
 #include "np-divs/div-funcs/div_l2.hpp"
+#include "np-divs/div-funcs/div_linear.hpp"
 #include "np-divs/div-funcs/div_bc.hpp"
 #include "np-divs/div-funcs/div_renyi.hpp"
 #include "np-divs/div-funcs/div_hellinger.hpp"
 #include "np-divs/dkn.hpp"
+#include "np-divs/dual_tree.hpp"
 #include "np-divs/fix_terms.hpp"
 #include "np-divs/gamma.hpp"
+#include "np-divs/gemm_index.hpp"
+#include "np-divs/index_policy.hpp"
+#include "np-divs/job_dispenser.hpp"
+#include "np-divs/kernels.hpp"
+#include "np-divs/knn_store.hpp"
 #include "np-divs/np_divs.hpp"
+#include "np-divs/thread_pool.hpp"
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <limits>
+#include <set>
 #include <string>
 
+#include <unistd.h>
+
 #include <boost/assign/std/vector.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <flann/flann.hpp>
 #include <flann/io/hdf5.h>
@@ -213,6 +233,177 @@ TEST(UtilitiesTest, FixTermsWithInfAndNan) {
     test_fix_terms(terms, expected, .98);
 }
 
+TEST(UtilitiesTest, CappedSum) {
+    // should match adding up what fix_terms leaves, for every kind of cutoff
+    float inf = std::numeric_limits<float>().infinity();
+    float nan = std::numeric_limits<float>().quiet_NaN();
+
+    vector<float> base;
+    base += 0.2346, nan, 0.0160, 1.1949, -1.4867, -0.0240, 3.7520, -0.9096,
+         -0.5122, 0.1069, 0.7500, 9.8975, -0.2494, inf, 1.7697, 0.5379,
+         2.4677, 6.2213, -1.1986, inf, 0.2894;
+
+    vector< vector<float> > cases;
+    cases.push_back(base);
+    cases.push_back(base);
+    cases.back()[4] = -inf;
+    cases.push_back(vector<float>(5, inf));
+    cases.push_back(vector<float>(1, 2.5));
+
+    double ubs[] = { .98, .9, .5, .75, .01, .999, 1, 2 };
+    for (size_t c = 0; c < cases.size(); c++) {
+        for (size_t u = 0; u < sizeof(ubs) / sizeof(ubs[0]); u++) {
+            vector<float> fixed = cases[c];
+            fix_terms(fixed, ubs[u]);
+            double expected = 0;
+            for (size_t i = 0; i < fixed.size(); i++)
+                expected += fixed[i];
+
+            vector<float> terms = cases[c];
+            double got = capped_sum(terms, ubs[u]);
+            EXPECT_EQ(terms.size(), fixed.size());
+            if (std::isinf(expected))
+                EXPECT_EQ(got, expected) << c << " " << ubs[u];
+            else
+                EXPECT_NEAR(got, expected, 1e-5) << c << " " << ubs[u];
+
+            vector<double> dterms(cases[c].begin(), cases[c].end());
+            double mean = capped_mean(dterms, ubs[u]);
+            if (std::isinf(expected))
+                EXPECT_EQ(mean, expected);
+            else
+                EXPECT_NEAR(mean, expected / fixed.size(), 1e-5);
+        }
+    }
+}
+
+TEST(UtilitiesTest, ApproxCap) {
+    vector<double> terms;
+    boost::uint32_t state = 99;
+    for (size_t i = 0; i < 200000; i++) {
+        state = state * 1664525u + 1013904223u;
+        terms.push_back(state / 4294967296.0);
+    }
+
+    // uniform on [0, 1), so the quantile is about p
+    EXPECT_NEAR(approx_quantile(terms, .99), .99, .003);
+    EXPECT_NEAR(approx_quantile(terms, .5), .5, .01);
+
+    // approx is close to exact; auto only switches over for big vectors
+    vector<double> small(terms.begin(), terms.begin() + 50000);
+    vector<double> a = terms, b = terms, c = small, d = small;
+    double exact = capped_sum(a, .9, CAP_EXACT);
+    EXPECT_NEAR(capped_sum(b, .9, CAP_APPROX), exact, exact * 1e-3);
+    EXPECT_EQ(capped_sum(c, .9, CAP_AUTO), capped_sum(d, .9, CAP_EXACT));
+
+    // and fix_terms agrees with capped_sum about it
+    a = terms;
+    b = terms;
+    fix_terms(a, .9, CAP_APPROX);
+    double total = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        total += a[i];
+    EXPECT_NEAR(capped_sum(b, .9, CAP_APPROX), total, total * 1e-12);
+
+    // specs
+    boost::scoped_ptr<DivFunc> df(div_func_from_str("l2:.95:approx"));
+    EXPECT_DOUBLE_EQ(df->get_ub(), .95);
+    EXPECT_EQ(df->get_cap_mode(), CAP_APPROX);
+    boost::scoped_ptr<DivFunc> copy(df->clone());
+    EXPECT_EQ(copy->get_cap_mode(), CAP_APPROX);
+
+    df.reset(div_func_from_str("renyi:.9"));
+    EXPECT_EQ(df->get_cap_mode(), CAP_AUTO);
+    df.reset(div_func_from_str("bc:exact"));
+    EXPECT_DOUBLE_EQ(df->get_ub(), .99);
+    EXPECT_EQ(df->get_cap_mode(), CAP_EXACT);
+
+    boost::ptr_vector<DivFunc> div_funcs;
+    div_funcs_from_str("renyi:.5..0.9:3:.95:approx", div_funcs);
+    ASSERT_EQ(div_funcs.size(), 3u);
+    for (size_t i = 0; i < div_funcs.size(); i++) {
+        EXPECT_DOUBLE_EQ(div_funcs[i].get_ub(), .95);
+        EXPECT_EQ(div_funcs[i].get_cap_mode(), CAP_APPROX);
+    }
+}
+
+TEST(UtilitiesTest, PreparedConstants) {
+    vector<float> rho, nu;
+    boost::uint32_t state = 31337;
+    for (size_t i = 0; i < 40; i++) {
+        state = state * 1664525u + 1013904223u;
+        rho.push_back(.5 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        nu.push_back(.5 + state / 4294967296.0);
+    }
+
+    boost::ptr_vector<DivFunc> div_funcs;
+    div_funcs.push_back(new DivL2());
+    div_funcs.push_back(new DivLinear());
+    div_funcs.push_back(new DivRenyi(.9));
+
+    // preparing just saves the work; it doesn't change the answers
+    for (size_t df = 0; df < div_funcs.size(); df++) {
+        boost::scoped_ptr<DivFunc> prepared(div_funcs[df].clone());
+        prepared->prepare(3, 4);
+        prepared->prepare(3, 2);
+        EXPECT_EQ((*prepared)(rho, nu, rho, nu, 3, 4),
+                  div_funcs[df](rho, nu, rho, nu, 3, 4));
+        EXPECT_EQ((*prepared)(rho, nu, rho, nu, 3, 2),
+                  div_funcs[df](rho, nu, rho, nu, 3, 2));
+    }
+
+    // the constants are in log space, so the gamma functions in them can't
+    // overflow in high dimensions
+    for (size_t i = 0; i < nu.size(); i++)
+        nu[i] = rho[i] * (1 + .01 * (i % 3));
+    double l2 = div_funcs[0](rho, nu, rho, nu, 400, 3);
+    EXPECT_FALSE(std::isnan(l2) || std::isinf(l2));
+}
+
+TEST(UtilitiesTest, SquaredDistances) {
+    vector<float> rho_x, nu_x, rho_y, nu_y;
+    boost::uint32_t state = 2718;
+    for (size_t i = 0; i < 300; i++) {
+        state = state * 1664525u + 1013904223u;
+        rho_x.push_back(.05 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        nu_x.push_back(.05 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        rho_y.push_back(.05 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        nu_y.push_back(.05 + state / 4294967296.0);
+    }
+    vector<float> sq_rho_x(rho_x), sq_nu_x(nu_x), sq_rho_y(rho_y),
+                  sq_nu_y(nu_y);
+    for (size_t i = 0; i < rho_x.size(); i++) {
+        sq_rho_x[i] *= sq_rho_x[i];
+        sq_nu_x[i] *= sq_nu_x[i];
+        sq_rho_y[i] *= sq_rho_y[i];
+        sq_nu_y[i] *= sq_nu_y[i];
+    }
+
+    const char *specs[] = { "l2", "linear", "alpha:.5", "renyi:.9", "bc",
+        "hellinger:.95" };
+    const size_t num_dfs = sizeof(specs) / sizeof(specs[0]);
+    boost::ptr_vector<DivFunc> div_funcs;
+    for (size_t i = 0; i < num_dfs; i++)
+        div_funcs.push_back(div_func_from_str(specs[i]));
+
+    // squared distances should give the same answers, but for rounding and
+    // the cap interpolating between squares
+    DivFuncBatch batch(div_funcs);
+    vector<double> results(num_dfs);
+    batch(sq_rho_x, sq_nu_x, sq_rho_y, sq_nu_y, 3, 3, &results[0], true);
+    for (size_t df = 0; df < num_dfs; df++) {
+        double plain = div_funcs[df](rho_x, nu_x, rho_y, nu_y, 3, 3);
+        double squared = div_funcs[df](sq_rho_x, sq_nu_x, sq_rho_y, sq_nu_y,
+                                       3, 3, true);
+        EXPECT_NEAR(squared, plain, fabs(plain) * 1e-4) << specs[df];
+        EXPECT_EQ(results[df], squared) << specs[df];
+    }
+}
+
 TEST(UtilitiesTest, Gamma) {
     using npdivs::gamma;
 
@@ -265,6 +456,465 @@ TEST(UtilitiesTest, LogGamma) {
 }
 
 
+TEST(UtilitiesTest, JobDispenserTriangular) {
+    // every (i, j) with j <= i should come out exactly once, in order
+    const size_t n = 300;
+    JobDispenser jobs(n, n, true);
+    ASSERT_EQ(jobs.size(), n * (n + 1) / 2);
+
+    size_t i, j;
+    for (size_t e_i = 0; e_i < n; e_i++) {
+        for (size_t e_j = 0; e_j <= e_i; e_j++) {
+            ASSERT_TRUE(jobs.next(i, j));
+            ASSERT_EQ(i, e_i);
+            ASSERT_EQ(j, e_j);
+        }
+    }
+    EXPECT_FALSE(jobs.next(i, j));
+    EXPECT_FALSE(jobs.next(i, j));
+
+    // check decoding out by the end of a big triangle
+    const size_t big = 100000;
+    JobDispenser big_jobs(big, big, true);
+    big_jobs.decode(big_jobs.size() - 1, i, j);
+    EXPECT_EQ(i, big - 1);
+    EXPECT_EQ(j, big - 1);
+    big_jobs.decode(big_jobs.size() - big, i, j);
+    EXPECT_EQ(i, big - 1);
+    EXPECT_EQ(j, 0u);
+}
+
+TEST(UtilitiesTest, JobDispenserRectangular) {
+    JobDispenser jobs(3, 5, false);
+    ASSERT_EQ(jobs.size(), 15u);
+
+    size_t i, j;
+    for (size_t e_i = 0; e_i < 3; e_i++) {
+        for (size_t e_j = 0; e_j < 5; e_j++) {
+            ASSERT_TRUE(jobs.next(i, j));
+            EXPECT_EQ(i, e_i);
+            EXPECT_EQ(j, e_j);
+        }
+    }
+    EXPECT_FALSE(jobs.next(i, j));
+
+    JobDispenser aborted(3, 5, false);
+    ASSERT_TRUE(aborted.next(i, j));
+    aborted.abort();
+    EXPECT_FALSE(aborted.next(i, j));
+}
+
+TEST(UtilitiesTest, JobDispenserTiled) {
+    // every pair should come out exactly once, with each tile's jobs
+    // together, including the ragged tiles at the edges
+    const size_t tile = 4;
+    for (int triangular = 0; triangular < 2; triangular++) {
+        const size_t rows = 11, cols = triangular ? rows : 7;
+        JobDispenser jobs(rows, cols, triangular, 0,
+                          boost::function<void (size_t)>(), tile);
+
+        vector<vector<int> > seen(rows, vector<int>(cols, 0));
+        std::set<std::pair<size_t, size_t> > done_tiles;
+        std::pair<size_t, size_t> cur_tile(0, 0);
+
+        size_t i, j, n = 0;
+        while (jobs.next(i, j)) {
+            ASSERT_LT(i, rows);
+            ASSERT_LT(j, cols);
+            if (triangular) {
+                ASSERT_LE(j, i);
+            }
+            seen[i][j]++;
+            n++;
+
+            std::pair<size_t, size_t> t(i / tile, j / tile);
+            if (t != cur_tile) {
+                done_tiles.insert(cur_tile);
+                ASSERT_EQ(done_tiles.count(t), 0u);
+                cur_tile = t;
+            }
+        }
+        EXPECT_EQ(n, jobs.size());
+
+        for (size_t e_i = 0; e_i < rows; e_i++)
+            for (size_t e_j = 0; e_j < (triangular ? e_i + 1 : cols); e_j++)
+                EXPECT_EQ(seen[e_i][e_j], 1);
+    }
+}
+
+TEST(UtilitiesTest, JobDispenserByCost) {
+    // bag 3 is huge, bag 5 is big, the rest are small; the pairs with bag 3
+    // should come first, and every pair should still come out exactly once
+    const size_t n = 9;
+    vector<size_t> sizes(n, 10);
+    sizes[3] = 100000;
+    sizes[5] = 1000;
+
+    for (size_t tile = 1; tile <= 2; tile++) {
+        JobDispenser jobs(n, n, true, 0,
+                          boost::function<void (size_t)>(), tile);
+        jobs.order_by_cost(sizes, sizes, 3, false);
+
+        vector<vector<int> > seen(n, vector<int>(n, 0));
+        size_t i, j, num = 0, last_with_3 = 0;
+        size_t first_without_3 = n * n, first_small = n * n;
+        while (jobs.next(i, j)) {
+            ASSERT_LE(j, i);
+            seen[i][j]++;
+            if (i == 3 || j == 3)
+                last_with_3 = num;
+            else
+                first_without_3 = std::min(first_without_3, num);
+            if (i != 3 && j != 3 && i != 5 && j != 5)
+                first_small = std::min(first_small, num);
+            num++;
+        }
+        EXPECT_EQ(num, jobs.size());
+        for (size_t e_i = 0; e_i < n; e_i++)
+            for (size_t e_j = 0; e_j <= e_i; e_j++)
+                EXPECT_EQ(seen[e_i][e_j], 1);
+
+        // with tiles, bag 3 shares its tiles with bag 5, the next biggest
+        EXPECT_LT(last_with_3, first_small);
+        if (tile == 1) {
+            EXPECT_LT(last_with_3, first_without_3);
+        }
+    }
+
+    // on a rectangle, the big row's jobs go first
+    vector<size_t> row_sizes(4, 10), col_sizes(3, 10);
+    row_sizes[2] = 5000;
+    JobDispenser rect(4, 3, false);
+    rect.order_by_cost(row_sizes, col_sizes, 3, false);
+    size_t i, j;
+    for (size_t e_j = 0; e_j < 3; e_j++) {
+        ASSERT_TRUE(rect.next(i, j));
+        EXPECT_EQ(i, 2u);
+    }
+}
+
+
+void count_up(boost::atomic<size_t> *counter) { (*counter)++; }
+
+void throw_domain_error() { throw std::domain_error("oops"); }
+
+void run_nested(ThreadPool *pool, boost::atomic<size_t> *counter) {
+    std::vector<boost::function<void ()> > tasks(
+            10, boost::bind(count_up, counter));
+    pool->run(tasks);
+}
+
+TEST(UtilitiesTest, ThreadPool) {
+    ThreadPool pool(4);
+    ASSERT_EQ(pool.size(), 4u);
+
+    // the same pool should handle several batches
+    boost::atomic<size_t> counter(0);
+    for (size_t batch = 0; batch < 5; batch++) {
+        std::vector<boost::function<void ()> > tasks(
+                20, boost::bind(count_up, &counter));
+        pool.run(tasks);
+        EXPECT_EQ(counter, 20 * (batch + 1));
+    }
+
+    // tasks that run their own batches shouldn't deadlock
+    counter = 0;
+    std::vector<boost::function<void ()> > nested(
+            8, boost::bind(run_nested, &pool, &counter));
+    pool.run(nested);
+    EXPECT_EQ(counter, 80u);
+
+    // exceptions come back out of run()
+    std::vector<boost::function<void ()> > throwing(
+            3, boost::bind(count_up, &counter));
+    throwing.push_back(throw_domain_error);
+    EXPECT_THROW(pool.run(throwing), std::domain_error);
+
+    // a pool of one just uses the calling thread
+    ThreadPool single(1);
+    counter = 0;
+    std::vector<boost::function<void ()> > tasks(
+            5, boost::bind(count_up, &counter));
+    single.run(tasks);
+    EXPECT_EQ(counter, 5u);
+
+    // np_divs only pins its own pool's threads if asked to
+    DivParams params(3, flann::LinearIndexParams(), flann::SearchParams(), 2);
+    EXPECT_FALSE(params.pin_threads);
+    EXPECT_FALSE(get_thread_pool(params)->pinned());
+    params.pin_threads = true;
+    EXPECT_TRUE(get_thread_pool(params)->pinned());
+}
+
+TEST(UtilitiesTest, DivFuncBatch) {
+    // the batch should give exactly what each DivFunc gives on its own
+    const char *specs[] = { "alpha:.5", "bc", "hellinger", "renyi:.9",
+        "renyi:.99", "l2", "renyi:.9:.95", "linear", "hellinger:.95" };
+    const size_t num_dfs = sizeof(specs) / sizeof(specs[0]);
+    boost::ptr_vector<DivFunc> div_funcs;
+    for (size_t i = 0; i < num_dfs; i++)
+        div_funcs.push_back(div_func_from_str(specs[i]));
+
+    vector<float> rho_x, nu_x, rho_y, nu_y;
+    boost::uint32_t state = 777;
+    for (size_t i = 0; i < 50; i++) {
+        state = state * 1664525u + 1013904223u;
+        rho_x.push_back(.05 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        nu_x.push_back(.05 + state / 4294967296.0);
+    }
+    for (size_t i = 0; i < 40; i++) {
+        state = state * 1664525u + 1013904223u;
+        rho_y.push_back(.05 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        nu_y.push_back(.05 + state / 4294967296.0);
+    }
+    nu_x[7] = 0; // an infinite ratio, to be capped
+
+    DivFuncBatch batch(div_funcs);
+    EXPECT_EQ(batch.num_ratio_groups(), 2u);
+
+    vector<double> results(num_dfs);
+    batch(rho_x, nu_x, rho_y, nu_y, 2, 3, &results[0]);
+    for (size_t df = 0; df < num_dfs; df++)
+        EXPECT_EQ(results[df], div_funcs[df](rho_x, nu_x, rho_y, nu_y, 2, 3))
+            << specs[df];
+
+    batch(rho_y, nu_y, rho_x, nu_x, 3, 4, &results[0]);
+    for (size_t df = 0; df < num_dfs; df++)
+        EXPECT_EQ(results[df], div_funcs[df](rho_y, nu_y, rho_x, nu_x, 3, 4))
+            << specs[df];
+}
+
+TEST(UtilitiesTest, DivPairs) {
+    // three pairs of bags, all viewing one buffer
+    const size_t sizes[] = { 30, 45, 20 };
+    size_t total = 0;
+    for (size_t b = 0; b < 3; b++)
+        total += 2 * sizes[b];
+    vector<float> buf;
+    boost::uint32_t state = 1618;
+    for (size_t i = 0; i < 2 * total; i++) {
+        state = state * 1664525u + 1013904223u;
+        buf.push_back(.05 + state / 4294967296.0);
+    }
+    buf[3] = 0; // an infinite ratio, to be capped
+
+    vector<DistSpan> rhos, nus;
+    size_t start = 0;
+    for (size_t b = 0; b < 3; b++) {
+        rhos.push_back(DistSpan(&buf[start], sizes[b]));
+        nus.push_back(DistSpan(&buf[start + sizes[b]], sizes[b]));
+        start += 2 * sizes[b];
+    }
+    vector<DivPair> pairs;
+    for (size_t b = 0; b < 3; b++)
+        pairs.push_back(DivPair(rhos[b], nus[b], rhos[(b+1) % 3],
+                                nus[(b+1) % 3]));
+
+    const char *specs[] = { "l2", "linear", "renyi:.9", "bc", "alpha:.5" };
+    const size_t num_dfs = sizeof(specs) / sizeof(specs[0]);
+    boost::ptr_vector<DivFunc> div_funcs;
+    for (size_t i = 0; i < num_dfs; i++)
+        div_funcs.push_back(div_func_from_str(specs[i]));
+
+    // one call for all the pairs gives what a call for each pair would,
+    // and what copying the spans into vectors would
+    vector<double> results(3), batch_results(3 * num_dfs);
+    DivFuncBatch batch(div_funcs);
+    batch(&pairs[0], 3, 3, 3, &batch_results[0]);
+    for (size_t df = 0; df < num_dfs; df++) {
+        div_funcs[df](&pairs[0], 3, 3, 3, &results[0]);
+        for (size_t p = 0; p < 3; p++) {
+            const DivPair &pair = pairs[p];
+            vector<float> rho_x(pair.rho_x.data,
+                                pair.rho_x.data + pair.rho_x.size);
+            vector<float> nu_x(pair.nu_x.data, pair.nu_x.data + pair.nu_x.size);
+            vector<float> rho_y(pair.rho_y.data,
+                                pair.rho_y.data + pair.rho_y.size);
+            vector<float> nu_y(pair.nu_y.data, pair.nu_y.data + pair.nu_y.size);
+
+            double single = div_funcs[df](rho_x, nu_x, rho_y, nu_y, 3, 3);
+            EXPECT_EQ(results[p], single) << specs[df] << " " << p;
+            EXPECT_EQ(batch_results[df * 3 + p], single)
+                << specs[df] << " " << p;
+        }
+    }
+}
+
+TEST(UtilitiesTest, DivAlphaSweep) {
+    boost::ptr_vector<DivFunc> div_funcs;
+    div_funcs_from_str("renyi:.5..0.99:8", div_funcs);
+    div_funcs_from_str("alpha:.2..0.2:1:.9", div_funcs);
+    div_funcs_from_str("bc", div_funcs);
+    ASSERT_EQ(div_funcs.size(), 10u);
+
+    const DivRenyi *first = dynamic_cast<const DivRenyi*>(&div_funcs[0]);
+    const DivRenyi *last = dynamic_cast<const DivRenyi*>(&div_funcs[7]);
+    const DivAlpha *single = dynamic_cast<const DivAlpha*>(&div_funcs[8]);
+    ASSERT_TRUE(first && last && single);
+    EXPECT_DOUBLE_EQ(first->get_alpha(), .5);
+    EXPECT_DOUBLE_EQ(last->get_alpha(), .99);
+    EXPECT_DOUBLE_EQ(single->get_alpha(), .2);
+    EXPECT_DOUBLE_EQ(single->get_ub(), .9);
+
+    EXPECT_THROW(div_func_from_str("renyi:.5..0.99:8"), std::domain_error);
+    EXPECT_THROW(div_funcs_from_str("l2:.5..0.99:8", div_funcs),
+                 std::domain_error);
+
+    // the sweep should match each function on its own
+    vector<float> rho, nu;
+    boost::uint32_t state = 4242;
+    for (size_t i = 0; i < 30; i++) {
+        state = state * 1664525u + 1013904223u;
+        rho.push_back(.05 + state / 4294967296.0);
+        state = state * 1664525u + 1013904223u;
+        nu.push_back(.05 + state / 4294967296.0);
+    }
+
+    DivFuncBatch batch(div_funcs);
+    vector<double> results(div_funcs.size());
+    batch(rho, nu, rho, nu, 3, 3, &results[0]);
+    for (size_t df = 0; df < div_funcs.size(); df++)
+        EXPECT_EQ(results[df], div_funcs[df](rho, nu, rho, nu, 3, 3));
+}
+
+void expect_close_or_same(double got, double expected, double rel_tol) {
+    if (std::isnan(expected))
+        EXPECT_TRUE(std::isnan(got));
+    else if (std::isinf(expected) || expected == 0)
+        EXPECT_EQ(got, expected);
+    else
+        EXPECT_NEAR(got, expected, fabs(expected) * rel_tol);
+}
+
+TEST(UtilitiesTest, Kernels) {
+    // an odd length, to get the vector kernels' tails, and some special values
+    vector<float> x, y;
+    boost::uint32_t state = 1234;
+    for (size_t i = 0; i < 45; i++) {
+        state = state * 1664525u + 1013904223u;
+        x.push_back(exp(20. * (state / 4294967296.0 - .5)));
+        state = state * 1664525u + 1013904223u;
+        y.push_back(.01 + state / 4294967296.0);
+    }
+    x[3] = 0;
+    x[7] = numeric_limits<float>::infinity();
+    x[11] = numeric_limits<float>::denorm_min() * 5;
+    x[12] = 1;
+    x[20] = numeric_limits<float>::quiet_NaN();
+    x[41] = 1e30f;
+    size_t n = x.size();
+
+    vector<float> ratios(n), ratios_ref(n);
+    vector<double> logs(n), logs_ref(n), pows(n), pows_ref(n);
+    vector<double> finite_logs;
+
+    const KernelISA best = get_kernel_isa();
+    set_kernel_isa(KERNELS_SCALAR);
+    divide_floats(&x[0], &y[0], n, &ratios_ref[0]);
+    log_floats(&x[0], n, &logs_ref[0]);
+    pow_floats(&x[0], n, -3., log(2.5), &pows_ref[0]);
+    for (size_t i = 0; i < n; i++)
+        if (!std::isinf(logs_ref[i]) && !std::isnan(logs_ref[i]))
+            finite_logs.push_back(logs_ref[i]);
+    double sum_exp_ref = sum_exp_as_floats(&finite_logs[0],
+                                           finite_logs.size(), 1.7);
+    double sum_ref = sum_doubles(&logs_ref[0], 40);
+
+    // odd numbers of rows, to get the dot products' edge blocks
+    const size_t nx = 5, ny = 7, len = 48;
+    vector<float> xs, ys;
+    for (size_t i = 0; i < (nx + ny) * len; i++) {
+        state = state * 1664525u + 1013904223u;
+        (i < nx * len ? xs : ys).push_back(state / 4294967296.0 - .5);
+    }
+    vector<float> dots(nx * ny);
+    vector<double> dots_ref(nx * ny, 0.);
+    for (size_t i = 0; i < nx; i++)
+        for (size_t j = 0; j < ny; j++)
+            for (size_t d = 0; d < len; d++)
+                dots_ref[i * ny + j] += double(xs[i*len + d]) * ys[j*len + d];
+
+    for (int isa = KERNELS_SCALAR; isa <= KERNELS_AVX512; isa++) {
+        if (!kernel_isa_supported((KernelISA) isa))
+            continue;
+        SCOPED_TRACE(kernel_isa_name((KernelISA) isa));
+        set_kernel_isa((KernelISA) isa);
+
+        divide_floats(&x[0], &y[0], n, &ratios[0]);
+        log_floats(&x[0], n, &logs[0]);
+        pow_floats(&x[0], n, -3., log(2.5), &pows[0]);
+        for (size_t i = 0; i < n; i++) {
+            if (std::isnan(ratios_ref[i]))
+                EXPECT_TRUE(std::isnan(ratios[i]));
+            else
+                EXPECT_EQ(ratios[i], ratios_ref[i]);
+            expect_close_or_same(logs[i], logs_ref[i], 1e-15);
+            expect_close_or_same(pows[i], pows_ref[i], 1e-13);
+        }
+
+        expect_close_or_same(sum_exp_as_floats(&finite_logs[0],
+                    finite_logs.size(), 1.7), sum_exp_ref, 1e-6);
+        expect_close_or_same(sum_doubles(&logs_ref[0], 40), sum_ref, 1e-12);
+
+        dot_products(&xs[0], nx, &ys[0], ny, len, &dots[0]);
+        for (size_t i = 0; i < nx * ny; i++)
+            EXPECT_NEAR(dots[i], dots_ref[i], 1e-5);
+    }
+
+    set_kernel_isa(best);
+    EXPECT_EQ(kernel_isa_from_str(kernel_isa_name(best)), best);
+    EXPECT_THROW(kernel_isa_from_str("mmx"), std::domain_error);
+}
+
+TEST(UtilitiesTest, IndexParamsFromStr) {
+    using flann::get_param;
+
+    IndexParams ps = index_params_from_str("kdforest:trees=8");
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(ps, "algorithm"),
+              flann::FLANN_INDEX_KDTREE);
+    EXPECT_EQ(get_param<int>(ps, "trees"), 8);
+
+    ps = index_params_from_str("kmeans:branching=16:iterations=5"
+                               ":centers_init=kmeanspp");
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(ps, "algorithm"),
+              flann::FLANN_INDEX_KMEANS);
+    EXPECT_EQ(get_param<int>(ps, "branching"), 16);
+    EXPECT_EQ(get_param<int>(ps, "iterations"), 5);
+    EXPECT_EQ(get_param<flann::flann_centers_init_t>(ps, "centers_init"),
+              flann::FLANN_CENTERS_KMEANSPP);
+    EXPECT_FLOAT_EQ(get_param<float>(ps, "cb_index"), 0.2f); // the default
+
+    ps = index_params_from_str("autotuned:precision=0.95");
+    EXPECT_FLOAT_EQ(get_param<float>(ps, "target_precision"), 0.95f);
+
+    ps = index_params_from_str("kdtree");
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(ps, "algorithm"),
+              flann::FLANN_INDEX_KDTREE_SINGLE);
+
+    EXPECT_THROW(index_params_from_str("kdforest:leaves=8"),
+                 std::domain_error);
+    EXPECT_THROW(index_params_from_str("kdforest:trees=many"),
+                 std::domain_error);
+    EXPECT_THROW(index_params_from_str("kmeans:branching"),
+                 std::domain_error);
+    EXPECT_THROW(index_params_from_str("linear:trees=2"), std::domain_error);
+    EXPECT_THROW(index_params_from_str("lsh"), std::domain_error);
+
+    flann::SearchParams sp = search_params_from_str("checks=128,eps=0.1");
+    EXPECT_EQ(sp.checks, 128);
+    EXPECT_FLOAT_EQ(sp.eps, 0.1f);
+    sp = search_params_from_str("eps=0.5", flann::SearchParams(64));
+    EXPECT_EQ(sp.checks, 64);
+    EXPECT_FLOAT_EQ(sp.eps, 0.5f);
+    EXPECT_EQ(search_params_from_str("checks=unlimited").checks,
+              int(flann::FLANN_CHECKS_UNLIMITED));
+    EXPECT_THROW(search_params_from_str("checks=128,leaves=3"),
+                 std::domain_error);
+}
+
+
 class NPDivTest : public ::testing::Test {
     protected:
 
@@ -314,6 +964,537 @@ TEST_F(NPDivTest, DKNTwoD) {
 }
 
 
+TEST_F(NPDivTest, DKNWorkspaceReuse) {
+    float d[] = { -2.999, -5.672,
+                  -9.051, -1.417,
+                   2.066, -0.519,
+                  -0.859, -8.354,
+                   2.159, -0.470,
+                  -5.365, -0.469 };
+    MatrixF dataset(d, 6, 2);
+
+    Index<L2<float> > index(dataset, params.index_params);
+    index.buildIndex();
+
+    // search the whole dataset, then a smaller and a bigger query, through
+    // the same workspace; should match the allocating version every time
+    DKNWorkspace<float> workspace;
+    vector<float> results(6);
+    size_t sizes[] = { 6, 2, 6 };
+    int ks[] = { 3, 2, 4 };
+
+    for (size_t s = 0; s < 3; s++) {
+        MatrixF query(d, sizes[s], 2);
+        vector<float> expected = npdivs::DKN<L2<float>, float>(
+                index, query, ks[s], params.search_params);
+
+        npdivs::DKN(index, query, &results[0], workspace, ks[s],
+                params.search_params);
+
+        for (size_t i = 0; i < sizes[s]; i++)
+            EXPECT_EQ(results[i], expected[i]);
+    }
+}
+
+
+TEST_F(NPDivTest, MakeIndicesThreaded) {
+    float d[] = { -2.999, -5.672,
+                  -9.051, -1.417,
+                   2.066, -0.519,
+                  -0.859, -8.354,
+                   2.159, -0.470,
+                  -5.365, -0.469,
+                   9.829,  2.735,
+                  -7.356, -9.513 };
+    const size_t n = 7;
+    MatrixF datasets[n];
+    for (size_t i = 0; i < n; i++)
+        datasets[i] = MatrixF(d + 2*i, 2, 2);
+
+    ThreadPool pool(3);
+    BagIndex<L2<float> > **indices = make_indices<L2<float> >(
+            datasets, n, params.index_params, pool);
+
+    // each point's nearest neighbor in its own index is itself
+    for (size_t i = 0; i < n; i++) {
+        vector<float> dists = npdivs::DKN(
+                *indices[i], datasets[i], 1, params.search_params);
+        ASSERT_EQ(dists.size(), 2u);
+        EXPECT_EQ(dists[0], 0);
+        EXPECT_EQ(dists[1], 0);
+    }
+    free_indices(indices, n);
+
+    // flann can't do LSH on float data, so this should fail in every thread
+    // and come back out as an exception
+    EXPECT_ANY_THROW(make_indices<L2<float> >(
+                datasets, n, flann::LshIndexParams(), pool));
+}
+
+TEST_F(NPDivTest, SplitDKN) {
+    // points from a fixed lcg; the first 200 are the index, the next 150
+    // the query
+    vector<float> pts;
+    boost::uint32_t state = 4321;
+    for (size_t i = 0; i < 2 * 350; i++) {
+        state = state * 1664525u + 1013904223u;
+        pts.push_back(state / 4294967296.0);
+    }
+    MatrixF data(&pts[0], 200, 2), query(&pts[400], 150, 2);
+
+    Index<L2<float> > index(data, params.index_params);
+    index.buildIndex();
+
+    vector<float> expected = npdivs::DKN(index, query, 3, params.search_params);
+
+    ThreadPool pool(3);
+    DKNWorkspace<float> workspace;
+    for (size_t split = 0; split <= 200; split += 40) {
+        vector<float> dkn(150, -1);
+        split_DKN<L2<float>, float>(index, query, &dkn[0], workspace,
+                                    3, params.search_params, pool, split);
+        for (size_t i = 0; i < 150; i++)
+            ASSERT_EQ(dkn[i], expected[i]) << "split " << split << ", " << i;
+    }
+}
+
+TEST_F(NPDivTest, GemmIndex) {
+    // should find the same neighbors as a linear search, in enough
+    // dimensions to go through several blocks
+    const size_t dim = 70, n = 300, nq = 50;
+    vector<float> pts;
+    boost::uint32_t state = 97531;
+    for (size_t i = 0; i < (n + nq) * dim; i++) {
+        state = state * 1664525u + 1013904223u;
+        pts.push_back(10 + state / 4294967296.0);
+    }
+    MatrixF data(&pts[0], n, dim), query(&pts[n * dim], nq, dim);
+
+    IndexParams gemm_params = index_params_from_str("gemm");
+    EXPECT_EQ(npdivs_algorithm(gemm_params), "gemm");
+    BagIndex<L2<float> > **indices = make_indices<L2<float> >(
+            &data, 1, gemm_params);
+    Index<L2<float> > linear(data, flann::LinearIndexParams());
+    linear.buildIndex();
+
+    const int k = 5;
+    vector<int> idx_buf(nq * k), linear_idx_buf(nq * k);
+    vector<float> dist_buf(nq * k), linear_dist_buf(nq * k);
+    flann::Matrix<int> idx(&idx_buf[0], nq, k);
+    flann::Matrix<int> linear_idx(&linear_idx_buf[0], nq, k);
+    MatrixF dist(&dist_buf[0], nq, k), linear_dist(&linear_dist_buf[0], nq, k);
+
+    indices[0]->knnSearch(query, idx, dist, k, params.search_params);
+    linear.knnSearch(query, linear_idx, linear_dist, k, params.search_params);
+    for (size_t i = 0; i < nq * k; i++) {
+        EXPECT_EQ(idx_buf[i], linear_idx_buf[i]) << i;
+        EXPECT_EQ(dist_buf[i], linear_dist_buf[i]) << i;
+    }
+    free_indices(indices, 1);
+
+    // two clusters far from the mean, with the neighbors nearly tied: the
+    // expansion's error dwarfs the differences, and it should still be exact
+    const size_t far_dim = 40;
+    vector<float> far;
+    for (size_t i = 0; i < (n + nq) * far_dim; i++) {
+        state = state * 1664525u + 1013904223u;
+        float side = (i / far_dim) % 2 ? 500.f : -500.f;
+        far.push_back(side + 1e-3f * (state / 4294967296.f));
+    }
+    MatrixF far_data(&far[0], n, far_dim);
+    MatrixF far_query(&far[n * far_dim], nq, far_dim);
+    GemmIndex<L2<float> > far_index(far_data);
+    Index<L2<float> > far_linear(far_data, flann::LinearIndexParams());
+    far_linear.buildIndex();
+
+    far_linear.knnSearch(far_query, linear_idx, linear_dist, k,
+                         params.search_params);
+    SearchScratch scratch;
+    for (size_t rep = 0; rep < 2; rep++) { // the second reuses scratch
+        far_index.knnSearchWith(far_query, idx, dist, k,
+                                params.search_params, scratch);
+        for (size_t i = 0; i < nq * k; i++) {
+            EXPECT_EQ(idx_buf[i], linear_idx_buf[i]) << rep << ", " << i;
+            EXPECT_EQ(dist_buf[i], linear_dist_buf[i]) << rep << ", " << i;
+        }
+    }
+
+    // a bag smaller than k pads the results out like flann does
+    MatrixF small(&pts[0], 3, dim);
+    GemmIndex<L2<float> > small_index(small);
+    small_index.knnSearch(query, idx, dist, k, params.search_params);
+    EXPECT_GE(idx[0][2], 0);
+    EXPECT_EQ(idx[0][3], -1);
+    EXPECT_EQ(dist[0][4], numeric_limits<float>::infinity());
+
+    EXPECT_THROW(index_params_from_str("gemmm"), std::domain_error);
+}
+
+TEST_F(NPDivTest, AutoIndex) {
+    using flann::get_param;
+
+    IndexPolicy policy(index_params_from_str(
+                "auto:linear_max_rows=100:gemm_min_dim=16:gemm_max_rows=5000"
+                ":trees=4"));
+    EXPECT_EQ(policy.linear_max_rows, 100);
+    EXPECT_EQ(policy.gemm_min_dim, 16);
+    EXPECT_EQ(policy.gemm_max_rows, 5000);
+    EXPECT_EQ(policy.forest_trees, 4);
+    EXPECT_EQ(policy.forest_min_dim, IndexPolicy().forest_min_dim);
+
+    EXPECT_EQ(npdivs_algorithm(policy.choose(1000, 20)), "gemm");
+    EXPECT_EQ(npdivs_algorithm(policy.choose(5000, 20)), "gemm");
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(
+                policy.choose(5001, 20), "algorithm"),
+              flann::FLANN_INDEX_KDTREE); // too big for gemm, so a forest
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(
+                policy.choose(50, 2), "algorithm"), flann::FLANN_INDEX_LINEAR);
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(
+                policy.choose(1000, 2), "algorithm"),
+              flann::FLANN_INDEX_KDTREE_SINGLE);
+    IndexParams forest = policy.choose(1000, 8);
+    EXPECT_EQ(get_param<flann::flann_algorithm_t>(forest, "algorithm"),
+              flann::FLANN_INDEX_KDTREE);
+    EXPECT_EQ(get_param<int>(forest, "trees"), 4);
+
+    // whatever each bag gets, without a forest the searches are exact
+    const size_t sizes[] = { 20, 500, 500 }, dims[] = { 3, 3, 40 };
+    const size_t nq = 30;
+    const int k = 3;
+    IndexParams auto_params = index_params_from_str("auto");
+    for (size_t b = 0; b < 3; b++) {
+        const size_t n = sizes[b], dim = dims[b];
+        vector<float> pts;
+        boost::uint32_t state = 24680 + b;
+        for (size_t i = 0; i < (n + nq) * dim; i++) {
+            state = state * 1664525u + 1013904223u;
+            pts.push_back(state / 4294967296.0);
+        }
+        MatrixF data(&pts[0], n, dim), query(&pts[n * dim], nq, dim);
+
+        BagIndex<L2<float> > **indices = make_indices<L2<float> >(
+                &data, 1, auto_params);
+        Index<L2<float> > linear(data, flann::LinearIndexParams());
+        linear.buildIndex();
+
+        vector<int> idx_buf(nq * k);
+        vector<float> dist_buf(nq * k), linear_dist_buf(nq * k);
+        flann::Matrix<int> idx(&idx_buf[0], nq, k);
+        MatrixF dist(&dist_buf[0], nq, k);
+        MatrixF linear_dist(&linear_dist_buf[0], nq, k);
+
+        indices[0]->knnSearch(query, idx, dist, k, params.search_params);
+        linear.knnSearch(query, idx, linear_dist, k, params.search_params);
+        for (size_t i = 0; i < nq * k; i++)
+            EXPECT_NEAR(dist_buf[i], linear_dist_buf[i], 1e-4) << b << i;
+        free_indices(indices, 1);
+    }
+}
+
+// squared L2 by another name, which a DualTreeIndex can't know to trust
+struct OtherDistance : L2<float> { };
+
+TEST_F(NPDivTest, DualTree) {
+    // a dual-tree search should find the same distances as a linear one, for
+    // another bag and for the bag itself, including repeated points
+    const size_t dim = 3, nx = 300, ny = 250;
+    vector<float> pts;
+    boost::uint32_t state = 8642;
+    for (size_t i = 0; i < (nx + ny) * dim; i++) {
+        state = state * 1664525u + 1013904223u;
+        pts.push_back(state / 4294967296.0);
+    }
+    std::copy(&pts[0], &pts[20 * dim], &pts[40 * dim]);
+    MatrixF x(&pts[0], nx, dim), y(&pts[nx * dim], ny, dim);
+
+    DivParams dual_params = params;
+    dual_params.search_strategy = SEARCH_DUAL_TREE;
+    BagIndex<L2<float> > *x_tree = build_bag_index<L2<float> >(
+            x, dual_params.get_index_params());
+    BagIndex<L2<float> > *y_tree = build_bag_index<L2<float> >(
+            y, dual_params.get_index_params());
+    ASSERT_TRUE(x_tree->searches_bags());
+
+    const int k = 4;
+    const MatrixF *queries[] = { &x, &x, &y };
+    BagIndex<L2<float> > *query_trees[] = { x_tree, x_tree, y_tree };
+    BagIndex<L2<float> > *trees[] = { y_tree, x_tree, x_tree };
+    for (size_t t = 0; t < 3; t++) {
+        const MatrixF &q = *queries[t];
+        const MatrixF &ref = t == 0 ? y : x;
+        Index<L2<float> > linear(ref, flann::LinearIndexParams());
+        linear.buildIndex();
+        vector<float> expected = npdivs::DKN(linear, q, k,
+                                             params.search_params, false);
+
+        vector<int> idx_buf(q.rows * k);
+        vector<float> dist_buf(q.rows * k);
+        flann::Matrix<int> idx(&idx_buf[0], q.rows, k);
+        MatrixF dist(&dist_buf[0], q.rows, k);
+
+        trees[t]->knnSearchBag(*query_trees[t], q, idx, dist, k,
+                               params.search_params);
+        for (size_t i = 0; i < q.rows; i++) {
+            ASSERT_EQ(dist[i][k - 1], expected[i]) << t << ", " << i;
+            EXPECT_EQ(L2<float>()(q[i], ref[idx[i][0]], dim), dist[i][0]);
+        }
+
+        // and the plain per-point search
+        trees[t]->knnSearch(q, idx, dist, k, params.search_params);
+        for (size_t i = 0; i < q.rows; i++)
+            ASSERT_EQ(dist[i][k - 1], expected[i]) << t << ", " << i;
+    }
+    delete x_tree;
+    delete y_tree;
+
+    // np_divs should come out the same either way
+    MatrixD bags[3];
+    vector<double> dpts(pts.begin(), pts.begin() + (nx + ny) * dim);
+    bags[0] = MatrixD(&dpts[0], 200, dim);
+    bags[1] = MatrixD(&dpts[200 * dim], 150, dim);
+    bags[2] = MatrixD(&dpts[350 * dim], 200, dim);
+    DivL2 div_func;
+    flann::Matrix<double> *per_point = alloc_matrix_array<double>(1, 3, 3);
+    flann::Matrix<double> *dual = alloc_matrix_array<double>(1, 3, 3);
+    np_divs(bags, 3, div_func, per_point, params);
+    np_divs(bags, 3, div_func, dual, dual_params);
+    for (size_t i = 0; i < 3; i++)
+        for (size_t j = 0; j < 3; j++)
+            EXPECT_EQ(dual[0][i][j], per_point[0][i][j]) << i << ", " << j;
+    free_matrix_array(per_point, 1);
+    free_matrix_array(dual, 1);
+
+    EXPECT_EQ(search_strategy_from_str("dual-tree"), SEARCH_DUAL_TREE);
+    EXPECT_THROW(search_strategy_from_str("triple-tree"), std::domain_error);
+
+    // its bounds are only right for flann::L2
+    EXPECT_THROW(delete build_bag_index<OtherDistance>(
+                    x, dual_params.get_index_params()),
+                 std::domain_error);
+}
+
+TEST_F(NPDivTest, MultipleKs) {
+    // one run with several ks should match separate runs with each
+    const size_t n = 6;
+    const size_t sizes[n] = { 9, 8, 12, 7, 10, 9 };
+    vector<double> pts;
+    boost::uint32_t state = 2468;
+    for (size_t i = 0; i < 2 * 55; i++) {
+        state = state * 1664525u + 1013904223u;
+        pts.push_back(state / 4294967296.0);
+    }
+    MatrixD bags[n];
+    for (size_t i = 0, off = 0; i < n; off += 2 * sizes[i], i++)
+        bags[i] = MatrixD(&pts[off], sizes[i], 2);
+
+    boost::ptr_vector<DivFunc> div_funcs;
+    div_funcs.push_back(new DivL2());
+    div_funcs.push_back(new DivRenyi(.9));
+    const size_t num_dfs = div_funcs.size();
+
+    vector<int> ks;
+    ks += 5, 2, 3;
+    const size_t num_ks = ks.size();
+
+    // same bags, then the first 2 against the other 4
+    for (int same = 1; same >= 0; same--) {
+        size_t num_x = same ? n : 2, num_y = same ? n : n - 2;
+        const MatrixD *y_bags = same ? NULL : bags + 2;
+
+        flann::Matrix<double>* all =
+            alloc_matrix_array<double>(num_dfs * num_ks, num_x, num_y);
+        params.ks = ks;
+        np_divs(bags, num_x, y_bags, num_y, div_funcs, all, params);
+        params.ks.clear();
+
+        for (size_t ki = 0; ki < num_ks; ki++) {
+            flann::Matrix<double>* one =
+                alloc_matrix_array<double>(num_dfs, num_x, num_y);
+            params.k = ks[ki];
+            np_divs(bags, num_x, y_bags, num_y, div_funcs, one, params);
+
+            for (size_t df = 0; df < num_dfs; df++)
+                for (size_t i = 0; i < num_x; i++)
+                    for (size_t j = 0; j < num_y; j++)
+                        EXPECT_EQ(all[df * num_ks + ki][i][j], one[df][i][j])
+                            << "k " << ks[ki] << ", df " << df;
+
+            free_matrix_array(one, num_dfs);
+        }
+        free_matrix_array(all, num_dfs * num_ks);
+    }
+
+    params.ks = ks;
+    params.knn_store = "/tmp/npdivs-unused-knn";
+    flann::Matrix<double>* results =
+        alloc_matrix_array<double>(num_dfs * num_ks, n, n);
+    EXPECT_THROW(np_divs(bags, n, div_funcs, results, params),
+                 std::domain_error);
+    free_matrix_array(results, num_dfs * num_ks);
+}
+
+TEST_F(NPDivTest, BagCacheRoundTrip) {
+    float d[] = { -2.999, -5.672,
+                  -9.051, -1.417,
+                   2.066, -0.519 };
+    MatrixF bag(d, 3, 2);
+
+    char dir[] = "/tmp/npdivs-cache-XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+
+    BagCache cache(dir, params.index_params, 3, params.search_params);
+    const std::string key = cache.key(bag);
+    EXPECT_EQ(key, cache.key(bag));
+
+    // changing the data or the index should change the key
+    float d2[6];
+    std::copy(d, d + 6, d2);
+    d2[5] += 1;
+    EXPECT_NE(key, cache.key(MatrixF(d2, 3, 2)));
+    EXPECT_NE(key, BagCache(dir, flann::LinearIndexParams(), 3,
+                            params.search_params).key(bag));
+
+    vector<float> rho;
+    EXPECT_FALSE(cache.load_rho(key, bag.rows, rho));
+
+    float r[] = { 1.5, 2.25, 3 };
+    cache.save_rho(key, vector<float>(r, r + 3));
+    ASSERT_TRUE(cache.load_rho(key, bag.rows, rho));
+    ASSERT_EQ(rho.size(), 3u);
+    for (size_t i = 0; i < 3; i++)
+        EXPECT_EQ(rho[i], r[i]);
+
+    // a different row count means a stale or colliding file
+    EXPECT_FALSE(cache.load_rho(key, bag.rows + 1, rho));
+
+    std::remove(cache.rho_path(key).c_str());
+    rmdir(dir);
+}
+
+TEST_F(NPDivTest, KNNStoreRoundTrip) {
+    // 6 bags of 2d points, of varying sizes, from a fixed lcg
+    const size_t n = 6;
+    const size_t sizes[n] = { 5, 8, 6, 7, 5, 9 };
+    vector<double> pts;
+    boost::uint32_t state = 12345;
+    for (size_t i = 0; i < 2 * 40; i++) {
+        state = state * 1664525u + 1013904223u;
+        pts.push_back(state / 4294967296.0);
+    }
+    MatrixD bags[n];
+    for (size_t i = 0, off = 0; i < n; off += 2 * sizes[i], i++)
+        bags[i] = MatrixD(&pts[off], sizes[i], 2);
+
+    boost::ptr_vector<DivFunc> first, second;
+    first.push_back(new DivL2());
+    second.push_back(new DivRenyi(.8));
+    second.push_back(new DivHellinger());
+
+    char path[] = "/tmp/npdivs-knn-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    // same bags, then x/y with the first 2 against the other 4
+    for (int same = 1; same >= 0; same--) {
+        size_t num_x = same ? n : 2, num_y = same ? n : n - 2;
+        const MatrixD *y_bags = same ? NULL : bags + 2;
+
+        flann::Matrix<double>* results =
+            alloc_matrix_array<double>(2, num_x, num_y);
+
+        params.knn_store = path;
+        np_divs(bags, num_x, y_bags, num_y, first, results, params);
+        params.knn_store = "";
+        np_divs(bags, num_x, y_bags, num_y, second, results, params);
+
+        flann::Matrix<double>* stored =
+            alloc_matrix_array<double>(2, num_x, num_y);
+        KNNStore store(path);
+        EXPECT_EQ(store.is_same_bags(), same == 1);
+        EXPECT_EQ(store.k(), params.k);
+        DivStats stats;
+        params.stats = &stats;
+        np_divs_from_store(store, second, stored, params);
+        params.stats = NULL;
+
+        // every pair was a job, and none of them searched
+        size_t jobs = 0;
+        for (size_t t = 0; t < stats.threads.size(); t++)
+            jobs += stats.threads[t].jobs;
+        EXPECT_EQ(jobs, same ? n * (n + 1) / 2 : num_x * num_y);
+        EXPECT_EQ(stats.knn_searches, 0u);
+
+        for (size_t df = 0; df < 2; df++)
+            for (size_t i = 0; i < num_x; i++)
+                for (size_t j = 0; j < num_y; j++)
+                    EXPECT_EQ(results[df][i][j], stored[df][i][j]);
+
+        free_matrix_array(results, 2);
+        free_matrix_array(stored, 2);
+    }
+
+    // a store that was never finished shouldn't open
+    {
+        std::vector<size_t> rows(2, 3);
+        KNNStore unfinished(path, 2, 3, rows);
+    }
+    EXPECT_THROW(KNNStore store(path), std::runtime_error);
+
+    std::remove(path);
+}
+
+TEST_F(NPDivTest, DivStats) {
+    const size_t n = 6;
+    const size_t sizes[n] = { 5, 8, 6, 7, 5, 9 };
+    const size_t total_points = 40;
+    vector<double> pts;
+    boost::uint32_t state = 54321;
+    for (size_t i = 0; i < 2 * total_points; i++) {
+        state = state * 1664525u + 1013904223u;
+        pts.push_back(state / 4294967296.0);
+    }
+    MatrixD bags[n];
+    for (size_t i = 0, off = 0; i < n; off += 2 * sizes[i], i++)
+        bags[i] = MatrixD(&pts[off], sizes[i], 2);
+
+    boost::ptr_vector<DivFunc> div_funcs;
+    div_funcs.push_back(new DivL2());
+    flann::Matrix<double>* results = alloc_matrix_array<double>(1, n, n);
+
+    DivStats stats;
+    params.stats = &stats;
+    params.thread_pool.reset(new ThreadPool(2));
+    np_divs(bags, n, div_funcs, results, params);
+    free_matrix_array(results, 1);
+
+    // one search of each bag for rho, one to itself, and one per other bag;
+    // each bag is a query n + 1 times
+    EXPECT_EQ(stats.knn_searches, n + n * n);
+    EXPECT_EQ(stats.knn_queries, (n + 1) * total_points);
+
+    ASSERT_EQ(stats.threads.size(), 2u);
+    size_t jobs = 0;
+    for (size_t i = 0; i < stats.threads.size(); i++) {
+        jobs += stats.threads[i].jobs;
+        EXPECT_GE(stats.threads[i].idle_seconds, 0);
+    }
+    EXPECT_EQ(jobs, n * (n + 1) / 2);
+
+    EXPECT_GE(stats.total.wall_seconds, stats.pairs.wall_seconds);
+    EXPECT_GE(stats.pairs.wall_seconds, 0);
+    EXPECT_EQ(stats.rho_bytes, total_points * sizeof(float));
+    EXPECT_EQ(stats.bytes_allocated(),
+              stats.index_bytes + stats.rho_bytes + stats.scratch_bytes);
+
+    // running again shouldn't accumulate
+    results = alloc_matrix_array<double>(1, n, n);
+    np_divs(bags, n, div_funcs, results, params);
+    free_matrix_array(results, 1);
+    EXPECT_EQ(stats.knn_searches, n + n * n);
+}
+
+
 class NPDivDataTest : public NPDivTest {
     typedef NPDivTest super;
 
@@ -427,6 +1608,13 @@ TEST_F(Gaussians2DTest, OneToTwoOneThread)   { test_one_to_two(1); }
 TEST_F(Gaussians2DTest, OneToTwoTwoThreads)  { test_one_to_two(2); }
 TEST_F(Gaussians2DTest, OneToTwoManyThreads) { test_one_to_two(50); }
 
+TEST_F(Gaussians2DTest, SharedThreadPool) {
+    params.thread_pool.reset(new ThreadPool(3));
+    test_to_self();
+    test_one_to_two();
+    test_to_self();
+}
+
 
 class Gaussians50DTest : public NPDivDataTest {
     typedef NPDivDataTest super;